@@ -0,0 +1,73 @@
+#include <cstdio>
+
+#include "ivox3d/ivox3d.h"
+#include "syntheticMap.hpp"
+
+/**
+ * LINKED vs FLAT voxel container: points inserted in scan sized batches, then 5-NN queries within 1 m, for two
+ * resolutions and a capacity that evicts voxels or not. Best of 3 runs, the checksum has to match between containers.
+ */
+template <faster_lio::IVoxGridType grid_type>
+void run( const char* name, const bench::PointVector& points, const bench::PointVector& queries, float resolution, std::size_t capacity )
+{
+  using IVoxType = faster_lio::IVox<3, faster_lio::IVoxNodeType::DEFAULT, bench::PointType, grid_type>;
+
+  for ( typename IVoxType::NearbyType nearby : { IVoxType::NearbyType::NEARBY6, IVoxType::NearbyType::NEARBY18, IVoxType::NearbyType::NEARBY26 } )
+  {
+    typename IVoxType::Options options;
+    options.resolution_  = resolution;
+    options.capacity_    = capacity;
+    options.nearby_type_ = nearby;
+
+    double      insertMs = 1e18;
+    double      queryMs  = 1e18;
+    double      checksum = 0;
+    std::size_t numGrids = 0;
+    for ( int run = 0; run < 3; ++run )
+    {
+      IVoxType iVox( options );
+      insertMs = std::min( insertMs, bench::timeMs( [ & ]() {
+                           // 2000 points a batch, as the keyframes of the mapping
+                           for ( std::size_t begin = 0; begin < points.size(); begin += 2000 )
+                           {
+                             typename IVoxType::PointVector batch( points.begin() + begin, points.begin() + std::min( points.size(), begin + 2000 ) );
+                             iVox.AddPoints( batch );
+                           }
+                         } ) );
+
+      typename IVoxType::PointVector closest;
+      checksum = 0;
+      queryMs  = std::min( queryMs, bench::timeMs( [ & ]() {
+                            for ( const bench::PointType& query : queries )
+                            {
+                              iVox.GetClosestPoint( query, closest, 5, 1.0 );
+                              for ( std::size_t j = 0; j < closest.size(); ++j )
+                              {
+                                checksum += closest[ j ].x * ( j + 1 ) + closest[ j ].intensity * 1e-3 * ( j + 1 ) + closest[ j ].y;
+                              }
+                            }
+                          } ) );
+      numGrids = iVox.NumValidGrids();
+    }
+
+    const int nearbyNum = nearby == IVoxType::NearbyType::NEARBY6 ? 6 : nearby == IVoxType::NearbyType::NEARBY18 ? 18 : 26;
+    std::printf( "%s  res %.1f  cap %7zu  NEARBY%-2d  insert %6.1f ns/point  query %7.1f ns  voxels %zu  checksum %.6f\n", name, resolution, capacity, nearbyNum,
+                 insertMs * 1e6 / points.size(), queryMs * 1e6 / queries.size(), numGrids, checksum );
+  }
+}
+
+int main()
+{
+  bench::PointVector points  = bench::wallsAndGround( 300000, 60.0f );
+  bench::PointVector queries = bench::queriesNear( points, 100000, 0.05f );
+
+  for ( float resolution : { 0.5f, 1.0f } )
+  {
+    for ( std::size_t capacity : { std::size_t( 10000 ), std::size_t( 1000000 ) } )
+    {
+      run<faster_lio::IVoxGridType::LINKED>( "linked", points, queries, resolution, capacity );
+      run<faster_lio::IVoxGridType::FLAT>( "flat  ", points, queries, resolution, capacity );
+    }
+  }
+  return 0;
+}
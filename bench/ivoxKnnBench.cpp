@@ -0,0 +1,56 @@
+#include <cstdio>
+
+#include "ivox3d/ivox3d.h"
+#include "syntheticMap.hpp"
+
+/**
+ * 5-NN queries within 1 m on 1 m voxels for each nearby type, on a small and a large map. Prints the time per query
+ * and a checksum that depends on the order of the neighbours, so two builds can be checked to return the same points.
+ */
+using IVoxType = faster_lio::IVox<3, faster_lio::IVoxNodeType::DEFAULT, bench::PointType>;
+
+int main()
+{
+  const int numQueries = 100000;
+
+  for ( int numPoints : { 60000, 400000 } )
+  {
+    bench::PointVector points  = bench::wallsAndGround( numPoints, 30.0f );
+    bench::PointVector queries = bench::queriesNear( points, numQueries, 0.05f );
+
+    for ( IVoxType::NearbyType nearby : { IVoxType::NearbyType::NEARBY6, IVoxType::NearbyType::NEARBY18, IVoxType::NearbyType::NEARBY26 } )
+    {
+      IVoxType::Options options;
+      options.resolution_  = 1.0;
+      options.capacity_    = 1000000;
+      options.nearby_type_ = nearby;
+      IVoxType iVox( options );
+      iVox.AddPoints( points );
+
+      IVoxType::PointVector closest;
+      double                best     = 1e18;
+      double                checksum = 0;
+      long                  numFound = 0;
+      for ( int run = 0; run < 3; ++run )
+      {
+        checksum = 0;
+        numFound = 0;
+        best     = std::min( best, bench::timeMs( [ & ]() {
+                       for ( const bench::PointType& query : queries )
+                       {
+                         iVox.GetClosestPoint( query, closest, 5, 1.0 );
+                         for ( std::size_t j = 0; j < closest.size(); ++j )
+                         {
+                           checksum += closest[ j ].x * ( j + 1 ) + closest[ j ].intensity * 1e-3 * ( j + 1 ) + closest[ j ].y;
+                         }
+                         numFound += closest.size();
+                       }
+                     } ) );
+      }
+
+      const int nearbyNum = nearby == IVoxType::NearbyType::NEARBY6 ? 6 : nearby == IVoxType::NearbyType::NEARBY18 ? 18 : 26;
+      std::printf( "%6d points  NEARBY%-2d  %8.1f ns/query  found %ld  checksum %.9f\n", numPoints, nearbyNum, best * 1e6 / numQueries, numFound, checksum );
+    }
+  }
+  return 0;
+}
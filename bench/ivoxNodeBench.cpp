@@ -0,0 +1,82 @@
+#include <malloc.h>
+
+#include <algorithm>
+#include <cstdio>
+
+#include "ivox3d/ivox3d.h"
+#include "syntheticMap.hpp"
+
+/**
+ * Memory, build time and 5-NN query time of the node types on the synthetic street map, NEARBY6 on the FLAT grid,
+ * without and with the voxel moments of GetClosestFit (Options::fit_). The mean distance to the neighbours found shows
+ * how approximate a node type is (PHC walks K sub cubes only).
+ */
+using IVoxBaseType = faster_lio::IVoxBase<3, bench::PointType>;
+
+/// bytes allocated on the heap
+static std::size_t heapBytes()
+{
+#if defined( __GLIBC__ ) && ( __GLIBC__ > 2 || ( __GLIBC__ == 2 && __GLIBC_MINOR__ >= 33 ) )
+  struct mallinfo2 info = mallinfo2();
+#else
+  struct mallinfo info = mallinfo();
+#endif
+  return std::size_t( info.uordblks ) + std::size_t( info.hblkhd );
+}
+
+int main()
+{
+  bench::PointVector points  = bench::street();
+  bench::PointVector queries = bench::queriesNear( points, 50000, 0.15f );
+  std::printf( "map %zu points, %zu queries\n", points.size(), queries.size() );
+
+  const char* names[] = { "DEFAULT  ", "PHC      ", "QUANTIZED" };
+  for ( faster_lio::IVoxNodeType nodeType : { faster_lio::IVoxNodeType::DEFAULT, faster_lio::IVoxNodeType::PHC, faster_lio::IVoxNodeType::QUANTIZED } )
+  {
+    for ( bool fit : { false, true } )
+    {
+      for ( float resolution : { 1.0f, 0.5f } )
+      {
+        IVoxBaseType::Options options;
+        options.resolution_  = resolution;
+        options.nearby_type_ = IVoxBaseType::NearbyType::NEARBY6;
+        options.fit_         = fit;
+
+        // best of 3 builds, the first one also pays for the page faults
+        std::shared_ptr<IVoxBaseType> iVox;
+        std::size_t                   bytes   = 0;
+        double                        buildMs = 1e30;
+        for ( int run = 0; run < 3; ++run )
+        {
+          iVox.reset();
+          const std::size_t heapBefore = heapBytes();
+          buildMs                      = std::min( buildMs, bench::timeMs( [ & ]() {
+            iVox = faster_lio::MakeIVox<3, bench::PointType, faster_lio::IVoxGridType::FLAT>( nodeType, options );
+            iVox->AddPoints( points );
+          } ) );
+          bytes = heapBytes() - heapBefore;
+        }
+
+        IVoxBaseType::PointVector closest;
+        double                    distSum  = 0;
+        std::size_t               numFound = 0;
+        const double              queryMs  = bench::timeMs( [ & ]() {
+          for ( const bench::PointType& query : queries )
+          {
+            iVox->GetClosestPoint( query, closest, 5, 1.0 );
+            for ( const bench::PointType& point : closest )
+            {
+              distSum += ( point.getVector3fMap() - query.getVector3fMap() ).norm();
+            }
+            numFound += closest.size();
+          }
+        } );
+
+        std::printf( "%s  fit %-3s  res %.1f  stored %zu  voxels %6zu  %6.1f bytes/point  %5.0f bytes/voxel  build %5.1f ms  knn5 %6.2f us  mean nn dist %.3f\n",
+                     names[ int( nodeType ) ], fit ? "on" : "off", resolution, iVox->NumPoints(), iVox->NumValidGrids(), double( bytes ) / points.size(),
+                     double( bytes ) / iVox->NumValidGrids(), buildMs, queryMs * 1e3 / queries.size(), numFound > 0 ? distSum / numFound : 0.0 );
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <pcl/point_types.h>
+
+#include <Eigen/Core>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <vector>
+
+/**
+ * Synthetic point maps for the iVox benchmarks, there is no recorded map in the tree. Everything is seeded, so
+ * two runs (or two builds being compared) see the same points and queries.
+ */
+namespace bench
+{
+using PointType   = pcl::PointXYZI;
+using PointVector = std::vector<PointType, Eigen::aligned_allocator<PointType>>;
+
+/// ground plane and walls every 10 m in both directions within +-halfSize, the intensity is the point index
+inline PointVector wallsAndGround( int num, float halfSize, unsigned seed = 1 )
+{
+  std::mt19937                          rng( seed );
+  std::uniform_real_distribution<float> uniform( -halfSize, halfSize );
+  std::uniform_real_distribution<float> noise( -0.05f, 0.05f );
+
+  PointVector points;
+  points.reserve( num );
+  for ( int i = 0; i < num; ++i )
+  {
+    PointType point;
+    float     a = uniform( rng );
+    float     b = uniform( rng );
+    if ( i % 3 == 0 )
+    {
+      point.x = a;
+      point.y = b;
+      point.z = noise( rng );
+    }
+    else if ( i % 3 == 1 )
+    {
+      point.x = a;
+      point.y = std::round( b / 10 ) * 10 + noise( rng );
+      point.z = std::abs( b ) * 0.1f;
+    }
+    else
+    {
+      point.x = std::round( a / 10 ) * 10 + noise( rng );
+      point.y = b;
+      point.z = std::abs( a ) * 0.1f;
+    }
+    point.intensity = i;
+    points.push_back( point );
+  }
+  return points;
+}
+
+/// 200 m street: ground, a facade on each side and poles every 10 m, on a 0.2 m lattice with 1 cm noise like downsampled scans
+inline PointVector street( unsigned seed = 5 )
+{
+  std::mt19937                    rng( seed );
+  std::normal_distribution<float> noise( 0, 0.01f );
+
+  PointVector points;
+  for ( float x = -100; x < 100; x += 0.2f )
+  {
+    for ( float y = -10; y < 10; y += 0.2f )
+    {
+      PointType point;
+      point.x = x + noise( rng );
+      point.y = y + noise( rng );
+      point.z = noise( rng );
+      points.push_back( point );
+    }
+  }
+  for ( float x = -100; x < 100; x += 0.2f )
+  {
+    for ( float z = 0; z < 8; z += 0.2f )
+    {
+      for ( float y : { -10.0f, 10.0f } )
+      {
+        PointType point;
+        point.x = x + noise( rng );
+        point.y = y + noise( rng );
+        point.z = z + noise( rng );
+        points.push_back( point );
+      }
+    }
+  }
+  for ( float x = -95; x < 100; x += 10 )
+  {
+    for ( float z = 0; z < 6; z += 0.1f )
+    {
+      for ( int k = 0; k < 8; ++k )
+      {
+        PointType point;
+        point.x = x + 0.15f * std::cos( k * 0.785f );
+        point.y = -7 + 0.15f * std::sin( k * 0.785f );
+        point.z = z;
+        points.push_back( point );
+      }
+    }
+  }
+  return points;
+}
+
+/// map points moved by up to noise on each axis, as the features of a new scan
+inline PointVector queriesNear( const PointVector& points, int num, float noise, unsigned seed = 2 )
+{
+  std::mt19937                          rng( seed );
+  std::uniform_real_distribution<float> offset( -noise, noise );
+
+  PointVector queries;
+  queries.reserve( num );
+  for ( int i = 0; i < num; ++i )
+  {
+    PointType query = points[ ( std::size_t( i ) * 7919 ) % points.size() ];
+    query.x += offset( rng );
+    query.y += offset( rng );
+    query.z += offset( rng );
+    queries.push_back( query );
+  }
+  return queries;
+}
+
+/// wall time of func in ms
+template <typename F>
+double timeMs( F&& func )
+{
+  auto start = std::chrono::steady_clock::now();
+  func();
+  return std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+}
+}  // namespace bench
@@ -0,0 +1,484 @@
+#pragma once
+
+#include <Eigen/Core>
+#include <Eigen/StdVector>
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <queue>
+#include <utility>
+#include <vector>
+
+namespace lio_sam
+{
+/**
+ * incremental kd-tree after ikd-Tree (Cai et al., 2021): points are inserted and deleted by box in place, and a
+ * subtree is rebuilt only once it got unbalanced or mostly deleted. Deleted points are only flagged and dropped by
+ * the next rebuild of their subtree, a subtree whose points all fall into a deleted box is freed right away.
+ * The queries are const and may run concurrently, the updates must not run concurrently with anything.
+ */
+template <typename PointType>
+class IkdTree
+{
+public:
+  using PointVector = std::vector<PointType, Eigen::aligned_allocator<PointType>>;
+
+  struct Options
+  {
+    float balance_ratio    = 0.7;  // a subtree is rebuilt once one child holds more than this share of it
+    float delete_ratio     = 0.5;  // or once more than this share of it is deleted
+    int   min_rebuild_size = 16;   // smaller subtrees are left as they are
+  };
+
+  struct Stats
+  {
+    std::size_t rebuilds_       = 0;
+    std::size_t rebuilt_points_ = 0;  // points moved by the rebuilds, the cost of keeping the tree balanced
+    std::size_t deleted_points_ = 0;
+  };
+
+  IkdTree() = default;
+  explicit IkdTree( const Options& options ) : options_( options ) {}
+
+  /// replace the content with points, balanced
+  void Build( const PointVector& points );
+
+  /**
+   * insert the points one by one. With downsample_size > 0 a point is dropped if the tree already holds one in the
+   * same cube of that side (cubes aligned on multiples of the side), which keeps the density of a voxel filter
+   * @return the number of inserted points
+   */
+  std::size_t AddPoints( const PointVector& points, const float downsample_size = 0 );
+
+  /// delete the points inside the axis aligned box [min, max], returns the number of deleted points
+  std::size_t DeleteBox( const Eigen::Vector3f& min, const Eigen::Vector3f& max );
+
+  /// up to k nearest points closer than sqrt(max_dist2), closest first, with their squared distances
+  void NearestSearch( const PointType& point, const int k, PointVector& nearest, std::vector<float>& sq_dists,
+                      const float max_dist2 = std::numeric_limits<float>::max() ) const;
+
+  /// the points closer than radius, closest first, with their squared distances
+  void RadiusSearch( const PointType& point, const float radius, PointVector& points, std::vector<float>& sq_dists ) const;
+
+  /// append the points inside the axis aligned box [min, max]
+  void BoxSearch( const Eigen::Vector3f& min, const Eigen::Vector3f& max, PointVector& points ) const;
+
+  void Clear() { root_.reset(); }
+
+  /// number of points, the deleted ones waiting for a rebuild are not counted
+  std::size_t Size() const { return root_ ? root_->size - root_->invalid : 0; }
+
+  /// number of nodes, with the deleted ones
+  std::size_t NumNodes() const { return root_ ? root_->size : 0; }
+
+  const Stats& GetStats() const { return stats_; }
+
+private:
+  struct Node
+  {
+    PointType             point;
+    std::unique_ptr<Node> left;
+    std::unique_ptr<Node> right;
+    Eigen::Vector3f       min;          // bounding box of the points of the subtree that are not deleted
+    Eigen::Vector3f       max;
+    int                   axis    = 0;  // split axis
+    int                   size    = 1;  // nodes of the subtree
+    int                   invalid = 0;  // deleted nodes of the subtree
+    bool                  deleted = false;
+  };
+
+  using NodePtr = std::unique_ptr<Node>;
+
+  static inline float Coord( const PointType& pt, const int axis ) { return pt.data[ axis ]; }
+
+  static inline bool Disjoint( const Node& node, const Eigen::Vector3f& min, const Eigen::Vector3f& max )
+  {
+    return ( node.min.array() > max.array() ).any() || ( node.max.array() < min.array() ).any();
+  }
+
+  static inline bool Inside( const PointType& pt, const Eigen::Vector3f& min, const Eigen::Vector3f& max )
+  {
+    return pt.x >= min.x() && pt.x <= max.x() && pt.y >= min.y() && pt.y <= max.y() && pt.z >= min.z() && pt.z <= max.z();
+  }
+
+  /// squared distance from pt to the bounding box of node, 0 inside
+  static inline float BoxDistance2( const Node& node, const PointType& pt )
+  {
+    float d = 0;
+    for ( int i = 0; i < 3; ++i )
+    {
+      float v = Coord( pt, i );
+      float e = std::max( { node.min[ i ] - v, v - node.max[ i ], 0.0f } );
+      d += e * e;
+    }
+    return d;
+  }
+
+  /// counts and bounding box from the node and its children
+  static void Update( Node& node );
+
+  /// balanced tree of points[begin, end), the range is reordered
+  static NodePtr BuildTree( PointVector& points, const std::size_t begin, const std::size_t end );
+
+  /**
+   * queue node for a rebuild if it broke the balance or delete criterion. Called bottom up, mark is the queue size
+   * when the node was entered, the subtrees of node queued since then are dropped as they are rebuilt with it
+   */
+  void CheckRebuild( NodePtr& node, const std::size_t mark );
+
+  /// rebuild the subtrees queued by CheckRebuild, disjoint by construction
+  void RebuildPending();
+
+  void Insert( NodePtr& node, const PointType& pt, const int axis );
+
+  std::size_t DeleteBox( NodePtr& node, const Eigen::Vector3f& min, const Eigen::Vector3f& max );
+
+  bool HasPointIn( const Node* node, const Eigen::Vector3f& min, const Eigen::Vector3f& max ) const;
+
+  using Heap = std::priority_queue<std::pair<float, const Node*>>;
+
+  void Search( const Node* node, const PointType& pt, const int k, const float max_dist2, Heap& heap ) const;
+
+  void RadiusSearch( const Node* node, const PointType& pt, const float radius2,
+                     std::vector<std::pair<float, const Node*>>& found ) const;
+
+  void BoxSearch( const Node* node, const Eigen::Vector3f& min, const Eigen::Vector3f& max, PointVector& points ) const;
+
+  static void Flatten( const Node* node, PointVector& points );
+
+  Options               options_;
+  Stats                 stats_;
+  NodePtr               root_;
+  std::vector<NodePtr*> rebuild_;
+  PointVector           rebuild_points_;  // kept to avoid reallocating at each rebuild
+};
+
+template <typename PointType>
+void IkdTree<PointType>::Update( Node& node )
+{
+  node.size    = 1;
+  node.invalid = node.deleted ? 1 : 0;
+  node.min.setConstant( std::numeric_limits<float>::max() );
+  node.max.setConstant( std::numeric_limits<float>::lowest() );
+  if ( !node.deleted )
+  {
+    node.min = node.min.cwiseMin( node.point.getVector3fMap() );
+    node.max = node.max.cwiseMax( node.point.getVector3fMap() );
+  }
+  for ( const NodePtr* child : { &node.left, &node.right } )
+  {
+    if ( !*child )
+    {
+      continue;
+    }
+    node.size += ( *child )->size;
+    node.invalid += ( *child )->invalid;
+    if ( ( *child )->invalid < ( *child )->size )
+    {
+      node.min = node.min.cwiseMin( ( *child )->min );
+      node.max = node.max.cwiseMax( ( *child )->max );
+    }
+  }
+}
+
+template <typename PointType>
+typename IkdTree<PointType>::NodePtr IkdTree<PointType>::BuildTree( PointVector& points, const std::size_t begin,
+                                                                    const std::size_t end )
+{
+  if ( begin >= end )
+  {
+    return nullptr;
+  }
+
+  // split along the longest side at the median
+  Eigen::Vector3f min = points[ begin ].getVector3fMap();
+  Eigen::Vector3f max = min;
+  for ( std::size_t i = begin + 1; i < end; ++i )
+  {
+    min = min.cwiseMin( points[ i ].getVector3fMap() );
+    max = max.cwiseMax( points[ i ].getVector3fMap() );
+  }
+  int axis;
+  ( max - min ).maxCoeff( &axis );
+
+  std::size_t mid = begin + ( end - begin ) / 2;
+  std::nth_element( points.begin() + begin, points.begin() + mid, points.begin() + end,
+                    [ axis ]( const PointType& a, const PointType& b ) { return Coord( a, axis ) < Coord( b, axis ); } );
+
+  NodePtr node( new Node() );
+  node->point = points[ mid ];
+  node->axis  = axis;
+  node->left  = BuildTree( points, begin, mid );
+  node->right = BuildTree( points, mid + 1, end );
+  Update( *node );
+  return node;
+}
+
+template <typename PointType>
+void IkdTree<PointType>::CheckRebuild( NodePtr& node, const std::size_t mark )
+{
+  if ( !node || node->size < options_.min_rebuild_size )
+  {
+    return;
+  }
+  int left  = node->left ? node->left->size : 0;
+  int right = node->right ? node->right->size : 0;
+  if ( std::max( left, right ) > options_.balance_ratio * ( node->size - 1 ) || node->invalid > options_.delete_ratio * node->size )
+  {
+    rebuild_.resize( mark );
+    rebuild_.push_back( &node );
+  }
+}
+
+template <typename PointType>
+void IkdTree<PointType>::RebuildPending()
+{
+  for ( NodePtr* node : rebuild_ )
+  {
+    rebuild_points_.clear();
+    Flatten( node->get(), rebuild_points_ );
+    *node = BuildTree( rebuild_points_, 0, rebuild_points_.size() );
+    stats_.rebuilds_++;
+    stats_.rebuilt_points_ += rebuild_points_.size();
+  }
+  rebuild_.clear();
+}
+
+template <typename PointType>
+void IkdTree<PointType>::Build( const PointVector& points )
+{
+  rebuild_points_ = points;
+  root_           = BuildTree( rebuild_points_, 0, rebuild_points_.size() );
+}
+
+template <typename PointType>
+std::size_t IkdTree<PointType>::AddPoints( const PointVector& points, const float downsample_size )
+{
+  std::size_t inserted = 0;
+  for ( const PointType& pt : points )
+  {
+    if ( downsample_size > 0 )
+    {
+      Eigen::Vector3f min = ( pt.getVector3fMap() / downsample_size ).array().floor() * downsample_size;
+      if ( HasPointIn( root_.get(), min, min + Eigen::Vector3f::Constant( downsample_size ) ) )
+      {
+        continue;
+      }
+    }
+    Insert( root_, pt, 0 );
+    RebuildPending();
+    inserted++;
+  }
+  return inserted;
+}
+
+template <typename PointType>
+void IkdTree<PointType>::Insert( NodePtr& node, const PointType& pt, const int axis )
+{
+  if ( !node )
+  {
+    node.reset( new Node() );
+    node->point = pt;
+    node->axis  = axis;
+    Update( *node );
+    return;
+  }
+
+  const std::size_t mark = rebuild_.size();
+  const int         next = ( node->axis + 1 ) % 3;
+  if ( Coord( pt, node->axis ) < Coord( node->point, node->axis ) )
+  {
+    Insert( node->left, pt, next );
+  }
+  else
+  {
+    Insert( node->right, pt, next );
+  }
+  Update( *node );
+  CheckRebuild( node, mark );
+}
+
+template <typename PointType>
+std::size_t IkdTree<PointType>::DeleteBox( const Eigen::Vector3f& min, const Eigen::Vector3f& max )
+{
+  std::size_t deleted = DeleteBox( root_, min, max );
+  RebuildPending();
+  stats_.deleted_points_ += deleted;
+  return deleted;
+}
+
+template <typename PointType>
+std::size_t IkdTree<PointType>::DeleteBox( NodePtr& node, const Eigen::Vector3f& min, const Eigen::Vector3f& max )
+{
+  if ( !node || node->invalid == node->size || Disjoint( *node, min, max ) )
+  {
+    return 0;
+  }
+
+  // every point of the subtree is in the box
+  if ( ( node->min.array() >= min.array() ).all() && ( node->max.array() <= max.array() ).all() )
+  {
+    std::size_t deleted = node->size - node->invalid;
+    node.reset();
+    return deleted;
+  }
+
+  const std::size_t mark    = rebuild_.size();
+  std::size_t       deleted = 0;
+  if ( !node->deleted && Inside( node->point, min, max ) )
+  {
+    node->deleted = true;
+    deleted++;
+  }
+  deleted += DeleteBox( node->left, min, max );
+  deleted += DeleteBox( node->right, min, max );
+  Update( *node );
+  CheckRebuild( node, mark );
+  return deleted;
+}
+
+template <typename PointType>
+bool IkdTree<PointType>::HasPointIn( const Node* node, const Eigen::Vector3f& min, const Eigen::Vector3f& max ) const
+{
+  if ( node == nullptr || node->invalid == node->size || Disjoint( *node, min, max ) )
+  {
+    return false;
+  }
+  if ( !node->deleted && Inside( node->point, min, max ) )
+  {
+    return true;
+  }
+  return HasPointIn( node->left.get(), min, max ) || HasPointIn( node->right.get(), min, max );
+}
+
+template <typename PointType>
+void IkdTree<PointType>::NearestSearch( const PointType& point, const int k, PointVector& nearest,
+                                        std::vector<float>& sq_dists, const float max_dist2 ) const
+{
+  nearest.clear();
+  sq_dists.clear();
+  if ( k <= 0 )
+  {
+    return;
+  }
+
+  Heap heap;
+  Search( root_.get(), point, k, max_dist2, heap );
+
+  nearest.resize( heap.size() );
+  sq_dists.resize( heap.size() );
+  for ( int i = heap.size() - 1; i >= 0; --i )
+  {
+    nearest[ i ]  = heap.top().second->point;
+    sq_dists[ i ] = heap.top().first;
+    heap.pop();
+  }
+}
+
+template <typename PointType>
+void IkdTree<PointType>::Search( const Node* node, const PointType& pt, const int k, const float max_dist2, Heap& heap ) const
+{
+  if ( node == nullptr || node->invalid == node->size )
+  {
+    return;
+  }
+  float bound = (int)heap.size() < k ? max_dist2 : heap.top().first;
+  if ( BoxDistance2( *node, pt ) >= bound )
+  {
+    return;
+  }
+
+  if ( !node->deleted )
+  {
+    float d = ( node->point.getVector3fMap() - pt.getVector3fMap() ).squaredNorm();
+    if ( d < bound )
+    {
+      if ( (int)heap.size() == k )
+      {
+        heap.pop();
+      }
+      heap.emplace( d, node );
+    }
+  }
+
+  // the side of the query first, it tightens the bound for the other one
+  bool left_first = Coord( pt, node->axis ) < Coord( node->point, node->axis );
+  Search( left_first ? node->left.get() : node->right.get(), pt, k, max_dist2, heap );
+  Search( left_first ? node->right.get() : node->left.get(), pt, k, max_dist2, heap );
+}
+
+template <typename PointType>
+void IkdTree<PointType>::RadiusSearch( const PointType& point, const float radius, PointVector& points,
+                                       std::vector<float>& sq_dists ) const
+{
+  std::vector<std::pair<float, const Node*>> found;
+  RadiusSearch( root_.get(), point, radius * radius, found );
+  std::sort( found.begin(), found.end(), []( const auto& a, const auto& b ) { return a.first < b.first; } );
+
+  points.resize( found.size() );
+  sq_dists.resize( found.size() );
+  for ( std::size_t i = 0; i < found.size(); ++i )
+  {
+    points[ i ]   = found[ i ].second->point;
+    sq_dists[ i ] = found[ i ].first;
+  }
+}
+
+template <typename PointType>
+void IkdTree<PointType>::RadiusSearch( const Node* node, const PointType& pt, const float radius2,
+                                       std::vector<std::pair<float, const Node*>>& found ) const
+{
+  if ( node == nullptr || node->invalid == node->size || BoxDistance2( *node, pt ) > radius2 )
+  {
+    return;
+  }
+  if ( !node->deleted )
+  {
+    float d = ( node->point.getVector3fMap() - pt.getVector3fMap() ).squaredNorm();
+    if ( d <= radius2 )
+    {
+      found.emplace_back( d, node );
+    }
+  }
+  RadiusSearch( node->left.get(), pt, radius2, found );
+  RadiusSearch( node->right.get(), pt, radius2, found );
+}
+
+template <typename PointType>
+void IkdTree<PointType>::BoxSearch( const Eigen::Vector3f& min, const Eigen::Vector3f& max, PointVector& points ) const
+{
+  BoxSearch( root_.get(), min, max, points );
+}
+
+template <typename PointType>
+void IkdTree<PointType>::BoxSearch( const Node* node, const Eigen::Vector3f& min, const Eigen::Vector3f& max,
+                                    PointVector& points ) const
+{
+  if ( node == nullptr || node->invalid == node->size || Disjoint( *node, min, max ) )
+  {
+    return;
+  }
+  if ( !node->deleted && Inside( node->point, min, max ) )
+  {
+    points.push_back( node->point );
+  }
+  BoxSearch( node->left.get(), min, max, points );
+  BoxSearch( node->right.get(), min, max, points );
+}
+
+template <typename PointType>
+void IkdTree<PointType>::Flatten( const Node* node, PointVector& points )
+{
+  if ( node == nullptr )
+  {
+    return;
+  }
+  if ( !node->deleted )
+  {
+    points.push_back( node->point );
+  }
+  Flatten( node->left.get(), points );
+  Flatten( node->right.get(), points );
+}
+
+}  // namespace lio_sam
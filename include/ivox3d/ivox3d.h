@@ -10,11 +10,16 @@
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
 
+#include <array>
 #include <execution>
+#include <functional>
+#include <iostream>
 #include <list>
+#include <memory>
 #include <thread>
 
 #include "eigen_types.h"
+#include "ivox3d_grid_map.hpp"
 #include "ivox3d_node.hpp"
 #include "utility/color.h"
 
@@ -22,37 +27,70 @@ namespace faster_lio
 {
 enum class IVoxNodeType
 {
-  DEFAULT,  // linear ivox
-  PHC,      // phc ivox
+  DEFAULT,    // linear ivox
+  PHC,        // phc ivox
+  QUANTIZED,  // linear ivox, points kept as 16 bit offsets from the voxel center
 };
 
 /// traits for NodeType
-template <IVoxNodeType node_type, typename PointT, int dim>
+template <IVoxNodeType node_type, typename PointT, int dim, bool with_fit>
 struct IVoxNodeTypeTraits
 {
 };
 
-template <typename PointT, int dim>
-struct IVoxNodeTypeTraits<IVoxNodeType::DEFAULT, PointT, dim>
+template <typename PointT, int dim, bool with_fit>
+struct IVoxNodeTypeTraits<IVoxNodeType::DEFAULT, PointT, dim, with_fit>
 {
-  using NodeType = IVoxNode<PointT, dim>;
+  using NodeType = IVoxNode<PointT, dim, IVoxPointStorage<PointT>, with_fit>;
 };
 
-template <typename PointT, int dim>
-struct IVoxNodeTypeTraits<IVoxNodeType::PHC, PointT, dim>
+template <typename PointT, int dim, bool with_fit>
+struct IVoxNodeTypeTraits<IVoxNodeType::PHC, PointT, dim, with_fit>
 {
-  using NodeType = IVoxNodePhc<PointT, dim>;
+  using NodeType = IVoxNodePhc<PointT, dim, with_fit>;
 };
 
-template <int dim = 3, IVoxNodeType node_type = IVoxNodeType::DEFAULT, typename PointType = pcl::PointXYZ>
-class IVox
+template <typename PointT, int dim, bool with_fit>
+struct IVoxNodeTypeTraits<IVoxNodeType::QUANTIZED, PointT, dim, with_fit>
+{
+  using NodeType = IVoxNode<PointT, dim, IVoxQuantizedStorage<PointT>, with_fit>;
+};
+
+enum class IVoxGridType
+{
+  LINKED,  // unordered_map + std::list lru
+  FLAT,    // open addressing table + slab with intrusive lru
+};
+
+/// traits for GridMapType
+template <IVoxGridType grid_type, typename KeyType, typename NodeType, int dim>
+struct IVoxGridTypeTraits
+{
+};
+
+template <typename KeyType, typename NodeType, int dim>
+struct IVoxGridTypeTraits<IVoxGridType::LINKED, KeyType, NodeType, dim>
+{
+  using GridMapType = LinkedGridMap<KeyType, NodeType, dim>;
+};
+
+template <typename KeyType, typename NodeType, int dim>
+struct IVoxGridTypeTraits<IVoxGridType::FLAT, KeyType, NodeType, dim>
+{
+  using GridMapType = FlatGridMap<KeyType, NodeType, dim>;
+};
+
+/**
+ * node and grid type independent interface of IVox, so the node type can be picked at runtime (see MakeIVox).
+ * IVox is final, calls through an IVox object are not virtual.
+ */
+template <int dim = 3, typename PointType = pcl::PointXYZ>
+class IVoxBase
 {
 public:
-  using KeyType     = Eigen::Matrix<int, dim, 1>;
   using PtType      = Eigen::Matrix<float, dim, 1>;
-  using NodeType    = typename IVoxNodeTypeTraits<node_type, PointType, dim>::NodeType;
   using PointVector = std::vector<PointType, Eigen::aligned_allocator<PointType>>;
-  using DistPoint   = typename NodeType::DistPoint;
+  using FitType     = IVoxFit<dim>;
 
   enum class NearbyType
   {
@@ -62,81 +100,323 @@ public:
     NEARBY26,
   };
 
+  enum class WindowType
+  {
+    NONE,    // bounded by capacity only
+    RADIUS,  // sphere around the window center
+    BOX,     // axis aligned cube around the window center
+  };
+
   struct Options
   {
-    float       resolution_     = 0.2;                  // ivox resolution
-    float       inv_resolution_ = 10.0;                 // inverse resolution
-    NearbyType  nearby_type_    = NearbyType::NEARBY6;  // nearby range
-    std::size_t capacity_       = 1000000;              // capacity
+    float             resolution_          = 0.2;                              // ivox resolution
+    float             inv_resolution_      = 10.0;                             // inverse resolution
+    NearbyType        nearby_type_         = NearbyType::NEARBY6;              // nearby range
+    std::size_t       capacity_            = 1000000;                          // capacity
+    int               num_threads_         = 1;                                // threads used by AddPoints on big batches
+    WindowType        window_type_         = WindowType::NONE;                 // sliding window, see UpdateWindow
+    float             window_size_         = 100.0;                            // radius or half side of the window
+    float             window_step_         = 1.0;                              // the window is swept again once its center moved this far
+    std::size_t       max_points_per_grid_ = 0;                                // point cap of a voxel, 0 for no limit
+    IVoxReplacePolicy replace_policy_      = IVoxReplacePolicy::KEEP_OLDEST;   // what a full voxel does with a new point
+    float             min_point_distance_  = 0.1;                              // points closer to a stored one are dropped by REJECT_NEAR
+    bool              fit_                 = false;                            // keep the voxel moments GetClosestFit needs, see MakeIVox
+  };
+
+  /// sliding window state of UpdateWindow and InWindow, also kept by callers that track the window of a map they do not own
+  class Window
+  {
+  public:
+    Window() = default;
+
+    explicit Window( const Options& options ) : type_( options.window_type_ ), size_( options.window_size_ ), step_( options.window_step_ ) {}
+
+    /// move the center, does nothing until it moved step from the last move. Returns whether it moved
+    bool Update( const PtType& center )
+    {
+      if ( type_ == WindowType::NONE || ( initialized_ && ( center - center_ ).norm() < step_ ) )
+      {
+        return false;
+      }
+      center_      = center;
+      initialized_ = true;
+      return true;
+    }
+
+    /// always true without window or before the first move
+    bool Contains( const PtType& pt ) const
+    {
+      if ( type_ == WindowType::NONE || !initialized_ )
+      {
+        return true;
+      }
+      if ( type_ == WindowType::RADIUS )
+      {
+        return ( pt - center_ ).squaredNorm() <= size_ * size_;
+      }
+      return ( pt - center_ ).cwiseAbs().maxCoeff() <= size_;
+    }
+
+  private:
+    WindowType type_        = WindowType::NONE;
+    float      size_        = 100.0;
+    float      step_        = 1.0;
+    PtType     center_      = PtType::Zero();
+    bool       initialized_ = false;
+  };
+
+  /// counters since construction
+  struct Stats
+  {
+    std::size_t window_evicted_grids_   = 0;  // voxels evicted for leaving the sliding window
+    std::size_t capacity_evicted_grids_ = 0;  // voxels evicted by the lru capacity
+    std::size_t rejected_points_        = 0;  // points dropped by the replacement policy
+    std::size_t replaced_points_        = 0;  // stored points overwritten by the replacement policy
   };
 
+  virtual ~IVoxBase() = default;
+
+  /// point classes kept apart in each voxel, the label argument of the methods below is in [ 0, NumLabels() )
+  virtual int NumLabels() const = 0;
+
+  virtual void AddPoints( const PointVector& points_to_add, const uint32_t tag = IVOX_NO_TAG, const int label = 0 ) = 0;
+
+  virtual std::size_t RemovePoints( const std::function<bool( uint32_t )>& pred ) = 0;
+
+  virtual bool GetClosestPoint( const PointType& pt, PointVector& closest_pt, int max_num = 5, double max_range = 5.0, const int label = 0 ) = 0;
+
+  /**
+     * get nn with condition into closest_pt[ 0, max_num ), the nearest first
+     * @param candidates  scratch, kept by the caller (one per thread) so that repeated queries do not allocate
+     * @return number of points found
+     */
+  virtual int GetClosestPoint( const PointType& pt, PointType* closest_pt, int max_num, std::vector<IVoxCandidate>& candidates,
+                               double max_range = 5.0, const int label = 0 ) = 0;
+
+  template <std::size_t N>
+  inline int GetClosestPoint( const PointType& pt, std::array<PointType, N>& closest_pt, std::vector<IVoxCandidate>& candidates,
+                              double max_range = 5.0, const int label = 0 )
+  {
+    return GetClosestPoint( pt, closest_pt.data(), N, candidates, max_range, label );
+  }
+
+  /**
+     * get nn with condition of every point in points, see GetClosestPoints in IVox
+     * @param closest_pt  max_num slots per point, the ones of points[ i ] start at closest_pt[ i * max_num ]
+     * @param num_found   number of points found for each point
+     * @param order       visiting order of points, computed if its size differs from points. Keep it to skip the
+     *                    sort on the next batch of the same points (e.g. the next iteration of a scan match)
+     */
+  virtual void GetClosestPoints( const PointVector& points, PointVector& closest_pt, std::vector<int>& num_found, std::vector<uint32_t>& order,
+                                 int max_num = 5, double max_range = 5.0, const int label = 0 ) = 0;
+
+  /**
+     * line/plane model of the points around pt, the one cached in its voxel or, with too few points there, the one of
+     * the nearby voxels together
+     * @param max_range  the centroid of the model is at most that far from pt
+     * @return false without a model, always for a map built without Options::fit_
+     */
+  virtual bool GetClosestFit( const PointType& pt, FitType& fit, int min_num = 5, double max_range = 5.0, const int label = 0 ) = 0;
+
+  virtual bool UpdateWindow( const PtType& center ) = 0;
+
+  virtual bool InWindow( const PtType& pt ) const = 0;
+
+  virtual const Stats& GetStats() const = 0;
+
+  virtual size_t NumPoints() const = 0;
+
+  virtual size_t NumValidGrids() const = 0;
+
+  virtual std::vector<float> StatGridPoints() const = 0;
+};
+
+/**
+ * @tparam num_labels  point classes kept apart in each voxel (e.g. corner and surf features), see IVoxLabeledNode.
+ *                     AddPoints and the queries take the class as label, the other methods work on every class
+ * @tparam with_fit    the voxels keep the moments of their points for GetClosestFit, see Options::fit_
+ */
+template <int dim = 3, IVoxNodeType node_type = IVoxNodeType::DEFAULT, typename PointType = pcl::PointXYZ,
+          IVoxGridType grid_type = IVoxGridType::LINKED, int num_labels = 1, bool with_fit = false>
+class IVox final : public IVoxBase<dim, PointType>
+{
+public:
+  using Base        = IVoxBase<dim, PointType>;
+  using KeyType     = Eigen::Matrix<int, dim, 1>;
+  using PtType      = typename Base::PtType;
+  using NodeType    = typename IVoxNodeTypeTraits<node_type, PointType, dim, with_fit>::NodeType;  // points of one class
+  using GridType    = IVoxLabeledNode<NodeType, num_labels>;
+  using GridMapType = typename IVoxGridTypeTraits<grid_type, KeyType, GridType, dim>::GridMapType;
+  using PointVector = typename Base::PointVector;
+  using DistPoint   = IVoxCandidate;
+  using FitType     = typename Base::FitType;
+  using NearbyType  = typename Base::NearbyType;
+  using WindowType  = typename Base::WindowType;
+  using Options     = typename Base::Options;
+  using Window      = typename Base::Window;
+  using Stats       = typename Base::Stats;
+
   /**
      * constructor
      * @param options  ivox options
      */
-  explicit IVox( Options options ) : options_( options )
+  explicit IVox( Options options ) : options_( options ), window_( options )
   {
     options_.inv_resolution_ = 1.0 / options_.resolution_;
     GenerateNearbyGrids();
   }
 
+  inline int NumLabels() const override { return num_labels; }
+
   /**
      * add points
      * @param points_to_add
+     * @param tag    owner of the points (e.g. keyframe id), see RemovePoints
+     * @param label  class of the points
+     */
+  void AddPoints( const PointVector& points_to_add, const uint32_t tag = IVOX_NO_TAG, const int label = 0 ) override;
+
+  /**
+     * remove the points (of every class) whose tag satisfies pred and the voxels left empty, visits every voxel
+     * @return number of removed points
      */
-  void AddPoints( const PointVector& points_to_add );
+  template <typename Pred>
+  std::size_t RemovePoints( Pred&& pred );
+
+  std::size_t RemovePoints( const std::function<bool( uint32_t )>& pred ) override
+  {
+    return RemovePoints<const std::function<bool( uint32_t )>&>( pred );
+  }
 
   void AddPoints( const typename pcl::PointCloud<PointType>::Ptr& points_to_add );
 
   /// get nn
-  bool GetClosestPoint( const PointType& pt, PointType& closest_pt );
+  bool GetClosestPoint( const PointType& pt, PointType& closest_pt, const int label = 0 );
 
   /// get nn with condition
-  bool GetClosestPoint( const PointType& pt, PointVector& closest_pt, int max_num = 5, double max_range = 5.0 );
+  bool GetClosestPoint( const PointType& pt, PointVector& closest_pt, int max_num = 5, double max_range = 5.0, const int label = 0 ) override;
+
+  /// get nn with condition into a caller owned array, allocation free once candidates has grown
+  int GetClosestPoint( const PointType& pt, PointType* closest_pt, int max_num, std::vector<DistPoint>& candidates,
+                       double max_range = 5.0, const int label = 0 ) override;
+
+  using Base::GetClosestPoint;
 
   /// get nn in cloud
   bool GetClosestPoint( const PointVector& cloud, PointVector& closest_cloud );
 
+  /**
+     * batch GetClosestPoint. The queries are visited along a morton curve over their voxels, so consecutive
+     * queries look up the same voxels, and split in chunks over num_threads_ threads. Same results as one
+     * GetClosestPoint per point.
+     */
+  void GetClosestPoints( const PointVector& points, PointVector& closest_pt, std::vector<int>& num_found, std::vector<uint32_t>& order,
+                         int max_num = 5, double max_range = 5.0, const int label = 0 ) override;
+
+  /// get the cached line/plane fit of the voxel of pt, or of its nearby voxels if it holds less than min_num points
+  bool GetClosestFit( const PointType& pt, FitType& fit, int min_num = 5, double max_range = 5.0, const int label = 0 ) override;
+
+  /**
+     * move the sliding window to center and evict the voxels out of it, does nothing until the center moved
+     * window_step_ from the last sweep. A sweep visits every voxel.
+     * @return whether the window was swept
+     */
+  bool UpdateWindow( const PtType& center ) override;
+
+  /// whether pt is inside the current sliding window (always true without window)
+  inline bool InWindow( const PtType& pt ) const override { return window_.Contains( pt ); }
+
+  inline const Stats& GetStats() const override { return stats_; }
+
   /// get number of points
-  size_t NumPoints() const;
+  size_t NumPoints() const override;
 
   /// get number of valid grids
-  size_t NumValidGrids() const;
+  size_t NumValidGrids() const override;
 
   /// get statistics of the points
-  std::vector<float> StatGridPoints() const;
+  std::vector<float> StatGridPoints() const override;
 
 private:
+  static constexpr int         MAX_NEARBY          = 27;    // NEARBY26 and the center
+  static constexpr std::size_t PARALLEL_INSERT_MIN = 8192;  // smaller batches are not worth the bucketing
+  static constexpr int         QUERY_CHUNK         = 64;    // consecutive queries handed to a thread by GetClosestPoints
+
   /// generate the nearby grids according to the given options
   void GenerateNearbyGrids();
 
   /// position to grid
   KeyType Pos2Grid( const PtType& pt ) const;
 
-  Options                                                                                                options_;
-  std::unordered_map<KeyType, typename std::list<std::pair<KeyType, NodeType>>::iterator, hash_vec<dim>> grids_map_;     // voxel hash map
-  std::list<std::pair<KeyType, NodeType>>                                                                grids_cache_;   // voxel cache
-  std::vector<KeyType>                                                                                   nearby_grids_;  // nearbys
+  /// spread the low 21 bits of v to every third bit, farther voxels only lose locality
+  static inline uint64_t MortonSpread( const int v )
+  {
+    uint64_t x = std::min( v, ( 1 << 21 ) - 1 );
+    x          = ( x | x << 32 ) & 0x1F00000000FFFFull;
+    x          = ( x | x << 16 ) & 0x1F0000FF0000FFull;
+    x          = ( x | x << 8 ) & 0x100F00F00F00F00Full;
+    x          = ( x | x << 4 ) & 0x10C30C30C30C30C3ull;
+    x          = ( x | x << 2 ) & 0x1249249249249249ull;
+    return x;
+  }
+
+  /// create or touch the voxel of key, evicting the least recently used one if over capacity
+  GridType* TouchGrid( const KeyType& key );
+
+  /// node of label in the voxel grid of key, created if missing
+  inline NodeType& TouchNode( GridType& grid, const KeyType& key, const int label ) const
+  {
+    return grid.Touch( label, [ &key, this ]() { return NodeType( GridCenter( key ), options_.resolution_ ); } );
+  }
+
+  inline PointType GridCenter( const KeyType& key ) const
+  {
+    PointType center;
+    center.getVector3fMap() = key.template cast<float>() * options_.resolution_;
+    return center;
+  }
+
+  /// AddPoints with the points bucketed by voxel and the buckets filled concurrently
+  void AddPointsParallel( const PointVector& points_to_add, const uint32_t tag, const int label );
+
+  inline IVoxInsertLimit InsertLimit() const
+  {
+    return { options_.max_points_per_grid_, options_.replace_policy_, options_.min_point_distance_ * options_.min_point_distance_ };
+  }
+
+  static inline void CountInsert( const IVoxInsertResult result, std::size_t& rejected, std::size_t& replaced )
+  {
+    rejected += result == IVoxInsertResult::REJECTED;
+    replaced += result == IVoxInsertResult::REPLACED;
+  }
+
+  Options              options_;
+  GridMapType          grids_;         // voxels in lru order
+  std::vector<KeyType> nearby_grids_;  // nearbys
+  Stats                stats_;
+  Window               window_;
 };
 
-template <int dim, IVoxNodeType node_type, typename PointType>
-bool IVox<dim, node_type, PointType>::GetClosestPoint( const PointType& pt, PointType& closest_pt )
+template <int dim, IVoxNodeType node_type, typename PointType, IVoxGridType grid_type, int num_labels, bool with_fit>
+bool IVox<dim, node_type, PointType, grid_type, num_labels, with_fit>::GetClosestPoint( const PointType& pt, PointType& closest_pt, const int label )
 {
-  std::vector<DistPoint> candidates;
-  auto                   key = Pos2Grid( ToEigen<float, dim>( pt ) );
-  std::for_each( nearby_grids_.begin(), nearby_grids_.end(), [ &key, &candidates, &pt, this ]( const KeyType& delta ) {
-    auto dkey = key + delta;
-    auto iter = grids_map_.find( dkey );
-    if ( iter != grids_map_.end() )
+  std::vector<DistPoint>                 candidates;
+  std::array<const NodeType*, MAX_NEARBY> nodes;
+  auto                                   key = Pos2Grid( ToEigen<float, dim>( pt ) );
+  for ( uint32_t slot = 0; slot < nearby_grids_.size(); ++slot )
+  {
+    const GridType* grid = grids_.Find( key + nearby_grids_[ slot ] );
+    const NodeType* node = grid == nullptr ? nullptr : grid->Find( label );
+    if ( node != nullptr )
     {
       DistPoint dist_point;
-      bool      found = iter->second->second.NNPoint( pt, dist_point );
-      if ( found )
+      nodes[ slot ] = node;
+      if ( nodes[ slot ]->NNPoint( pt, dist_point, slot ) )
       {
         candidates.emplace_back( dist_point );
       }
     }
-  } );
+  }
 
   if ( candidates.empty() )
   {
@@ -144,16 +424,27 @@ bool IVox<dim, node_type, PointType>::GetClosestPoint( const PointType& pt, Poin
   }
 
   auto iter  = std::min_element( candidates.begin(), candidates.end() );
-  closest_pt = iter->Get();
+  closest_pt = nodes[ iter->Slot() ]->GetPoint( iter->Index() );
   return true;
 }
 
-template <int dim, IVoxNodeType node_type, typename PointType>
-bool IVox<dim, node_type, PointType>::GetClosestPoint( const PointType& pt, PointVector& closest_pt, int max_num,
-                                                       double max_range )
+template <int dim, IVoxNodeType node_type, typename PointType, IVoxGridType grid_type, int num_labels, bool with_fit>
+bool IVox<dim, node_type, PointType, grid_type, num_labels, with_fit>::GetClosestPoint( const PointType& pt, PointVector& closest_pt, int max_num,
+                                                       double max_range, const int label )
 {
   std::vector<DistPoint> candidates;
   candidates.reserve( max_num * nearby_grids_.size() );
+  closest_pt.resize( max_num );
+  closest_pt.resize( GetClosestPoint( pt, closest_pt.data(), max_num, candidates, max_range, label ) );
+  return closest_pt.empty() == false;
+}
+
+template <int dim, IVoxNodeType node_type, typename PointType, IVoxGridType grid_type, int num_labels, bool with_fit>
+int IVox<dim, node_type, PointType, grid_type, num_labels, with_fit>::GetClosestPoint( const PointType& pt, PointType* closest_pt, int max_num,
+                                                      std::vector<DistPoint>& candidates, double max_range, const int label )
+{
+  candidates.clear();
+  std::array<const NodeType*, MAX_NEARBY> nodes;  // candidates refer to the nodes by nearby slot
 
   auto key = Pos2Grid( ToEigen<float, dim>( pt ) );
 
@@ -167,16 +458,17 @@ bool IVox<dim, node_type, PointType>::GetClosestPoint( const PointType& pt, Poin
   }
 #endif
 
-  for ( const KeyType& delta : nearby_grids_ )
+  for ( uint32_t slot = 0; slot < nearby_grids_.size(); ++slot )
   {
-    auto dkey = key + delta;
-    auto iter = grids_map_.find( dkey );
-    if ( iter != grids_map_.end() )
+    const GridType* grid = grids_.Find( key + nearby_grids_[ slot ] );
+    const NodeType* node = grid == nullptr ? nullptr : grid->Find( label );
+    if ( node != nullptr )
     {
 #ifdef INNER_TIMER
       auto t1 = std::chrono::high_resolution_clock::now();
 #endif
-      iter->second->second.KNNPointByCondition( candidates, pt, max_num, max_range );
+      nodes[ slot ] = node;
+      nodes[ slot ]->KNNPointByCondition( candidates, pt, max_num, max_range, slot );
 #ifdef INNER_TIMER
       auto t2  = std::chrono::high_resolution_clock::now();
       auto knn = std::chrono::duration_cast<std::chrono::nanoseconds>( t2 - t1 ).count();
@@ -187,7 +479,7 @@ bool IVox<dim, node_type, PointType>::GetClosestPoint( const PointType& pt, Poin
 
   if ( candidates.empty() )
   {
-    return false;
+    return 0;
   }
 
 #ifdef INNER_TIMER
@@ -225,22 +517,114 @@ bool IVox<dim, node_type, PointType>::GetClosestPoint( const PointType& pt, Poin
   }
 #endif
 
-  closest_pt.clear();
-  for ( auto& it : candidates )
+  for ( std::size_t i = 0; i < candidates.size(); ++i )
   {
-    closest_pt.emplace_back( it.Get() );
+    closest_pt[ i ] = nodes[ candidates[ i ].Slot() ]->GetPoint( candidates[ i ].Index() );
   }
-  return closest_pt.empty() == false;
+  return candidates.size();
+}
+
+template <int dim, IVoxNodeType node_type, typename PointType, IVoxGridType grid_type, int num_labels, bool with_fit>
+void IVox<dim, node_type, PointType, grid_type, num_labels, with_fit>::GetClosestPoints( const PointVector& points, PointVector& closest_pt,
+                                                        std::vector<int>& num_found, std::vector<uint32_t>& order,
+                                                        int max_num, double max_range, const int label )
+{
+  const int num = points.size();
+  closest_pt.resize( std::size_t( num ) * max_num );
+  num_found.resize( num );
+  if ( num == 0 )
+  {
+    return;
+  }
+
+  if ( order.size() != points.size() )
+  {
+    // sort by the morton code of the voxels, relative to the lowest voxel of the batch
+    std::vector<KeyType> keys( num );
+    KeyType              min_key = Pos2Grid( ToEigen<float, dim>( points[ 0 ] ) );
+    for ( int i = 0; i < num; ++i )
+    {
+      keys[ i ] = Pos2Grid( ToEigen<float, dim>( points[ i ] ) );
+      min_key   = min_key.cwiseMin( keys[ i ] );
+    }
+
+    std::vector<std::pair<uint64_t, uint32_t>> codes( num );
+    for ( int i = 0; i < num; ++i )
+    {
+      uint64_t code = 0;
+      for ( int d = 0; d < dim; ++d )
+      {
+        code |= MortonSpread( keys[ i ][ d ] - min_key[ d ] ) << d;
+      }
+      codes[ i ] = { code, uint32_t( i ) };
+    }
+    std::sort( codes.begin(), codes.end() );
+
+    order.resize( num );
+    for ( int k = 0; k < num; ++k )
+    {
+      order[ k ] = codes[ k ].second;
+    }
+  }
+
+#pragma omp parallel for num_threads( options_.num_threads_ ) schedule( dynamic, QUERY_CHUNK )
+  for ( int k = 0; k < num; ++k )
+  {
+    thread_local std::vector<DistPoint> candidates;  // reused by the queries of this thread
+
+    const uint32_t i = order[ k ];
+    num_found[ i ]   = GetClosestPoint( points[ i ], &closest_pt[ std::size_t( i ) * max_num ], max_num, candidates, max_range, label );
+  }
+}
+
+template <int dim, IVoxNodeType node_type, typename PointType, IVoxGridType grid_type, int num_labels, bool with_fit>
+bool IVox<dim, node_type, PointType, grid_type, num_labels, with_fit>::GetClosestFit( const PointType& pt, FitType& fit, int min_num, double max_range, const int label )
+{
+  if constexpr ( !with_fit )
+  {
+    // the voxels keep no moments
+    return false;
+  }
+
+  const PtType    query = ToEigen<float, dim>( pt );
+  auto            key   = Pos2Grid( query );
+  const GridType* grid  = grids_.Find( key );
+  const NodeType* node  = grid == nullptr ? nullptr : grid->Find( label );
+  if ( node != nullptr && node->GetMoments().num >= min_num )
+  {
+    fit = node->GetFit();
+    return fit.valid && ( fit.centroid - query ).squaredNorm() <= max_range * max_range;
+  }
+
+  // too few points in the center voxel, merge the moments of the nearby ones
+  IVoxMoments<dim> moments;
+  for ( const KeyType& delta : nearby_grids_ )
+  {
+    const GridType* grid   = grids_.Find( key + delta );
+    const NodeType* nearby = grid == nullptr ? nullptr : grid->Find( label );
+    if ( nearby != nullptr )
+    {
+      moments += nearby->GetMoments();
+    }
+  }
+
+  if ( moments.num < min_num )
+  {
+    return false;
+  }
+  // the merged points may span several voxels, the model is of no use if they are mostly far from pt
+  fit = FitType::FromMoments( moments );
+  return fit.valid && ( fit.centroid - query ).squaredNorm() <= max_range * max_range;
 }
 
-template <int dim, IVoxNodeType node_type, typename PointType>
-size_t IVox<dim, node_type, PointType>::NumValidGrids() const
+template <int dim, IVoxNodeType node_type, typename PointType, IVoxGridType grid_type, int num_labels, bool with_fit>
+size_t IVox<dim, node_type, PointType, grid_type, num_labels, with_fit>::NumValidGrids() const
 {
-  return grids_map_.size();
+  return grids_.Size();
 }
 
-template <int dim, IVoxNodeType node_type, typename PointType>
-void IVox<dim, node_type, PointType>::GenerateNearbyGrids()
+template <int dim, IVoxNodeType node_type, typename PointType, IVoxGridType grid_type, int num_labels, bool with_fit>
+void IVox<dim, node_type, PointType, grid_type, num_labels, with_fit>::GenerateNearbyGrids()
 {
   if ( options_.nearby_type_ == NearbyType::CENTER )
   {
@@ -276,8 +660,8 @@ void IVox<dim, node_type, PointType>::GenerateNearbyGrids()
   }
 }
 
-template <int dim, IVoxNodeType node_type, typename PointType>
-bool IVox<dim, node_type, PointType>::GetClosestPoint( const PointVector& cloud, PointVector& closest_cloud )
+template <int dim, IVoxNodeType node_type, typename PointType, IVoxGridType grid_type, int num_labels, bool with_fit>
+bool IVox<dim, node_type, PointType, grid_type, num_labels, with_fit>::GetClosestPoint( const PointVector& cloud, PointVector& closest_cloud )
 {
   std::vector<size_t> index( cloud.size() );
   for ( int i = 0; i < cloud.size(); ++i )
@@ -300,63 +684,281 @@ bool IVox<dim, node_type, PointType>::GetClosestPoint( const PointVector& cloud,
   return true;
 }
 
-template <int dim, IVoxNodeType node_type, typename PointType>
-void IVox<dim, node_type, PointType>::AddPoints( const PointVector& points_to_add )
+template <int dim, IVoxNodeType node_type, typename PointType, IVoxGridType grid_type, int num_labels, bool with_fit>
+typename IVox<dim, node_type, PointType, grid_type, num_labels, with_fit>::GridType*
+IVox<dim, node_type, PointType, grid_type, num_labels, with_fit>::TouchGrid( const KeyType& key )
 {
-  std::for_each( std::execution::unseq, points_to_add.begin(), points_to_add.end(), [ this ]( const auto& pt ) {
-    auto key = Pos2Grid( ToEigen<float, dim>( pt ) );
+  auto touched = grids_.Touch( key, [ &key, this ]() { return GridType( GridCenter( key ), options_.resolution_ ); } );
+
+  if ( touched.second && grids_.Size() >= options_.capacity_ )
+  {
+    grids_.PopBack();
+    stats_.capacity_evicted_grids_++;
+    return grids_.Find( key );  // nullptr if the new voxel itself was dropped
+  }
+  return touched.first;
+}
+
+template <int dim, IVoxNodeType node_type, typename PointType, IVoxGridType grid_type, int num_labels, bool with_fit>
+void IVox<dim, node_type, PointType, grid_type, num_labels, with_fit>::AddPoints( const PointVector& points_to_add, const uint32_t tag, const int label )
+{
+  if ( options_.num_threads_ > 1 && points_to_add.size() >= PARALLEL_INSERT_MIN )
+  {
+    AddPointsParallel( points_to_add, tag, label );
+    return;
+  }
+
+  const IVoxInsertLimit limit = InsertLimit();
+  for ( const auto& pt : points_to_add )
+  {
+    const KeyType key  = Pos2Grid( ToEigen<float, dim>( pt ) );
+    GridType*     grid = TouchGrid( key );
+    if ( grid == nullptr )
+    {
+      continue;
+    }
+    CountInsert( TouchNode( *grid, key, label ).InsertPoint( pt, tag, limit ), stats_.rejected_points_, stats_.replaced_points_ );
+  }
+}
+
+template <int dim, IVoxNodeType node_type, typename PointType, IVoxGridType grid_type, int num_labels, bool with_fit>
+template <typename Pred>
+std::size_t IVox<dim, node_type, PointType, grid_type, num_labels, with_fit>::RemovePoints( Pred&& pred )
+{
+  std::size_t          removed = 0;
+  std::vector<KeyType> empty_grids;
+  grids_.ForEach( [ & ]( const KeyType& key, GridType& node ) {
+    removed += node.RemovePoints( pred );
+    if ( node.Empty() )
+    {
+      empty_grids.emplace_back( key );
+    }
+  } );
+
+  for ( const auto& key : empty_grids )
+  {
+    grids_.Erase( key );
+  }
+  return removed;
+}
+
+/**
+ * Same result as the serial insertion when nothing is evicted: every voxel gets its points in input order and
+ * the voxels end up in the lru order of their last point. Under eviction each voxel is touched once (at its last
+ * point) instead of at every point, so the victims may differ, but the voxels of the batch are never evicted
+ * while the batch touches less voxels than the capacity.
+ *  1. voxel keys and their hash partition (one per thread) are computed in parallel
+ *  2. the points are grouped by partition with a counting sort, each thread counting and then placing the points
+ *     of one contiguous chunk, so a point is hashed once whatever the number of threads
+ *  3. each thread owns the voxels of one partition and stable sorts its points by voxel
+ *  4. the voxels are touched serially, ordered by their last point (the only step that changes the map)
+ *  5. the voxel buckets are filled concurrently, no two threads share a voxel
+ */
+template <int dim, IVoxNodeType node_type, typename PointType, IVoxGridType grid_type, int num_labels, bool with_fit>
+void IVox<dim, node_type, PointType, grid_type, num_labels, with_fit>::AddPointsParallel( const PointVector& points_to_add, const uint32_t tag, const int label )
+{
+  struct Bucket
+  {
+    uint32_t last  = 0;  // index of the last point of the voxel, lru order
+    uint32_t begin = 0;  // range in order
+    uint32_t end   = 0;
+  };
+
+  const int             num_threads = options_.num_threads_;
+  const int             num_points  = points_to_add.size();
+  std::vector<KeyType>  keys( num_points );
+  std::vector<uint32_t> part_of( num_points );
+
+#pragma omp parallel for num_threads( num_threads )
+  for ( int i = 0; i < num_points; ++i )
+  {
+    keys[ i ]    = Pos2Grid( ToEigen<float, dim>( points_to_add[ i ] ) );
+    part_of[ i ] = hash_vec<dim>()( keys[ i ] ) % num_threads;
+  }
 
-    auto iter = grids_map_.find( key );
-    if ( iter == grids_map_.end() )
+  // chunk c holds the points chunk_begin( c ) to chunk_begin( c + 1 ), offsets[ c * num_threads + p ] is where its
+  // points of partition p go. Partitions are laid out one after the other and chunks in order inside them, so the
+  // points of a partition keep the input order
+  auto chunk_begin = [ num_points, num_threads ]( const int c ) { return static_cast<int>( int64_t( num_points ) * c / num_threads ); };
+  std::vector<uint32_t> offsets( num_threads * num_threads, 0 );
+#pragma omp parallel for num_threads( num_threads ) schedule( static, 1 )
+  for ( int c = 0; c < num_threads; ++c )
+  {
+    for ( int i = chunk_begin( c ); i < chunk_begin( c + 1 ); ++i )
+    {
+      offsets[ c * num_threads + part_of[ i ] ]++;
+    }
+  }
+
+  std::vector<uint32_t> part_begin( num_threads + 1, 0 );
+  uint32_t              offset = 0;
+  for ( int p = 0; p < num_threads; ++p )
+  {
+    part_begin[ p ] = offset;
+    for ( int c = 0; c < num_threads; ++c )
     {
-      PointType center;
-      center.getVector3fMap() = key.template cast<float>() * options_.resolution_;
+      const uint32_t count           = offsets[ c * num_threads + p ];
+      offsets[ c * num_threads + p ] = offset;
+      offset += count;
+    }
+  }
+  part_begin[ num_threads ] = offset;
 
-      grids_cache_.push_front( { key, NodeType( center, options_.resolution_ ) } );
-      grids_map_.insert( { key, grids_cache_.begin() } );
+  std::vector<uint32_t> order( num_points );
+#pragma omp parallel for num_threads( num_threads ) schedule( static, 1 )
+  for ( int c = 0; c < num_threads; ++c )
+  {
+    for ( int i = chunk_begin( c ); i < chunk_begin( c + 1 ); ++i )
+    {
+      order[ offsets[ c * num_threads + part_of[ i ] ]++ ] = i;
+    }
+  }
 
-      grids_cache_.front().second.InsertPoint( pt );
+  std::vector<std::vector<Bucket>> part_buckets( num_threads );
+#pragma omp parallel for num_threads( num_threads ) schedule( static, 1 )
+  for ( int t = 0; t < num_threads; ++t )
+  {
+    std::sort( order.begin() + part_begin[ t ], order.begin() + part_begin[ t + 1 ], [ &keys ]( const uint32_t a, const uint32_t b ) {
+      return less_vec<dim>()( keys[ a ], keys[ b ] ) || ( keys[ a ] == keys[ b ] && a < b );
+    } );
 
-      if ( grids_map_.size() >= options_.capacity_ )
+    for ( uint32_t begin = part_begin[ t ], end = begin; begin < part_begin[ t + 1 ]; begin = end )
+    {
+      for ( end = begin + 1; end < part_begin[ t + 1 ] && keys[ order[ end ] ] == keys[ order[ begin ] ]; ++end )
       {
-        grids_map_.erase( grids_cache_.back().first );
-        grids_cache_.pop_back();
       }
+      part_buckets[ t ].push_back( Bucket{ order[ end - 1 ], begin, end } );
     }
-    else
+  }
+
+  std::vector<Bucket> buckets;
+  for ( const auto& it : part_buckets )
+  {
+    buckets.insert( buckets.end(), it.begin(), it.end() );
+  }
+  std::sort( buckets.begin(), buckets.end(), []( const Bucket& a, const Bucket& b ) { return a.last < b.last; } );
+
+  for ( const Bucket& bucket : buckets )
+  {
+    TouchGrid( keys[ bucket.last ] );
+  }
+
+  // the map is not modified any more, node pointers stay valid
+  const IVoxInsertLimit limit    = InsertLimit();
+  std::size_t           rejected = 0;
+  std::size_t           replaced = 0;
+#pragma omp parallel for num_threads( num_threads ) schedule( dynamic, 16 ) reduction( + : rejected, replaced )
+  for ( int b = 0; b < static_cast<int>( buckets.size() ); ++b )
+  {
+    const Bucket& bucket = buckets[ b ];
+    GridType*     grid   = grids_.Find( keys[ bucket.last ] );
+    if ( grid == nullptr )
+    {
+      continue;  // evicted, the batch is bigger than the capacity
+    }
+    NodeType& node = TouchNode( *grid, keys[ bucket.last ], label );
+    for ( uint32_t k = bucket.begin; k < bucket.end; ++k )
+    {
+      CountInsert( node.InsertPoint( points_to_add[ order[ k ] ], tag, limit ), rejected, replaced );
+    }
+  }
+  stats_.rejected_points_ += rejected;
+  stats_.replaced_points_ += replaced;
+}
+
+template <int dim, IVoxNodeType node_type, typename PointType, IVoxGridType grid_type, int num_labels, bool with_fit>
+bool IVox<dim, node_type, PointType, grid_type, num_labels, with_fit>::UpdateWindow( const PtType& center )
+{
+  if ( !window_.Update( center ) )
+  {
+    return false;
+  }
+
+  std::vector<KeyType> out_grids;
+  grids_.ForEach( [ &out_grids, this ]( const KeyType& key, const GridType& node ) {
+    if ( !InWindow( key.template cast<float>() * options_.resolution_ ) )
     {
-      iter->second->second.InsertPoint( pt );
-      grids_cache_.splice( grids_cache_.begin(), grids_cache_, iter->second );
-      grids_map_[ key ] = grids_cache_.begin();
+      out_grids.emplace_back( key );
     }
   } );
+
+  for ( const auto& key : out_grids )
+  {
+    grids_.Erase( key );
+  }
+  stats_.window_evicted_grids_ += out_grids.size();
+  return true;
+}
+
+template <int dim, IVoxNodeType node_type, typename PointType, IVoxGridType grid_type, int num_labels, bool with_fit>
+size_t IVox<dim, node_type, PointType, grid_type, num_labels, with_fit>::NumPoints() const
+{
+  std::size_t num = 0;
+  grids_.ForEach( [ &num ]( const KeyType& key, const GridType& node ) { num += node.Size(); } );
+  return num;
 }
 
-template <int dim, IVoxNodeType node_type, typename PointType>
-Eigen::Matrix<int, dim, 1> IVox<dim, node_type, PointType>::Pos2Grid( const IVox::PtType& pt ) const
+template <int dim, IVoxNodeType node_type, typename PointType, IVoxGridType grid_type, int num_labels, bool with_fit>
+Eigen::Matrix<int, dim, 1> IVox<dim, node_type, PointType, grid_type, num_labels, with_fit>::Pos2Grid( const IVox::PtType& pt ) const
 {
   return ( pt * options_.inv_resolution_ ).array().round().template cast<int>();
 }
 
-template <int dim, IVoxNodeType node_type, typename PointType>
-std::vector<float> IVox<dim, node_type, PointType>::StatGridPoints() const
+template <int dim, IVoxNodeType node_type, typename PointType, IVoxGridType grid_type, int num_labels, bool with_fit>
+std::vector<float> IVox<dim, node_type, PointType, grid_type, num_labels, with_fit>::StatGridPoints() const
 {
-  int num = grids_cache_.size(), valid_num = 0, max = 0, min = 100000000;
+  int num = grids_.Size(), valid_num = 0, max = 0, min = 100000000;
   int sum = 0, sum_square = 0;
-  for ( auto& it : grids_cache_ )
-  {
-    int s = it.second.Size();
+  grids_.ForEach( [ & ]( const KeyType& key, const GridType& node ) {
+    int s = node.Size();
     valid_num += s > 0;
     max = s > max ? s : max;
     min = s < min ? s : min;
     sum += s;
     sum_square += s * s;
-  }
+  } );
   float ave    = float( sum ) / num;
   float stddev = num > 1 ? sqrt( ( float( sum_square ) - num * ave * ave ) / ( num - 1 ) ) : 0;
   return std::vector<float>{ valid_num, ave, max, min, stddev };
 }
 
+/// IVox of node_type with the number of point classes (1 or 2) and the voxel fit (options.fit_) picked at runtime
+template <int dim, IVoxNodeType node_type, typename PointType, IVoxGridType grid_type>
+std::shared_ptr<IVoxBase<dim, PointType>> MakeIVoxLabeled( const typename IVoxBase<dim, PointType>::Options& options,
+                                                           const int num_labels )
+{
+  if ( options.fit_ )
+  {
+    if ( num_labels == 2 )
+    {
+      return std::make_shared<IVox<dim, node_type, PointType, grid_type, 2, true>>( options );
+    }
+    return std::make_shared<IVox<dim, node_type, PointType, grid_type, 1, true>>( options );
+  }
+  if ( num_labels == 2 )
+  {
+    return std::make_shared<IVox<dim, node_type, PointType, grid_type, 2>>( options );
+  }
+  return std::make_shared<IVox<dim, node_type, PointType, grid_type>>( options );
+}
+
+/// IVox with the node type, the number of point classes (1 or 2) and the voxel fit picked at runtime, every combination is
+/// compiled in
+template <int dim, typename PointType, IVoxGridType grid_type = IVoxGridType::LINKED>
+std::shared_ptr<IVoxBase<dim, PointType>> MakeIVox( const IVoxNodeType node_type, const typename IVoxBase<dim, PointType>::Options& options,
+                                                    const int num_labels = 1 )
+{
+  if ( node_type == IVoxNodeType::PHC )
+  {
+    return MakeIVoxLabeled<dim, IVoxNodeType::PHC, PointType, grid_type>( options, num_labels );
+  }
+  if ( node_type == IVoxNodeType::QUANTIZED )
+  {
+    return MakeIVoxLabeled<dim, IVoxNodeType::QUANTIZED, PointType, grid_type>( options, num_labels );
+  }
+  return MakeIVoxLabeled<dim, IVoxNodeType::DEFAULT, PointType, grid_type>( options, num_labels );
+}
+
 }  // namespace faster_lio
 
 #endif
@@ -0,0 +1,360 @@
+#ifndef FASTER_LIO_IVOX3D_GRID_MAP_HPP
+#define FASTER_LIO_IVOX3D_GRID_MAP_HPP
+
+#include <cstdint>
+#include <limits>
+#include <list>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "eigen_types.h"
+
+namespace faster_lio
+{
+/**
+ * Voxel containers of IVox. Both keep the voxels in LRU order (front = most recently touched) and share
+ * the same interface:
+ *   Size, Find, Touch (find or create, then move to the front), PopBack (drop the least recently used),
+ *   Erase, Clear and ForEach (most to least recently used, the nodes may be modified but not the map).
+ */
+
+/// std::unordered_map of list iterators + std::list, the original ivox layout
+template <typename KeyType, typename NodeType, int dim>
+class LinkedGridMap
+{
+public:
+  inline std::size_t Size() const { return grids_map_.size(); }
+
+  inline NodeType* Find( const KeyType& key )
+  {
+    auto iter = grids_map_.find( key );
+    return iter == grids_map_.end() ? nullptr : &iter->second->second;
+  }
+
+  inline const NodeType* Find( const KeyType& key ) const
+  {
+    auto iter = grids_map_.find( key );
+    return iter == grids_map_.end() ? nullptr : &iter->second->second;
+  }
+
+  /// node of key, created by make_node() if missing, returns the node and whether it was created
+  template <typename MakeNode>
+  std::pair<NodeType*, bool> Touch( const KeyType& key, MakeNode&& make_node )
+  {
+    auto iter = grids_map_.find( key );
+    if ( iter == grids_map_.end() )
+    {
+      grids_cache_.push_front( { key, make_node() } );
+      grids_map_.insert( { key, grids_cache_.begin() } );
+      return { &grids_cache_.front().second, true };
+    }
+
+    // splice keeps the iterator valid, no need to write the map again
+    grids_cache_.splice( grids_cache_.begin(), grids_cache_, iter->second );
+    return { &iter->second->second, false };
+  }
+
+  void PopBack()
+  {
+    grids_map_.erase( grids_cache_.back().first );
+    grids_cache_.pop_back();
+  }
+
+  bool Erase( const KeyType& key )
+  {
+    auto iter = grids_map_.find( key );
+    if ( iter == grids_map_.end() )
+    {
+      return false;
+    }
+    grids_cache_.erase( iter->second );
+    grids_map_.erase( iter );
+    return true;
+  }
+
+  void Clear()
+  {
+    grids_map_.clear();
+    grids_cache_.clear();
+  }
+
+  template <typename Func>
+  void ForEach( Func&& func ) const
+  {
+    for ( const auto& it : grids_cache_ )
+    {
+      func( it.first, it.second );
+    }
+  }
+
+  template <typename Func>
+  void ForEach( Func&& func )
+  {
+    for ( auto& it : grids_cache_ )
+    {
+      func( it.first, it.second );
+    }
+  }
+
+private:
+  std::unordered_map<KeyType, typename std::list<std::pair<KeyType, NodeType>>::iterator, hash_vec<dim>> grids_map_;    // voxel hash map
+  std::list<std::pair<KeyType, NodeType>>                                                                grids_cache_;  // voxel cache
+};
+
+/**
+ * Open addressing (linear probing, backward shift deletion) table on the voxel coordinates packed into 64 bits,
+ * 21 bits per axis. The table only holds the packed key and the index of the voxel in a contiguous slab, the
+ * slab entries are chained into the LRU list by index, so touching a voxel is one probe plus a few index writes.
+ * Freed slab entries are recycled. Nodes move when the slab grows, pointers returned by Find/Touch are only
+ * valid until the next Touch.
+ */
+template <typename KeyType, typename NodeType, int dim>
+class FlatGridMap
+{
+  static_assert( dim == 3, "FlatGridMap packs 3d voxel keys" );
+
+public:
+  inline std::size_t Size() const { return size_; }
+
+  inline NodeType* Find( const KeyType& key )
+  {
+    std::size_t bucket = FindBucket( key );
+    return bucket == NPOS ? nullptr : &entries_[ buckets_[ bucket ].entry ].node;
+  }
+
+  inline const NodeType* Find( const KeyType& key ) const
+  {
+    std::size_t bucket = FindBucket( key );
+    return bucket == NPOS ? nullptr : &entries_[ buckets_[ bucket ].entry ].node;
+  }
+
+  template <typename MakeNode>
+  std::pair<NodeType*, bool> Touch( const KeyType& key, MakeNode&& make_node )
+  {
+    if ( ( size_ + 1 ) * 2 > buckets_.size() )
+    {
+      Rehash( buckets_.empty() ? 64 : buckets_.size() * 2 );
+    }
+
+    const uint64_t packed = Pack( key );
+    std::size_t    i      = Home( packed );
+    for ( ;; i = ( i + 1 ) & mask_ )
+    {
+      Bucket& bucket = buckets_[ i ];
+      if ( bucket.entry == NIL )
+      {
+        break;
+      }
+      if ( bucket.key == packed && entries_[ bucket.entry ].key == key )
+      {
+        MoveToFront( bucket.entry );
+        return { &entries_[ bucket.entry ].node, false };
+      }
+    }
+
+    uint32_t e;
+    if ( !free_.empty() )
+    {
+      e = free_.back();
+      free_.pop_back();
+      entries_[ e ].key  = key;
+      entries_[ e ].node = make_node();
+    }
+    else
+    {
+      e = entries_.size();
+      entries_.push_back( Entry{ key, NIL, NIL, make_node() } );
+    }
+    buckets_[ i ] = Bucket{ packed, e };
+    size_++;
+    LinkFront( e );
+    return { &entries_[ e ].node, true };
+  }
+
+  void PopBack()
+  {
+    if ( tail_ != NIL )
+    {
+      EraseBucket( FindBucket( entries_[ tail_ ].key ) );
+    }
+  }
+
+  bool Erase( const KeyType& key )
+  {
+    std::size_t bucket = FindBucket( key );
+    if ( bucket == NPOS )
+    {
+      return false;
+    }
+    EraseBucket( bucket );
+    return true;
+  }
+
+  void Clear()
+  {
+    buckets_.clear();
+    entries_.clear();
+    free_.clear();
+    mask_  = 0;
+    shift_ = 64;
+    size_  = 0;
+    head_  = NIL;
+    tail_  = NIL;
+  }
+
+  template <typename Func>
+  void ForEach( Func&& func ) const
+  {
+    for ( uint32_t e = head_; e != NIL; e = entries_[ e ].next )
+    {
+      func( entries_[ e ].key, entries_[ e ].node );
+    }
+  }
+
+  template <typename Func>
+  void ForEach( Func&& func )
+  {
+    for ( uint32_t e = head_; e != NIL; e = entries_[ e ].next )
+    {
+      func( static_cast<const KeyType&>( entries_[ e ].key ), entries_[ e ].node );
+    }
+  }
+
+private:
+  static constexpr uint32_t    NIL      = std::numeric_limits<uint32_t>::max();
+  static constexpr std::size_t NPOS     = std::numeric_limits<std::size_t>::max();
+  static constexpr int         KEY_BITS = 21;
+  static constexpr uint64_t    KEY_MASK = ( uint64_t( 1 ) << KEY_BITS ) - 1;
+  static constexpr int64_t     KEY_BIAS = int64_t( 1 ) << ( KEY_BITS - 1 );
+
+  struct Bucket
+  {
+    uint64_t key   = 0;    // packed voxel coordinates
+    uint32_t entry = NIL;  // index in entries_, NIL if the bucket is empty
+  };
+
+  struct Entry
+  {
+    KeyType  key;
+    uint32_t prev = NIL;  // lru neighbours
+    uint32_t next = NIL;
+    NodeType node;
+  };
+
+  /// keys beyond +-2^20 voxels alias, the full key is compared on a match anyway
+  static inline uint64_t Pack( const KeyType& key )
+  {
+    return ( ( uint64_t( key[ 0 ] + KEY_BIAS ) & KEY_MASK ) << ( 2 * KEY_BITS ) ) |
+           ( ( uint64_t( key[ 1 ] + KEY_BIAS ) & KEY_MASK ) << KEY_BITS ) | ( uint64_t( key[ 2 ] + KEY_BIAS ) & KEY_MASK );
+  }
+
+  /// fibonacci hashing, the top bits of the product are well mixed
+  inline std::size_t Home( const uint64_t packed ) const { return ( packed * 0x9E3779B97F4A7C15ull ) >> shift_; }
+
+  std::size_t FindBucket( const KeyType& key ) const
+  {
+    if ( size_ == 0 )
+    {
+      return NPOS;
+    }
+    const uint64_t packed = Pack( key );
+    for ( std::size_t i = Home( packed );; i = ( i + 1 ) & mask_ )
+    {
+      const Bucket& bucket = buckets_[ i ];
+      if ( bucket.entry == NIL )
+      {
+        return NPOS;
+      }
+      if ( bucket.key == packed && entries_[ bucket.entry ].key == key )
+      {
+        return i;
+      }
+    }
+  }
+
+  void Rehash( const std::size_t num_buckets )
+  {
+    std::vector<Bucket> old_buckets( num_buckets );
+    old_buckets.swap( buckets_ );
+    mask_ = num_buckets - 1;
+    shift_ = 64;
+    for ( std::size_t n = num_buckets; n > 1; n >>= 1 )
+    {
+      shift_--;
+    }
+
+    for ( const Bucket& bucket : old_buckets )
+    {
+      if ( bucket.entry == NIL )
+      {
+        continue;
+      }
+      std::size_t i = Home( bucket.key );
+      while ( buckets_[ i ].entry != NIL )
+      {
+        i = ( i + 1 ) & mask_;
+      }
+      buckets_[ i ] = bucket;
+    }
+  }
+
+  /// remove the voxel in bucket i and shift the following probe chain back, so no tombstones are needed
+  void EraseBucket( std::size_t i )
+  {
+    const uint32_t e = buckets_[ i ].entry;
+    for ( std::size_t j = ( i + 1 ) & mask_; buckets_[ j ].entry != NIL; j = ( j + 1 ) & mask_ )
+    {
+      std::size_t home = Home( buckets_[ j ].key );
+      if ( ( ( j - home ) & mask_ ) >= ( ( j - i ) & mask_ ) )
+      {
+        buckets_[ i ] = buckets_[ j ];
+        i             = j;
+      }
+    }
+    buckets_[ i ].entry = NIL;
+
+    Unlink( e );
+    entries_[ e ].node = NodeType();  // release the points
+    free_.push_back( e );
+    size_--;
+  }
+
+  void Unlink( const uint32_t e )
+  {
+    Entry& entry = entries_[ e ];
+    ( entry.prev == NIL ? head_ : entries_[ entry.prev ].next ) = entry.next;
+    ( entry.next == NIL ? tail_ : entries_[ entry.next ].prev ) = entry.prev;
+    entry.prev = entry.next = NIL;
+  }
+
+  void LinkFront( const uint32_t e )
+  {
+    entries_[ e ].prev = NIL;
+    entries_[ e ].next = head_;
+    ( head_ == NIL ? tail_ : entries_[ head_ ].prev ) = e;
+    head_ = e;
+  }
+
+  inline void MoveToFront( const uint32_t e )
+  {
+    if ( e != head_ )
+    {
+      Unlink( e );
+      LinkFront( e );
+    }
+  }
+
+  std::vector<Bucket>   buckets_;  // power of two, at most half full
+  std::vector<Entry>    entries_;  // voxel slab
+  std::vector<uint32_t> free_;     // recycled slab entries
+  std::size_t           mask_  = 0;
+  int                   shift_ = 64;
+  std::size_t           size_  = 0;
+  uint32_t              head_  = NIL;  // most recently used
+  uint32_t              tail_  = NIL;  // least recently used
+};
+
+}  // namespace faster_lio
+
+#endif
@@ -1,10 +1,20 @@
 #include <pcl/common/centroid.h>
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cmath>
+#include <limits>
 #include <list>
+#include <memory>
+#include <type_traits>
 #include <vector>
 
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+#define IVOX_X86_SIMD
+#endif
+
 #include "hilbert.hpp"
 
 namespace faster_lio
@@ -42,16 +52,588 @@ inline Eigen::Matrix<float, 3, 1> ToEigen<float, 3, pcl::PointXYZINormal>( const
   return pt.getVector3fMap();
 }
 
-template <typename PointT, int dim = 3>
-class IVoxNode
+/// tag of the points added without one
+constexpr uint32_t IVOX_NO_TAG = std::numeric_limits<uint32_t>::max();
+
+/// what a voxel holding max_points does with a new point
+enum class IVoxReplacePolicy
+{
+  KEEP_OLDEST,  // reject it
+  REJECT_NEAR,  // reject it, and reject any point closer than min_dist to a stored one even if not full
+  RESERVOIR,    // the n-th point replaces a random one with probability max_points / n (uniform sample)
+  NEWEST,       // replace the oldest point
+};
+
+struct IVoxInsertLimit
+{
+  std::size_t       max_points = 0;  // 0 for no limit
+  IVoxReplacePolicy policy     = IVoxReplacePolicy::KEEP_OLDEST;
+  float             min_dist2  = 0;  // squared distance for REJECT_NEAR
+};
+
+enum class IVoxInsertResult
+{
+  INSERTED,
+  REPLACED,
+  REJECTED,
+};
+
+/// splitmix64 finalizer, a cheap deterministic random source
+inline uint64_t IVoxMix64( uint64_t x )
+{
+  x ^= x >> 30;
+  x *= 0xBF58476D1CE4E5B9ull;
+  x ^= x >> 27;
+  x *= 0x94D049BB133111EBull;
+  x ^= x >> 31;
+  return x;
+}
+
+/// running first and second moments of the points inside a voxel
+template <int dim = 3>
+struct IVoxMoments
+{
+  int                             num    = 0;
+  Eigen::Matrix<double, dim, 1>   sum    = Eigen::Matrix<double, dim, 1>::Zero();
+  Eigen::Matrix<double, dim, dim> sum_sq = Eigen::Matrix<double, dim, dim>::Zero();  // sum of p * p^T
+
+  inline void Add( const Eigen::Matrix<float, dim, 1>& pt, const int weight = 1 )
+  {
+    Eigen::Matrix<double, dim, 1> p = pt.template cast<double>();
+    num += weight;
+    sum += weight * p;
+    sum_sq.noalias() += weight * p * p.transpose();
+  }
+
+  inline IVoxMoments& operator+=( const IVoxMoments& rhs )
+  {
+    num += rhs.num;
+    sum += rhs.sum;
+    sum_sq += rhs.sum_sq;
+    return *this;
+  }
+};
+
+/// line/plane model of a set of points, eigen values are in increasing order
+template <int dim = 3>
+struct IVoxFit
+{
+  using VecType = Eigen::Matrix<float, dim, 1>;
+
+  VecType centroid     = VecType::Zero();
+  VecType normal       = VecType::Zero();  // eigen vector of the smallest eigen value
+  VecType direction    = VecType::Zero();  // eigen vector of the biggest eigen value
+  VecType eigen_values = VecType::Zero();
+  float   planarity    = 0;  // (l1 - l0) / l2
+  float   linearity    = 0;  // (l2 - l1) / l2
+  int     num          = 0;
+  bool    valid        = false;
+
+  static IVoxFit FromMoments( const IVoxMoments<dim>& moments )
+  {
+    IVoxFit fit;
+    fit.num = moments.num;
+    if ( moments.num < dim )
+    {
+      return fit;
+    }
+
+    Eigen::Matrix<double, dim, 1>   mean = moments.sum / moments.num;
+    Eigen::Matrix<double, dim, dim> cov  = moments.sum_sq / moments.num - mean * mean.transpose();
+
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix<double, dim, dim>> solver;
+    solver.computeDirect( cov );
+    fit.centroid     = mean.template cast<float>();
+    fit.eigen_values = solver.eigenvalues().template cast<float>().cwiseMax( 0.0f );
+    fit.normal       = solver.eigenvectors().col( 0 ).template cast<float>();
+    fit.direction    = solver.eigenvectors().col( dim - 1 ).template cast<float>();
+    if ( fit.eigen_values( dim - 1 ) > 0 )
+    {
+      fit.planarity = ( fit.eigen_values( 1 ) - fit.eigen_values( 0 ) ) / fit.eigen_values( dim - 1 );
+      fit.linearity = ( fit.eigen_values( dim - 1 ) - fit.eigen_values( dim - 2 ) ) / fit.eigen_values( dim - 1 );
+      fit.valid     = true;
+    }
+    return fit;
+  }
+};
+
+/// fit of a voxel, invalidated on insert and refitted by the first query that needs it
+template <int dim = 3>
+class IVoxFitCache
 {
 public:
-  struct DistPoint;
+  IVoxFitCache() = default;
+  IVoxFitCache( const IVoxFitCache& rhs ) noexcept : fit_( rhs.fit_ ), state_( rhs.state_.load() ) {}
+  IVoxFitCache& operator=( const IVoxFitCache& rhs ) noexcept
+  {
+    fit_ = rhs.fit_;
+    state_.store( rhs.state_.load() );
+    return *this;
+  }
+
+  inline void Invalidate() { state_.store( DIRTY, std::memory_order_relaxed ); }
+
+  /// queries may run concurrently, only the first one to refit writes the cache
+  IVoxFit<dim> Get( const IVoxMoments<dim>& moments ) const
+  {
+    if ( state_.load( std::memory_order_acquire ) == CLEAN )
+    {
+      return fit_;
+    }
+
+    IVoxFit<dim> fit      = IVoxFit<dim>::FromMoments( moments );
+    uint8_t      expected = DIRTY;
+    if ( state_.compare_exchange_strong( expected, BUSY, std::memory_order_acquire ) )
+    {
+      fit_ = fit;
+      state_.store( CLEAN, std::memory_order_release );
+    }
+    return fit;
+  }
+
+private:
+  enum : uint8_t
+  {
+    DIRTY,
+    BUSY,
+    CLEAN,
+  };
+
+  mutable IVoxFit<dim>         fit_;
+  mutable std::atomic<uint8_t> state_{ DIRTY };
+};
+
+/// moments and cached fit a node keeps for IVox::GetClosestFit, base of the node types
+template <int dim, bool enabled>
+class IVoxFitState
+{
+public:
+  inline const IVoxMoments<dim>& GetMoments() const { return moments_; }
+
+  inline IVoxFit<dim> GetFit() const { return fit_cache_.Get( moments_ ); }
+
+protected:
+  inline void FitAdd( const Eigen::Matrix<float, dim, 1>& pt, const int weight = 1 )
+  {
+    moments_.Add( pt, weight );
+    fit_cache_.Invalidate();
+  }
+
+  inline void FitReset()
+  {
+    moments_ = IVoxMoments<dim>();
+    fit_cache_.Invalidate();
+  }
+
+private:
+  IVoxMoments<dim>  moments_;
+  IVoxFitCache<dim> fit_cache_;
+};
+
+/// nodes of a map built without fit keep and update nothing, the empty base takes no room
+template <int dim>
+class IVoxFitState<dim, false>
+{
+public:
+  /// no points as far as a fit is concerned
+  inline IVoxMoments<dim> GetMoments() const { return IVoxMoments<dim>(); }
+
+  inline IVoxFit<dim> GetFit() const { return IVoxFit<dim>(); }
+
+protected:
+  inline void FitAdd( const Eigen::Matrix<float, dim, 1>&, const int = 1 ) {}
+
+  inline void FitReset() {}
+};
+
+/// whether the point type carries an intensity field
+template <typename PointT, typename = void>
+struct HasIntensity : std::false_type
+{
+};
+
+template <typename PointT>
+struct HasIntensity<PointT, std::void_t<decltype( std::declval<PointT>().intensity )>> : std::true_type
+{
+};
+
+/// knn candidate: float squared distance and the (nearby grid slot, point index) it refers to, 8 bytes
+struct IVoxCandidate
+{
+  static constexpr int      SLOT_BITS  = 5;  // up to 32 nearby grids
+  static constexpr uint32_t INDEX_MASK = ( 1u << ( 32 - SLOT_BITS ) ) - 1;
+
+  float    dist = 0;
+  uint32_t id   = 0;
+
+  IVoxCandidate() = default;
+  IVoxCandidate( const float d, const uint32_t slot, const uint32_t idx )
+      : dist( d ), id( ( slot << ( 32 - SLOT_BITS ) ) | ( idx & INDEX_MASK ) )
+  {
+  }
+
+  inline uint32_t Slot() const { return id >> ( 32 - SLOT_BITS ); }
+
+  inline uint32_t Index() const { return id & INDEX_MASK; }
+
+  inline bool operator<( const IVoxCandidate& rhs ) const { return dist < rhs.dist; }
+};
+
+/// float threshold t with (d < t) == (double(d) < max_range^2) for every float d, so the float
+/// distances select exactly the points the double comparison did
+inline float SquaredRangeThreshold( const double max_range )
+{
+  const double range2 = max_range * max_range;
+  float        th     = static_cast<float>( range2 );
+  if ( static_cast<double>( th ) < range2 )
+  {
+    th = std::nextafter( th, std::numeric_limits<float>::infinity() );
+  }
+  return th;
+}
+
+#ifdef IVOX_X86_SIMD
+/// 8-wide part of CollectCandidates, returns the number of points handled. Compiled for avx2 only in this
+/// function so the rest of the build (and the eigen alignment it shares with pcl/gtsam) is untouched.
+/// The distance is evaluated as ( dx*dx + dy*dy ) + dz*dz without fma, bit-equal to the scalar path.
+__attribute__( ( target( "avx2" ) ) ) inline std::size_t CollectCandidatesAvx2( const float* xs, const float* ys,
+                                                                              const float* zs, const std::size_t num,
+                                                                              const float qx, const float qy,
+                                                                              const float qz, const float range2,
+                                                                              const uint32_t              slot,
+                                                                              std::vector<IVoxCandidate>& candidates )
+{
+  const __m256 vqx = _mm256_set1_ps( qx );
+  const __m256 vqy = _mm256_set1_ps( qy );
+  const __m256 vqz = _mm256_set1_ps( qz );
+  const __m256 vth = _mm256_set1_ps( range2 );
+  alignas( 32 ) float dist[ 8 ];
+
+  std::size_t i = 0;
+  for ( ; i + 8 <= num; i += 8 )
+  {
+    __m256 dx = _mm256_sub_ps( _mm256_loadu_ps( xs + i ), vqx );
+    __m256 dy = _mm256_sub_ps( _mm256_loadu_ps( ys + i ), vqy );
+    __m256 dz = _mm256_sub_ps( _mm256_loadu_ps( zs + i ), vqz );
+    __m256 d  = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( dx, dx ), _mm256_mul_ps( dy, dy ) ), _mm256_mul_ps( dz, dz ) );
+    int    mask = _mm256_movemask_ps( _mm256_cmp_ps( d, vth, _CMP_LT_OQ ) );
+    if ( mask == 0 )
+    {
+      continue;
+    }
+    _mm256_store_ps( dist, d );
+    while ( mask )
+    {
+      int j = __builtin_ctz( mask );
+      candidates.emplace_back( dist[ j ], slot, i + j );
+      mask &= mask - 1;
+    }
+  }
+  return i;
+}
+#endif
+
+/// append every point closer than sqrt(range2) to the query as a candidate, in storage order
+inline void CollectCandidates( const float* xs, const float* ys, const float* zs, const std::size_t num, const float qx,
+                               const float qy, const float qz, const float range2, const uint32_t slot,
+                               std::vector<IVoxCandidate>& candidates )
+{
+  std::size_t i = 0;
+#ifdef IVOX_X86_SIMD
+  static const bool has_avx2 = __builtin_cpu_supports( "avx2" );
+  if ( has_avx2 )
+  {
+    i = CollectCandidatesAvx2( xs, ys, zs, num, qx, qy, qz, range2, slot, candidates );
+  }
+#endif
+  for ( ; i < num; ++i )
+  {
+    float dx = xs[ i ] - qx;
+    float dy = ys[ i ] - qy;
+    float dz = zs[ i ] - qz;
+    float d  = dx * dx + dy * dy + dz * dz;
+    if ( d < range2 )
+    {
+      candidates.emplace_back( d, slot, i );
+    }
+  }
+}
+
+#ifdef IVOX_X86_SIMD
+/// 8-wide part of CollectQuantizedCandidates, same evaluation order as the scalar path
+__attribute__( ( target( "avx2" ) ) ) inline std::size_t
+CollectQuantizedCandidatesAvx2( const int16_t* xs, const int16_t* ys, const int16_t* zs, const std::size_t num,
+                                const float step, const float qx, const float qy, const float qz, const float range2,
+                                const uint32_t slot, std::vector<IVoxCandidate>& candidates )
+{
+  const __m256 vstep = _mm256_set1_ps( step );
+  const __m256 vqx   = _mm256_set1_ps( qx );
+  const __m256 vqy   = _mm256_set1_ps( qy );
+  const __m256 vqz   = _mm256_set1_ps( qz );
+  const __m256 vth   = _mm256_set1_ps( range2 );
+  alignas( 32 ) float dist[ 8 ];
+
+  std::size_t i = 0;
+  for ( ; i + 8 <= num; i += 8 )
+  {
+    __m256i ix = _mm256_cvtepi16_epi32( _mm_loadu_si128( reinterpret_cast<const __m128i*>( xs + i ) ) );
+    __m256i iy = _mm256_cvtepi16_epi32( _mm_loadu_si128( reinterpret_cast<const __m128i*>( ys + i ) ) );
+    __m256i iz = _mm256_cvtepi16_epi32( _mm_loadu_si128( reinterpret_cast<const __m128i*>( zs + i ) ) );
+    __m256  dx = _mm256_sub_ps( _mm256_mul_ps( _mm256_cvtepi32_ps( ix ), vstep ), vqx );
+    __m256  dy = _mm256_sub_ps( _mm256_mul_ps( _mm256_cvtepi32_ps( iy ), vstep ), vqy );
+    __m256  dz = _mm256_sub_ps( _mm256_mul_ps( _mm256_cvtepi32_ps( iz ), vstep ), vqz );
+    __m256  d  = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( dx, dx ), _mm256_mul_ps( dy, dy ) ), _mm256_mul_ps( dz, dz ) );
+    int     mask = _mm256_movemask_ps( _mm256_cmp_ps( d, vth, _CMP_LT_OQ ) );
+    if ( mask == 0 )
+    {
+      continue;
+    }
+    _mm256_store_ps( dist, d );
+    while ( mask )
+    {
+      int j = __builtin_ctz( mask );
+      candidates.emplace_back( dist[ j ], slot, i + j );
+      mask &= mask - 1;
+    }
+  }
+  return i;
+}
+#endif
+
+/// CollectCandidates on offsets quantized with step, the query (qx, qy, qz) is relative to the same origin
+inline void CollectQuantizedCandidates( const int16_t* xs, const int16_t* ys, const int16_t* zs, const std::size_t num,
+                                        const float step, const float qx, const float qy, const float qz,
+                                        const float range2, const uint32_t slot, std::vector<IVoxCandidate>& candidates )
+{
+  std::size_t i = 0;
+#ifdef IVOX_X86_SIMD
+  static const bool has_avx2 = __builtin_cpu_supports( "avx2" );
+  if ( has_avx2 )
+  {
+    i = CollectQuantizedCandidatesAvx2( xs, ys, zs, num, step, qx, qy, qz, range2, slot, candidates );
+  }
+#endif
+  for ( ; i < num; ++i )
+  {
+    float dx = xs[ i ] * step - qx;
+    float dy = ys[ i ] * step - qy;
+    float dz = zs[ i ] * step - qz;
+    float d  = dx * dx + dy * dy + dz * dz;
+    if ( d < range2 )
+    {
+      candidates.emplace_back( d, slot, i );
+    }
+  }
+}
+
+/// point storage of IVoxNode: structure of arrays, only the coordinates and the intensity (if any) are kept
+template <typename PointT>
+class IVoxPointStorage
+{
+public:
+  IVoxPointStorage() = default;
+  IVoxPointStorage( const PointT& center, const float& side_length ) {}
+
+  inline std::size_t Size() const { return xs_.size(); }
+
+  inline void Push( const PointT& pt )
+  {
+    xs_.emplace_back( pt.x );
+    ys_.emplace_back( pt.y );
+    zs_.emplace_back( pt.z );
+    if constexpr ( HasIntensity<PointT>::value )
+    {
+      intensities_.emplace_back( pt.intensity );
+    }
+  }
+
+  inline void Set( const std::size_t idx, const PointT& pt )
+  {
+    xs_[ idx ] = pt.x;
+    ys_[ idx ] = pt.y;
+    zs_[ idx ] = pt.z;
+    if constexpr ( HasIntensity<PointT>::value )
+    {
+      intensities_[ idx ] = pt.intensity;
+    }
+  }
+
+  /// overwrite the point at dst with the one at src, for in place compaction
+  inline void Move( const std::size_t dst, const std::size_t src )
+  {
+    xs_[ dst ] = xs_[ src ];
+    ys_[ dst ] = ys_[ src ];
+    zs_[ dst ] = zs_[ src ];
+    if constexpr ( HasIntensity<PointT>::value )
+    {
+      intensities_[ dst ] = intensities_[ src ];
+    }
+  }
+
+  inline void Resize( const std::size_t num )
+  {
+    xs_.resize( num );
+    ys_.resize( num );
+    zs_.resize( num );
+    if constexpr ( HasIntensity<PointT>::value )
+    {
+      intensities_.resize( num );
+    }
+  }
+
+  inline PointT Get( const std::size_t idx ) const
+  {
+    PointT pt;
+    pt.x = xs_[ idx ];
+    pt.y = ys_[ idx ];
+    pt.z = zs_[ idx ];
+    if constexpr ( HasIntensity<PointT>::value )
+    {
+      pt.intensity = intensities_[ idx ];
+    }
+    return pt;
+  }
+
+  inline Eigen::Vector3f Position( const std::size_t idx ) const { return Eigen::Vector3f( xs_[ idx ], ys_[ idx ], zs_[ idx ] ); }
+
+  inline float Distance2( const std::size_t idx, const PointT& pt ) const
+  {
+    float dx = xs_[ idx ] - pt.x;
+    float dy = ys_[ idx ] - pt.y;
+    float dz = zs_[ idx ] - pt.z;
+    return dx * dx + dy * dy + dz * dz;
+  }
+
+  inline void Collect( const PointT& pt, const float range2, const uint32_t slot,
+                       std::vector<IVoxCandidate>& candidates ) const
+  {
+    CollectCandidates( xs_.data(), ys_.data(), zs_.data(), xs_.size(), pt.x, pt.y, pt.z, range2, slot, candidates );
+  }
+
+private:
+  std::vector<float> xs_;
+  std::vector<float> ys_;
+  std::vector<float> zs_;
+  std::vector<float> intensities_;
+};
+
+/**
+ * compact point storage of IVoxNode: 16 bit offsets from the voxel center, 6 bytes a point instead of 12 (16 with an
+ * intensity, which is not kept). The step is side_length / 65534, every point is within half a step per axis of its
+ * input (8 um for 1 m voxels). The distances are evaluated on the offsets, dequantized in the kernel.
+ * Tags and the voxel itself come on top: about 23 bytes a point against 37 for the plain storage on a street map at
+ * 1 m resolution, see bench/ivoxNodeBench.cpp.
+ */
+template <typename PointT>
+class IVoxQuantizedStorage
+{
+public:
+  IVoxQuantizedStorage() = default;
+  IVoxQuantizedStorage( const PointT& center, const float& side_length )
+      : cx_( center.x ), cy_( center.y ), cz_( center.z ), step_( side_length / ( 2 * QMAX ) ), inv_step_( 1 / step_ )
+  {
+  }
+
+  inline std::size_t Size() const { return xs_.size(); }
+
+  inline void Push( const PointT& pt )
+  {
+    xs_.emplace_back( Quantize( pt.x, cx_ ) );
+    ys_.emplace_back( Quantize( pt.y, cy_ ) );
+    zs_.emplace_back( Quantize( pt.z, cz_ ) );
+  }
+
+  inline void Set( const std::size_t idx, const PointT& pt )
+  {
+    xs_[ idx ] = Quantize( pt.x, cx_ );
+    ys_[ idx ] = Quantize( pt.y, cy_ );
+    zs_[ idx ] = Quantize( pt.z, cz_ );
+  }
+
+  inline void Move( const std::size_t dst, const std::size_t src )
+  {
+    xs_[ dst ] = xs_[ src ];
+    ys_[ dst ] = ys_[ src ];
+    zs_[ dst ] = zs_[ src ];
+  }
+
+  inline void Resize( const std::size_t num )
+  {
+    xs_.resize( num );
+    ys_.resize( num );
+    zs_.resize( num );
+  }
+
+  /// the intensity is left to its default
+  inline PointT Get( const std::size_t idx ) const
+  {
+    PointT          pt;
+    Eigen::Vector3f p = Position( idx );
+    pt.x              = p.x();
+    pt.y              = p.y();
+    pt.z              = p.z();
+    return pt;
+  }
+
+  inline Eigen::Vector3f Position( const std::size_t idx ) const
+  {
+    return Eigen::Vector3f( cx_ + xs_[ idx ] * step_, cy_ + ys_[ idx ] * step_, cz_ + zs_[ idx ] * step_ );
+  }
+
+  inline float Distance2( const std::size_t idx, const PointT& pt ) const
+  {
+    float dx = xs_[ idx ] * step_ - ( pt.x - cx_ );
+    float dy = ys_[ idx ] * step_ - ( pt.y - cy_ );
+    float dz = zs_[ idx ] * step_ - ( pt.z - cz_ );
+    return dx * dx + dy * dy + dz * dz;
+  }
+
+  inline void Collect( const PointT& pt, const float range2, const uint32_t slot,
+                       std::vector<IVoxCandidate>& candidates ) const
+  {
+    CollectQuantizedCandidates( xs_.data(), ys_.data(), zs_.data(), xs_.size(), step_, pt.x - cx_, pt.y - cy_, pt.z - cz_,
+                                range2, slot, candidates );
+  }
+
+private:
+  static constexpr int QMAX = 32767;
+
+  /// points outside the voxel (e.g. added before a resolution change) are clamped to its border
+  inline int16_t Quantize( const float v, const float c ) const
+  {
+    long q = std::lround( ( v - c ) * inv_step_ );
+    return static_cast<int16_t>( std::clamp<long>( q, -QMAX, QMAX ) );
+  }
+
+  std::vector<int16_t> xs_;
+  std::vector<int16_t> ys_;
+  std::vector<int16_t> zs_;
+  float                cx_       = 0;
+  float                cy_       = 0;
+  float                cz_       = 0;
+  float                step_     = 0;
+  float                inv_step_ = 0;
+};
 
+/// with_fit: keep the moments of the points for GetFit
+template <typename PointT, int dim = 3, typename Storage = IVoxPointStorage<PointT>, bool with_fit = false>
+class IVoxNode : private IVoxFitState<dim, with_fit>
+{
+  using FitState = IVoxFitState<dim, with_fit>;
+
+public:
   IVoxNode() = default;
-  IVoxNode( const PointT& center, const float& side_length ) {}  /// same with phc
+  IVoxNode( const PointT& center, const float& side_length ) : points_( center, side_length ) {}  /// same with phc
 
-  void InsertPoint( const PointT& pt );
+  /// tag: owner of the point (e.g. keyframe id), used by RemovePoints
+  void InsertPoint( const PointT& pt, const uint32_t tag = IVOX_NO_TAG );
+
+  /// insert with a point cap and replacement policy
+  IVoxInsertResult InsertPoint( const PointT& pt, const uint32_t tag, const IVoxInsertLimit& limit );
+
+  /// remove the points whose tag satisfies pred, returns the number of removed points
+  template <typename Pred>
+  std::size_t RemovePoints( Pred&& pred );
 
   inline bool Empty() const;
 
@@ -59,23 +641,51 @@ public:
 
   inline PointT GetPoint( const std::size_t idx ) const;
 
-  void KNNPointByCondition( std::vector<DistPoint>& dis_points, const PointT& point, const int& K, const double& max_range );
+  using FitState::GetMoments;
+
+  /// line/plane fit of all the points in this voxel
+  using FitState::GetFit;
+
+  bool NNPoint( const PointT& cur_pt, IVoxCandidate& candidate, const uint32_t slot = 0 ) const;
+
+  /// append the K nearest points within max_range, tagged with the nearby grid slot of this node
+  void KNNPointByCondition( std::vector<IVoxCandidate>& candidates, const PointT& point, const int& K,
+                            const double& max_range, const uint32_t slot = 0 ) const;
 
 private:
-  std::vector<PointT> points_;
+  void ReplacePoint( const std::size_t idx, const PointT& pt, const uint32_t tag );
+
+  bool HasPointWithin( const PointT& pt, const float range2 ) const;
+
+  Storage               points_;
+  std::vector<uint32_t> tags_;
+  uint32_t              num_offered_ = 0;  // points offered to a capped voxel, for RESERVOIR
+  uint32_t              oldest_      = 0;  // next point replaced by NEWEST
 };
 
-template <typename PointT, int dim = 3>
-class IVoxNodePhc
+/// with_fit: keep the moments of the points for GetFit
+template <typename PointT, int dim = 3, bool with_fit = false>
+class IVoxNodePhc : private IVoxFitState<dim, with_fit>
 {
+  using FitState = IVoxFitState<dim, with_fit>;
+
 public:
-  struct DistPoint;
   struct PhcCube;
 
   IVoxNodePhc() = default;
   IVoxNodePhc( const PointT& center, const float& side_length, const int& phc_order = 6 );
 
-  void InsertPoint( const PointT& pt );
+  /// a sub cube keeps the tag of the point that created it
+  void InsertPoint( const PointT& pt, const uint32_t tag = IVOX_NO_TAG );
+
+  /// the cap applies to the sub cubes: a point that falls into an existing sub cube is always merged, one that
+  /// would create a sub cube in a full voxel is rejected (the points are already averaged per sub cube, there
+  /// is nothing to replace). REJECT_NEAR also rejects points closer than min_dist to a sub cube centroid.
+  IVoxInsertResult InsertPoint( const PointT& pt, const uint32_t tag, const IVoxInsertLimit& limit );
+
+  /// remove the sub cubes whose tag satisfies pred, returns the number of removed cubes
+  template <typename Pred>
+  std::size_t RemovePoints( Pred&& pred );
 
   void ErasePoint( const PointT& pt, const double erase_distance_th_ );
 
@@ -85,14 +695,25 @@ public:
 
   PointT GetPoint( const std::size_t idx ) const;
 
-  bool NNPoint( const PointT& cur_pt, DistPoint& dist_point ) const;
+  bool NNPoint( const PointT& cur_pt, IVoxCandidate& candidate, const uint32_t slot = 0 ) const;
+
+  void KNNPointByCondition( std::vector<IVoxCandidate>& candidates, const PointT& cur_pt, const int& K = 5,
+                            const double& max_range = 5.0, const uint32_t slot = 0 ) const;
+
+  using FitState::GetMoments;
 
-  void KNNPointByCondition( std::vector<DistPoint>& dis_points, const PointT& cur_pt, const int& K = 5,
-                            const double& max_range = 5.0 );
+  /// line/plane fit of all the points inserted into this voxel
+  using FitState::GetFit;
 
 private:
   uint32_t CalculatePhcIndex( const PointT& pt ) const;
 
+  /// first sub cube whose index is not less than idx
+  typename std::vector<PhcCube>::const_iterator LowerBound( const uint32_t idx ) const;
+
+  /// moments from the sub cube centroids, the spread inside a sub cube is lost, negligible at the sub cube size
+  void RebuildMoments();
+
 private:
   std::vector<PhcCube> phc_cubes_;
 
@@ -104,97 +725,178 @@ private:
   Eigen::Matrix<float, dim, 1> min_cube_;
 };
 
-template <typename PointT, int dim>
-struct IVoxNode<PointT, dim>::DistPoint
+template <typename PointT, int dim, typename Storage, bool with_fit>
+void IVoxNode<PointT, dim, Storage, with_fit>::InsertPoint( const PointT& pt, const uint32_t tag )
 {
-  double    dist = 0;
-  IVoxNode* node = nullptr;
-  int       idx  = 0;
+  points_.Push( pt );
+  tags_.emplace_back( tag );
+  this->FitAdd( points_.Position( points_.Size() - 1 ) );
+}
 
-  DistPoint() = default;
-  DistPoint( const double d, IVoxNode* n, const int i ) : dist( d ), node( n ), idx( i ) {}
+template <typename PointT, int dim, typename Storage, bool with_fit>
+IVoxInsertResult IVoxNode<PointT, dim, Storage, with_fit>::InsertPoint( const PointT& pt, const uint32_t tag,
+                                                                        const IVoxInsertLimit& limit )
+{
+  if ( limit.policy == IVoxReplacePolicy::REJECT_NEAR && HasPointWithin( pt, limit.min_dist2 ) )
+  {
+    return IVoxInsertResult::REJECTED;
+  }
+  if ( limit.max_points == 0 || points_.Size() < limit.max_points )
+  {
+    InsertPoint( pt, tag );
+    num_offered_++;
+    return IVoxInsertResult::INSERTED;
+  }
 
-  PointT Get() { return node->GetPoint( idx ); }
+  num_offered_++;
+  if ( limit.policy == IVoxReplacePolicy::RESERVOIR )
+  {
+    // seeded by the point itself so that a replay of the same data keeps the same sample
+    uint64_t seed = ( uint64_t( num_offered_ ) << 32 ) ^ uint64_t( int64_t( pt.x * 1024.0f ) * 73856093 ) ^
+                    uint64_t( int64_t( pt.y * 1024.0f ) * 19349663 ) ^ uint64_t( int64_t( pt.z * 1024.0f ) * 83492791 );
+    uint64_t idx  = IVoxMix64( seed ) % num_offered_;
+    if ( idx >= points_.Size() )
+    {
+      return IVoxInsertResult::REJECTED;
+    }
+    ReplacePoint( idx, pt, tag );
+    return IVoxInsertResult::REPLACED;
+  }
+  if ( limit.policy == IVoxReplacePolicy::NEWEST )
+  {
+    oldest_ %= points_.Size();
+    ReplacePoint( oldest_, pt, tag );
+    oldest_++;
+    return IVoxInsertResult::REPLACED;
+  }
+  return IVoxInsertResult::REJECTED;
+}
 
-  inline bool operator()( const DistPoint& p1, const DistPoint& p2 ) { return p1.dist < p2.dist; }
+template <typename PointT, int dim, typename Storage, bool with_fit>
+void IVoxNode<PointT, dim, Storage, with_fit>::ReplacePoint( const std::size_t idx, const PointT& pt, const uint32_t tag )
+{
+  this->FitAdd( points_.Position( idx ), -1 );
+  points_.Set( idx, pt );
+  this->FitAdd( points_.Position( idx ) );
+  tags_[ idx ] = tag;
+}
 
-  inline bool operator<( const DistPoint& rhs ) { return dist < rhs.dist; }
-};
+template <typename PointT, int dim, typename Storage, bool with_fit>
+bool IVoxNode<PointT, dim, Storage, with_fit>::HasPointWithin( const PointT& pt, const float range2 ) const
+{
+  for ( std::size_t i = 0; i < points_.Size(); ++i )
+  {
+    if ( points_.Distance2( i, pt ) < range2 )
+    {
+      return true;
+    }
+  }
+  return false;
+}
 
-template <typename PointT, int dim>
-void IVoxNode<PointT, dim>::InsertPoint( const PointT& pt )
+template <typename PointT, int dim, typename Storage, bool with_fit>
+template <typename Pred>
+std::size_t IVoxNode<PointT, dim, Storage, with_fit>::RemovePoints( Pred&& pred )
 {
-  points_.template emplace_back( pt );
+  // compact in place keeping the insertion order, the moments are rebuilt from the kept points
+  std::size_t kept = 0;
+  this->FitReset();
+  for ( std::size_t i = 0; i < tags_.size(); ++i )
+  {
+    if ( pred( tags_[ i ] ) )
+    {
+      continue;
+    }
+    points_.Move( kept, i );
+    tags_[ kept ] = tags_[ i ];
+    this->FitAdd( points_.Position( kept ) );
+    kept++;
+  }
+
+  std::size_t removed = tags_.size() - kept;
+  if ( removed > 0 )
+  {
+    points_.Resize( kept );
+    tags_.resize( kept );
+    oldest_      = 0;
+    num_offered_ = uint32_t( kept );  // the kept points are a fresh sample, otherwise RESERVOIR would rarely refill the voxel
+  }
+  return removed;
 }
 
-template <typename PointT, int dim>
-bool IVoxNode<PointT, dim>::Empty() const
+template <typename PointT, int dim, typename Storage, bool with_fit>
+bool IVoxNode<PointT, dim, Storage, with_fit>::Empty() const
 {
-  return points_.empty();
+  return points_.Size() == 0;
 }
 
-template <typename PointT, int dim>
-std::size_t IVoxNode<PointT, dim>::Size() const
+template <typename PointT, int dim, typename Storage, bool with_fit>
+std::size_t IVoxNode<PointT, dim, Storage, with_fit>::Size() const
 {
-  return points_.size();
+  return points_.Size();
 }
 
-template <typename PointT, int dim>
-PointT IVoxNode<PointT, dim>::GetPoint( const std::size_t idx ) const
+template <typename PointT, int dim, typename Storage, bool with_fit>
+PointT IVoxNode<PointT, dim, Storage, with_fit>::GetPoint( const std::size_t idx ) const
 {
-  return points_[ idx ];
+  return points_.Get( idx );
 }
 
-template <typename PointT, int dim>
-void IVoxNode<PointT, dim>::KNNPointByCondition( std::vector<DistPoint>& dis_points, const PointT& point, const int& K,
-                                                 const double& max_range )
+template <typename PointT, int dim, typename Storage, bool with_fit>
+bool IVoxNode<PointT, dim, Storage, with_fit>::NNPoint( const PointT& cur_pt, IVoxCandidate& candidate, const uint32_t slot ) const
 {
-  std::size_t old_size = dis_points.size();
+  if ( Empty() )
+  {
+    return false;
+  }
+
+  std::size_t best   = 0;
+  float       best_d = std::numeric_limits<float>::max();
+  for ( std::size_t i = 0; i < points_.Size(); ++i )
+  {
+    float d = points_.Distance2( i, cur_pt );
+    if ( d < best_d )
+    {
+      best_d = d;
+      best   = i;
+    }
+  }
+  candidate = IVoxCandidate( best_d, slot, best );
+  return true;
+}
+
+template <typename PointT, int dim, typename Storage, bool with_fit>
+void IVoxNode<PointT, dim, Storage, with_fit>::KNNPointByCondition( std::vector<IVoxCandidate>& candidates, const PointT& point,
+                                                                    const int& K, const double& max_range,
+                                                                    const uint32_t slot ) const
+{
+  std::size_t old_size = candidates.size();
 // #define INNER_TIMER
 #ifdef INNER_TIMER
   static std::unordered_map<std::string, std::vector<int64_t>> stats;
   if ( stats.empty() )
   {
     stats[ "dis" ] = std::vector<int64_t>();
-    stats[ "put" ] = std::vector<int64_t>();
     stats[ "nth" ] = std::vector<int64_t>();
   }
+  auto t0 = std::chrono::high_resolution_clock::now();
 #endif
 
-  for ( const auto& pt : points_ )
-  {
-#ifdef INNER_TIMER
-    auto t0 = std::chrono::high_resolution_clock::now();
-#endif
-    double d = distance2( pt, point );
-#ifdef INNER_TIMER
-    auto t1 = std::chrono::high_resolution_clock::now();
-#endif
-    if ( d < max_range * max_range )
-    {
-      dis_points.template emplace_back( DistPoint( d, this, &pt - points_.data() ) );
-    }
-#ifdef INNER_TIMER
-    auto t2 = std::chrono::high_resolution_clock::now();
-
-    auto dis = std::chrono::duration_cast<std::chrono::nanoseconds>( t1 - t0 ).count();
-    stats[ "dis" ].emplace_back( dis );
-    auto put = std::chrono::duration_cast<std::chrono::nanoseconds>( t2 - t1 ).count();
-    stats[ "put" ].emplace_back( put );
-#endif
-  }
+  points_.Collect( point, SquaredRangeThreshold( max_range ), slot, candidates );
 
 #ifdef INNER_TIMER
-  auto t1 = std::chrono::high_resolution_clock::now();
+  auto t1  = std::chrono::high_resolution_clock::now();
+  auto dis = std::chrono::duration_cast<std::chrono::nanoseconds>( t1 - t0 ).count();
+  stats[ "dis" ].emplace_back( dis );
 #endif
   // sort by distance
-  if ( old_size + K >= dis_points.size() )
+  if ( old_size + K >= candidates.size() )
   {
   }
   else
   {
-    std::nth_element( dis_points.begin() + old_size, dis_points.begin() + old_size + K - 1, dis_points.end() );
-    dis_points.resize( old_size + K );
+    std::nth_element( candidates.begin() + old_size, candidates.begin() + old_size + K - 1, candidates.end() );
+    candidates.resize( old_size + K );
   }
 
 #ifdef INNER_TIMER
@@ -217,34 +919,16 @@ void IVoxNode<PointT, dim>::KNNPointByCondition( std::vector<DistPoint>& dis_poi
     }
   }
 #endif
-
-  // return dis_points.size();
 }
 
-template <typename PointT, int dim>
-struct IVoxNodePhc<PointT, dim>::DistPoint
-{
-  double       dist = 0;
-  IVoxNodePhc* node = nullptr;
-  int          idx  = 0;
-
-  DistPoint() {}
-  DistPoint( const double d, IVoxNodePhc* n, const int i ) : dist( d ), node( n ), idx( i ) {}
-
-  PointT Get() { return node->GetPoint( idx ); }
-
-  inline bool operator()( const DistPoint& p1, const DistPoint& p2 ) { return p1.dist < p2.dist; }
-
-  inline bool operator<( const DistPoint& rhs ) { return dist < rhs.dist; }
-};
-
-template <typename PointT, int dim>
-struct IVoxNodePhc<PointT, dim>::PhcCube
+template <typename PointT, int dim, bool with_fit>
+struct IVoxNodePhc<PointT, dim, with_fit>::PhcCube
 {
   uint32_t                   idx = 0;
+  uint32_t                   tag = IVOX_NO_TAG;
   pcl::CentroidPoint<PointT> mean;
 
-  PhcCube( uint32_t index, const PointT& pt ) { mean.add( pt ); }
+  PhcCube( uint32_t index, const PointT& pt, uint32_t t = IVOX_NO_TAG ) : idx( index ), tag( t ) { mean.add( pt ); }
 
   void AddPoint( const PointT& pt ) { mean.add( pt ); }
 
@@ -256,51 +940,92 @@ struct IVoxNodePhc<PointT, dim>::PhcCube
   }
 };
 
-template <typename PointT, int dim>
-IVoxNodePhc<PointT, dim>::IVoxNodePhc( const PointT& center, const float& side_length, const int& phc_order )
+template <typename PointT, int dim, bool with_fit>
+IVoxNodePhc<PointT, dim, with_fit>::IVoxNodePhc( const PointT& center, const float& side_length, const int& phc_order )
     : center_( center ), side_length_( side_length ), phc_order_( phc_order )
 {
   assert( phc_order <= 8 );
   phc_side_length_     = side_length_ / ( std::pow( 2, phc_order_ ) );
   phc_side_length_inv_ = ( std::pow( 2, phc_order_ ) ) / side_length_;
   min_cube_            = center_.getArray3fMap() - side_length / 2.0;
-  phc_cubes_.reserve( 64 );
 }
 
-template <typename PointT, int dim>
-void IVoxNodePhc<PointT, dim>::InsertPoint( const PointT& pt )
+template <typename PointT, int dim, bool with_fit>
+void IVoxNodePhc<PointT, dim, with_fit>::InsertPoint( const PointT& pt, const uint32_t tag )
 {
-  uint32_t idx = CalculatePhcIndex( pt );
-
-  PhcCube cube{ idx, pt };
-  auto    it = std::lower_bound( phc_cubes_.begin(), phc_cubes_.end(), cube,
-                              []( const PhcCube& a, const PhcCube& b ) { return a.idx < b.idx; } );
+  this->FitAdd( ToEigen<float, dim>( pt ) );
 
-  if ( it == phc_cubes_.end() )
+  uint32_t idx = CalculatePhcIndex( pt );
+  auto     it  = phc_cubes_.begin() + ( LowerBound( idx ) - phc_cubes_.cbegin() );
+  if ( it != phc_cubes_.end() && it->idx == idx )
   {
-    phc_cubes_.emplace_back( cube );
+    it->AddPoint( pt );
   }
   else
   {
-    if ( it->idx == idx )
+    phc_cubes_.insert( it, PhcCube( idx, pt, tag ) );
+  }
+}
+
+template <typename PointT, int dim, bool with_fit>
+IVoxInsertResult IVoxNodePhc<PointT, dim, with_fit>::InsertPoint( const PointT& pt, const uint32_t tag, const IVoxInsertLimit& limit )
+{
+  if ( limit.policy == IVoxReplacePolicy::REJECT_NEAR )
+  {
+    for ( const auto& cube : phc_cubes_ )
     {
-      it->AddPoint( pt );
+      if ( distance2( cube.GetPoint(), pt ) < limit.min_dist2 )
+      {
+        return IVoxInsertResult::REJECTED;
+      }
     }
-    else
+  }
+  if ( limit.max_points > 0 && phc_cubes_.size() >= limit.max_points )
+  {
+    uint32_t idx = CalculatePhcIndex( pt );
+    auto     it  = LowerBound( idx );
+    if ( it == phc_cubes_.end() || it->idx != idx )
     {
-      phc_cubes_.insert( it, cube );
+      return IVoxInsertResult::REJECTED;
     }
   }
+  InsertPoint( pt, tag );
+  return IVoxInsertResult::INSERTED;
 }
 
-template <typename PointT, int dim>
-void IVoxNodePhc<PointT, dim>::ErasePoint( const PointT& pt, const double erase_distance_th_ )
+template <typename PointT, int dim, bool with_fit>
+template <typename Pred>
+std::size_t IVoxNodePhc<PointT, dim, with_fit>::RemovePoints( Pred&& pred )
 {
-  uint32_t idx = CalculatePhcIndex( pt );
+  std::size_t old_size = phc_cubes_.size();
+  phc_cubes_.erase( std::remove_if( phc_cubes_.begin(), phc_cubes_.end(), [ &pred ]( const PhcCube& cube ) { return pred( cube.tag ); } ),
+                    phc_cubes_.end() );
+  std::size_t removed = old_size - phc_cubes_.size();
+  if ( removed > 0 )
+  {
+    RebuildMoments();
+  }
+  return removed;
+}
 
-  PhcCube cube{ idx, pt };
-  auto    it = std::lower_bound( phc_cubes_.begin(), phc_cubes_.end(), cube,
-                              []( const PhcCube& a, const PhcCube& b ) { return a.idx < b.idx; } );
+template <typename PointT, int dim, bool with_fit>
+void IVoxNodePhc<PointT, dim, with_fit>::RebuildMoments()
+{
+  if constexpr ( with_fit )
+  {
+    this->FitReset();
+    for ( const auto& cube : phc_cubes_ )
+    {
+      this->FitAdd( ToEigen<float, dim>( cube.GetPoint() ), cube.mean.getSize() );
+    }
+  }
+}
+
+template <typename PointT, int dim, bool with_fit>
+void IVoxNodePhc<PointT, dim, with_fit>::ErasePoint( const PointT& pt, const double erase_distance_th_ )
+{
+  uint32_t idx = CalculatePhcIndex( pt );
+  auto     it  = LowerBound( idx );
 
   if ( erase_distance_th_ > 0 )
   {
@@ -308,145 +1033,117 @@ void IVoxNodePhc<PointT, dim>::ErasePoint( const PointT& pt, const double erase_
   if ( it != phc_cubes_.end() && it->idx == idx )
   {
     phc_cubes_.erase( it );
+    RebuildMoments();
   }
 }
 
-template <typename PointT, int dim>
-bool IVoxNodePhc<PointT, dim>::Empty() const
+template <typename PointT, int dim, bool with_fit>
+bool IVoxNodePhc<PointT, dim, with_fit>::Empty() const
 {
   return phc_cubes_.empty();
 }
 
-template <typename PointT, int dim>
-std::size_t IVoxNodePhc<PointT, dim>::Size() const
+template <typename PointT, int dim, bool with_fit>
+std::size_t IVoxNodePhc<PointT, dim, with_fit>::Size() const
 {
   return phc_cubes_.size();
 }
 
-template <typename PointT, int dim>
-PointT IVoxNodePhc<PointT, dim>::GetPoint( const std::size_t idx ) const
+template <typename PointT, int dim, bool with_fit>
+PointT IVoxNodePhc<PointT, dim, with_fit>::GetPoint( const std::size_t idx ) const
 {
   return phc_cubes_[ idx ].GetPoint();
 }
 
-template <typename PointT, int dim>
-bool IVoxNodePhc<PointT, dim>::NNPoint( const PointT& cur_pt, DistPoint& dist_point ) const
+template <typename PointT, int dim, bool with_fit>
+bool IVoxNodePhc<PointT, dim, with_fit>::NNPoint( const PointT& cur_pt, IVoxCandidate& candidate, const uint32_t slot ) const
 {
   if ( phc_cubes_.empty() )
   {
     return false;
   }
-  uint32_t cur_idx = CalculatePhcIndex( cur_pt );
-  PhcCube  cube{ cur_idx, cur_pt };
-  auto     it = std::lower_bound( phc_cubes_.begin(), phc_cubes_.end(), cube,
-                              []( const PhcCube& a, const PhcCube& b ) { return a.idx < b.idx; } );
+  auto it = LowerBound( CalculatePhcIndex( cur_pt ) );
 
+  // nearest of the two sub cubes around cur_pt along the curve
   if ( it == phc_cubes_.end() )
   {
     it--;
-    dist_point = DistPoint( distance2( cur_pt, it->GetPoint() ), this, it - phc_cubes_.begin() );
-  }
-  else if ( it == phc_cubes_.begin() )
-  {
-    dist_point = DistPoint( distance2( cur_pt, it->GetPoint() ), this, it - phc_cubes_.begin() );
   }
-  else
+  else if ( it != phc_cubes_.begin() )
   {
-    auto last_it = it;
-    last_it--;
-    double d1 = distance2( cur_pt, it->GetPoint() );
-    double d2 = distance2( cur_pt, last_it->GetPoint() );
-    if ( d1 > d2 )
+    auto last_it = it - 1;
+    if ( distance2( cur_pt, last_it->GetPoint() ) < distance2( cur_pt, it->GetPoint() ) )
     {
-      dist_point = DistPoint( d2, this, it - phc_cubes_.begin() );
-    }
-    else
-    {
-      dist_point = DistPoint( d1, this, it - phc_cubes_.begin() );
+      it = last_it;
     }
   }
-
+  candidate = IVoxCandidate( distance2( cur_pt, it->GetPoint() ), slot, it - phc_cubes_.begin() );
   return true;
 }
 
-template <typename PointT, int dim>
-void IVoxNodePhc<PointT, dim>::KNNPointByCondition( std::vector<DistPoint>& dis_points, const PointT& cur_pt,
-                                                    const int& K, const double& max_range )
+template <typename PointT, int dim, bool with_fit>
+void IVoxNodePhc<PointT, dim, with_fit>::KNNPointByCondition( std::vector<IVoxCandidate>& candidates, const PointT& cur_pt,
+                                                              const int& K, const double& max_range, const uint32_t slot ) const
 {
-  uint32_t cur_idx = CalculatePhcIndex( cur_pt );
-  PhcCube  cube{ cur_idx, cur_pt };
-  auto     it = std::lower_bound( phc_cubes_.begin(), phc_cubes_.end(), cube,
-                              []( const PhcCube& a, const PhcCube& b ) { return a.idx < b.idx; } );
-
-  const int max_search_cube_side_length = std::pow( 2, std::ceil( std::log2( max_range * phc_side_length_inv_ ) ) );
-
-  const int max_search_idx_th = 8 * max_search_cube_side_length * max_search_cube_side_length * max_search_cube_side_length;
-
-  auto create_dist_point = [ &cur_pt, this ]( typename std::vector<PhcCube>::const_iterator forward_it ) {
-    double d = distance2( forward_it->GetPoint(), cur_pt );
-    return DistPoint( d, this, forward_it - phc_cubes_.begin() );
-  };
-
-  typename std::vector<PhcCube>::const_iterator         forward_it( it );
-  typename std::vector<PhcCube>::const_reverse_iterator backward_it( it );
-  if ( it != phc_cubes_.end() )
-  {
-    dis_points.emplace_back( create_dist_point( it ) );
-    forward_it++;
-  }
-  if ( backward_it != phc_cubes_.rend() )
+  if ( phc_cubes_.empty() )
   {
-    backward_it++;
+    return;
   }
+  const std::size_t old_size = candidates.size();
+  const std::size_t max_size = old_size + K;
+  const float       range2   = SquaredRangeThreshold( max_range );
+  const uint32_t    cur_idx  = CalculatePhcIndex( cur_pt );
+
+  // sub cubes farther than this along the curve are outside a cube of side max_range around cur_pt
+  const uint64_t max_search_cube_side_length = std::max( 1.0, std::pow( 2, std::ceil( std::log2( max_range * phc_side_length_inv_ ) ) ) );
+  const uint64_t max_search_idx_th           = 8 * max_search_cube_side_length * max_search_cube_side_length * max_search_cube_side_length;
+
+  auto add_candidate = [ & ]( typename std::vector<PhcCube>::const_iterator cube_it ) {
+    float d = distance2( cube_it->GetPoint(), cur_pt );
+    if ( d < range2 )
+    {
+      candidates.emplace_back( d, slot, cube_it - phc_cubes_.begin() );
+    }
+  };
 
+  // walk both ways along the curve, nearest index first, until K sub cubes in range are found
+  auto forward_it  = LowerBound( cur_idx );  // next sub cube to visit forward
+  auto backward_it = forward_it;             // one past the next sub cube to visit backward
   auto forward_reach_boundary = [ & ]() {
     return forward_it == phc_cubes_.end() || forward_it->idx - cur_idx > max_search_idx_th;
   };
   auto backward_reach_boundary = [ & ]() {
-    return backward_it == phc_cubes_.rend() || cur_idx - backward_it->idx > max_search_idx_th;
+    return backward_it == phc_cubes_.begin() || cur_idx - ( backward_it - 1 )->idx > max_search_idx_th;
   };
 
-  while ( !forward_reach_boundary() && !backward_reach_boundary() )
+  while ( candidates.size() < max_size )
   {
-    if ( forward_it->idx - cur_idx > cur_idx - backward_it->idx )
-    {
-      dis_points.emplace_back( create_dist_point( forward_it ) );
-      forward_it++;
-    }
-    else
-    {
-      dis_points.emplace_back( create_dist_point( backward_it.base() ) );
-      backward_it++;
-    }
-    if ( dis_points.size() > K )
+    bool forward_end  = forward_reach_boundary();
+    bool backward_end = backward_reach_boundary();
+    if ( forward_end && backward_end )
     {
       break;
     }
-  }
-
-  if ( forward_reach_boundary() )
-  {
-    while ( !backward_reach_boundary() && dis_points.size() < K )
+    if ( backward_end || ( !forward_end && forward_it->idx - cur_idx <= cur_idx - ( backward_it - 1 )->idx ) )
     {
-      dis_points.emplace_back( create_dist_point( backward_it.base() ) );
-      backward_it++;
+      add_candidate( forward_it++ );
     }
-  }
-
-  if ( backward_reach_boundary() )
-  {
-    while ( !forward_reach_boundary() && dis_points.size() < K )
+    else
     {
-      dis_points.emplace_back( create_dist_point( forward_it ) );
-      forward_it++;
+      add_candidate( --backward_it );
     }
   }
+}
 
-  return dis_points.size();
+template <typename PointT, int dim, bool with_fit>
+typename std::vector<typename IVoxNodePhc<PointT, dim, with_fit>::PhcCube>::const_iterator
+IVoxNodePhc<PointT, dim, with_fit>::LowerBound( const uint32_t idx ) const
+{
+  return std::lower_bound( phc_cubes_.begin(), phc_cubes_.end(), idx, []( const PhcCube& a, const uint32_t b ) { return a.idx < b; } );
 }
 
-template <typename PointT, int dim>
-uint32_t IVoxNodePhc<PointT, dim>::CalculatePhcIndex( const PointT& pt ) const
+template <typename PointT, int dim, bool with_fit>
+uint32_t IVoxNodePhc<PointT, dim, with_fit>::CalculatePhcIndex( const PointT& pt ) const
 {
   Eigen::Matrix<float, dim, 1> eposf = ( pt.getVector3fMap() - min_cube_ ) * phc_side_length_inv_;
   Eigen::Matrix<int, dim, 1>   eposi = eposf.template cast<int>();
@@ -456,9 +1153,9 @@ uint32_t IVoxNodePhc<PointT, dim>::CalculatePhcIndex( const PointT& pt ) const
     {
       eposi( i, 0 ) = 0;
     }
-    if ( eposi( i, 0 ) > std::pow( 2, phc_order_ ) )
+    if ( eposi( i, 0 ) >= ( 1 << phc_order_ ) )
     {
-      eposi( i, 0 ) = std::pow( 2, phc_order_ ) - 1;
+      eposi( i, 0 ) = ( 1 << phc_order_ ) - 1;
     }
   }
   std::array<uint8_t, 3> apos{ eposi( 0 ), eposi( 1 ), eposi( 2 ) };
@@ -468,4 +1165,78 @@ uint32_t IVoxNodePhc<PointT, dim>::CalculatePhcIndex( const PointT& pt ) const
   return idx;
 }
 
+/**
+ * voxel holding the points of num_labels classes (e.g. corner and surf features) apart, one node per class. The
+ * classes share the voxel key and lru entry of the map. Label 0 is stored inline, the other ones are allocated on
+ * their first point, so label 0 should be the class present in most voxels. A single class is the plain node.
+ */
+template <typename NodeType, int num_labels = 1>
+class IVoxLabeledNode
+{
+public:
+  IVoxLabeledNode() = default;
+
+  template <typename PointT>
+  IVoxLabeledNode( const PointT& center, const float& side_length ) : node_( center, side_length )
+  {
+  }
+
+  /// node of label, nullptr if the voxel holds no point of it
+  inline const NodeType* Find( const int label ) const { return label == 0 ? &node_ : more_[ label - 1 ].get(); }
+
+  /// node of label, created by make_node() if missing
+  template <typename MakeNode>
+  inline NodeType& Touch( const int label, MakeNode&& make_node )
+  {
+    if ( label == 0 )
+    {
+      return node_;
+    }
+    auto& node = more_[ label - 1 ];
+    if ( !node )
+    {
+      node.reset( new NodeType( make_node() ) );
+    }
+    return *node;
+  }
+
+  /// remove the points of every class whose tag satisfies pred, returns the number of removed points
+  template <typename Pred>
+  std::size_t RemovePoints( Pred&& pred )
+  {
+    std::size_t removed = node_.RemovePoints( pred );
+    for ( auto& node : more_ )
+    {
+      if ( node )
+      {
+        removed += node->RemovePoints( pred );
+        if ( node->Empty() )
+        {
+          node.reset();
+        }
+      }
+    }
+    return removed;
+  }
+
+  inline bool Empty() const
+  {
+    return node_.Empty() && std::all_of( more_.begin(), more_.end(), []( const std::unique_ptr<NodeType>& node ) { return !node || node->Empty(); } );
+  }
+
+  inline std::size_t Size() const
+  {
+    std::size_t size = node_.Size();
+    for ( const auto& node : more_ )
+    {
+      size += node ? node->Size() : 0;
+    }
+    return size;
+  }
+
+private:
+  NodeType                                              node_;  // label 0
+  std::array<std::unique_ptr<NodeType>, num_labels - 1> more_;  // labels 1 and up, null until their first point
+};
+
 }  // namespace faster_lio
@@ -15,10 +15,15 @@
 #include <GeographicLib/Geocentric.hpp>
 #include <GeographicLib/LocalCartesian.hpp>
 
+#include "ikd_tree/ikd_tree.h"
 #include "ivox3d/ivox3d.h"
 #include "lio_sam/cloud_info.h"
 #include "lio_sam/save_map.h"
 #include "utility/dataType.hpp"
+#include "utility/cowVector.hpp"
+#include "utility/doubleBuffer.hpp"
+#include "utility/keyFrameStore.hpp"
+#include "utility/lruCache.hpp"
 #include "utility/paramServer.hpp"
 #include "utility/statisticsAccumulator.h"
 #include "utility/timer.h"
@@ -30,8 +35,10 @@ using gtsam::symbol_shorthand::G;  // GPS pose
 using gtsam::symbol_shorthand::V;  // Vel   (xdot,ydot,zdot)
 using gtsam::symbol_shorthand::X;  // Pose3 (x,y,z,r,p,y)
 // ivox
-using IVoxType    = faster_lio::IVox<3, faster_lio::IVoxNodeType::DEFAULT, PointType>;
-using PointVector = std::vector<PointType, Eigen::aligned_allocator<PointType>>;
+// node type picked by iVoxNodeType at startup, see allocateMemory
+using IVoxType     = faster_lio::IVoxBase<3, PointType>;
+using PointVector  = std::vector<PointType, Eigen::aligned_allocator<PointType>>;
+using AffineVector = std::vector<Eigen::Affine3f, Eigen::aligned_allocator<Eigen::Affine3f>>;
 
 
 namespace lio_sam
@@ -46,14 +53,59 @@ private:
   lin::Timer        timerLin;
 
   // ivox
-  bool                     needCorrectFlag = false;
-  std::vector<PointVector> nearestCornerPoints;
-  std::vector<PointVector> nearestSurfPoints;
-
-  IVoxType::Options         iVoxOptions;
-  std::shared_ptr<IVoxType> iVoxCornerMap = nullptr;
-  std::shared_ptr<IVoxType> iVoxSurfMap   = nullptr;
-  std::shared_ptr<IVoxType> iVoxGlobalMap = nullptr;
+  bool                         needCorrectFlag = false;
+  std::vector<PointVector>     nearestCornerPoints;
+  std::vector<PointVector>     nearestSurfPoints;
+  std::map<int, PointTypePose> iVoxKeyFramePoses;       // keyframes in the ivox map and the pose their points were inserted with
+  std::deque<int>              iVoxStaleKeyFrames;      // keyframes to re-insert after a pose correction, nearest first
+  PointType                    lastIVoxExtractPose;     // latest keyframe at the last surrounding keyframes search
+  bool                         iVoxExtractFlag = true;  // search the surrounding keyframes on the next scan
+
+  // selected features of a scan and their closest map points, see searchNearestIVox
+  struct IVoxBatchQuery
+  {
+    PointVector           points;    // features in the map frame
+    std::vector<int>      index;     // feature index of each point
+    PointVector           nearest;   // 5 closest map points of each point
+    std::vector<int>      numFound;  // number of closest points found for each point
+    std::vector<uint32_t> order;     // search order, kept over the iterations of a scan
+  };
+  IVoxBatchQuery iVoxCornerQuery;
+  IVoxBatchQuery iVoxSurfQuery;
+
+  // corner and surf maps, always updated together
+  struct IVoxMaps
+  {
+    std::shared_ptr<IVoxType> corner;
+    std::shared_ptr<IVoxType> surf;  // same map as corner with iVoxSharedMap
+
+    /// func on each distinct map, for the operations on every point class (window, keyframe removal)
+    template <typename Func>
+    void forEach( Func&& func )
+    {
+      func( *corner );
+      if ( surf != corner )
+      {
+        func( *surf );
+      }
+    }
+  };
+
+  IVoxType::Options                       iVoxOptions;
+  std::unique_ptr<DoubleBuffer<IVoxMaps>> iVoxBuffer;                 // map updates go through it, see iVoxAsyncUpdate
+  IVoxType::Window                        iVoxWindow;                 // sliding window of the maps, tracked here so it is known before the updates are applied
+  std::shared_ptr<IVoxType>               iVoxCornerMap   = nullptr;  // published maps, read by scan-to-map
+  std::shared_ptr<IVoxType>               iVoxSurfMap     = nullptr;
+  std::shared_ptr<IVoxType>               iVoxGlobalMap   = nullptr;
+  int                                     iVoxCornerLabel = 0;        // point class of the features in their map
+  int                                     iVoxSurfLabel   = 0;
+
+  // ikd-tree
+  IkdTree<PointType> ikdCornerMap;
+  IkdTree<PointType> ikdSurfMap;
+  std::set<int>      ikdKeyFrames;                             // keyframes whose points were added to the ikd-tree maps
+  Eigen::Vector3f    ikdMapCenter = Eigen::Vector3f::Zero();  // center of the cube kept in the maps, see updateIkdTreeMapBox
+  bool               ikdMapInit   = false;
 
   // gtsam
   gtsam::NonlinearFactorGraph gtSAMgraph;
@@ -61,7 +113,33 @@ private:
   gtsam::Values               optimizedEstimate;
   gtsam::ISAM2*               isam;
   gtsam::Values               isamCurrentEstimate;
-  Eigen::MatrixXd             poseCovariance;
+  Eigen::MatrixXd             poseCovariance;                // latest keyframe, empty until needed, see updatePoseCovariance
+  double                      poseCovarianceTime   = -1;     // scan it was computed or asked for at
+  bool                        poseCovarianceWanted = false;  // ask poseGraphThread for it with the next update
+  int                         poseCovarianceMinKey = 0;      // first keyframe solved with the last loop or gps factor
+
+  // factors of the keyframes sent to poseGraphThread and what comes back, see asyncPoseGraph
+  struct PoseGraphUpdate
+  {
+    gtsam::NonlinearFactorGraph graph;
+    gtsam::Values               estimate;
+    bool                        correction = false;  // loop or gps factors, the poses of every keyframe may move
+    bool                        covariance = false;  // the marginal covariance of the last keyframe is wanted
+    int                         firstKey   = std::numeric_limits<int>::max();  // oldest key pose of its loop factors
+  };
+  struct PoseGraphResult
+  {
+    gtsam::Values   estimate;    // all keyframes solved so far, only with a correction
+    Eigen::MatrixXd covariance;  // only when asked for
+    int             covarianceKey = -1;  // keyframe of the covariance, the newest one solved
+    int             firstKey      = std::numeric_limits<int>::max();  // oldest key pose of the loop factors solved
+    bool            correction    = false;
+  };
+  std::deque<PoseGraphUpdate> poseGraphQueue;
+  PoseGraphResult             poseGraphResult;
+  bool                        poseGraphResultReady = false;
+  std::mutex                  mtxPoseGraph;  // poseGraphQueue and poseGraphResult
+  std::condition_variable     poseGraphCondition;
 
   // ros
   ros::Publisher pubLaserCloudSurround;
@@ -94,13 +172,23 @@ private:
   std::deque<nav_msgs::Odometry> gpsQueue;
   lio_sam::cloud_info            cloudInfo;
 
-  std::vector<pcl::PointCloud<PointType>::Ptr> cornerCloudKeyFrames;
-  std::vector<pcl::PointCloud<PointType>::Ptr> surfCloudKeyFrames;
+  KeyFrameStore<PointType> cornerCloudKeyFrames;  // in the keyframe frame, 16 bit quantized
+  KeyFrameStore<PointType> surfCloudKeyFrames;
 
   pcl::PointCloud<PointType>::Ptr     cloudKeyPoses3D;
   pcl::PointCloud<PointTypePose>::Ptr cloudKeyPoses6D;
-  pcl::PointCloud<PointType>::Ptr     copy_cloudKeyPoses3D;
-  pcl::PointCloud<PointTypePose>::Ptr copy_cloudKeyPoses6D;
+  AffineVector                        keyPoseTransforms;  // pose of each keyframe as a matrix, kept with cloudKeyPoses6D
+
+  // key poses for the loop closure, visualization and save map threads, a new version is published after each change
+  struct KeyPoses
+  {
+    CowVector<PointType>       poses3D;
+    CowVector<PointTypePose>   poses6D;
+    CowVector<Eigen::Affine3f> transforms;
+  };
+  KeyPoses                        keyPosesWorking;   // written by the mapping thread only
+  std::shared_ptr<const KeyPoses> keyPosesSnapshot;  // latest version, only through std::atomic_load / std::atomic_store
+  std::shared_ptr<const KeyPoses> loopKeyPoses;      // version the current loop closure search runs on
 
   pcl::PointCloud<PointType>::Ptr laserCloudCornerLast;    // corner feature set from odoOptimization
   pcl::PointCloud<PointType>::Ptr laserCloudSurfLast;      // surf feature set from odoOptimization
@@ -116,18 +204,34 @@ private:
   std::vector<PointType> laserCloudOriSurfVec;  // surf point holder for parallel computation
   std::vector<PointType> coeffSelSurfVec;
   std::vector<bool>      laserCloudOriSurfFlag;
-
-  std::map<int, std::pair<pcl::PointCloud<PointType>, pcl::PointCloud<PointType>>> laserCloudMapContainer;
-  pcl::PointCloud<PointType>::Ptr                                                  laserCloudCornerFromMap;
-  pcl::PointCloud<PointType>::Ptr                                                  laserCloudSurfFromMap;
-  pcl::PointCloud<PointType>::Ptr                                                  laserCloudCornerFromMapDS;
-  pcl::PointCloud<PointType>::Ptr                                                  laserCloudSurfFromMapDS;
+  std::vector<bool>      laserCloudCornerSelectFlag;  // corner points kept by observability-driven selection
+  std::vector<bool>      laserCloudSurfSelectFlag;    // surf points kept by observability-driven selection
+  std::vector<int>       laserCloudOriSourceInd;      // index of each combined residual in corner (then surf) feature set
+
+  pcl::PointCloud<PointType>::Ptr laserCloudCornerFromMap;
+  pcl::PointCloud<PointType>::Ptr laserCloudSurfFromMap;
+  pcl::PointCloud<PointType>::Ptr laserCloudCornerFromMapDS;
+  pcl::PointCloud<PointType>::Ptr laserCloudSurfFromMapDS;
+
+  // transformed corner and surf clouds of the keyframes, by keyframe and pose version
+  using KeyFrameClouds   = std::pair<pcl::PointCloud<PointType>, pcl::PointCloud<PointType>>;
+  using KeyFrameCacheKey = std::pair<int, int>;
+  struct KeyFrameCacheKeyHash
+  {
+    std::size_t operator()( const KeyFrameCacheKey& key ) const
+    {
+      return std::hash<uint64_t>()( ( (uint64_t)key.first << 32 ) | (uint32_t)key.second );
+    }
+  };
+  using KeyFrameCache = LruCache<KeyFrameCacheKey, KeyFrameClouds, KeyFrameCacheKeyHash>;
+  std::unique_ptr<KeyFrameCache> laserCloudMapContainer;
+  std::vector<int>               keyPoseVersions;           // bumped when a correction moves the keyframe past the cache thresholds
+  AffineVector                   keyPoseVersionTransforms;  // pose of each keyframe at its latest version
 
   pcl::KdTreeFLANN<PointType>::Ptr kdtreeCornerFromMap;
   pcl::KdTreeFLANN<PointType>::Ptr kdtreeSurfFromMap;
 
-  pcl::KdTreeFLANN<PointType>::Ptr kdtreeSurroundingKeyPoses;
-  pcl::KdTreeFLANN<PointType>::Ptr kdtreeHistoryKeyPoses;
+  IkdTree<PointType> keyPoseIndex;  // positions of cloudKeyPoses3D, intensity is the keyframe index
 
   pcl::VoxelGrid<PointType> downSizeFilterCorner;
   pcl::VoxelGrid<PointType> downSizeFilterSurf;
@@ -144,6 +248,7 @@ private:
 
   std::mutex mtx;
   std::mutex mtxLoopInfo;
+  std::mutex mtxKeyPoseIndex;  // keyPoseIndex updates and its queries from other threads than the mapping one
 
   bool    isDegenerate = false;
   cv::Mat matP;
@@ -153,6 +258,8 @@ private:
   int laserCloudCornerLastDSNum    = 0;
   int laserCloudSurfLastDSNum      = 0;
 
+  static constexpr int minResidualNum = 50;  // scan-to-map gives up below it, the residual subsampling keeps at least that many
+
   // loop closure
   bool                                                 aLoopIsClosed = false;
   std::map<int, int>                                   loopIndexContainer;  // from new to old
@@ -161,6 +268,12 @@ private:
   std::vector<gtsam::noiseModel::Diagonal::shared_ptr> loopNoiseQueue;
   std::deque<std_msgs::Float64MultiArray>              loopInfoVec;
 
+  // what a loop or gps correction can move, see correctPoses
+  std::vector<std::pair<int, int>> loopFactorSpans;                                      // oldest and newest key pose of each loop factor
+  int                              loopFactorFirstKey = std::numeric_limits<int>::max();  // oldest key pose of the loop factors not solved yet
+  int                              correctionFirstKey = std::numeric_limits<int>::max();  // same for the solve correctPoses applies
+  bool                             gpsFactorAdded     = false;                            // absolute factors, a correction may move any key pose
+
   nav_msgs::Path keyFramePath;
   nav_msgs::Path realtimePath;
 
@@ -179,7 +292,7 @@ public:
   void                            gpsHandler( const nav_msgs::Odometry::ConstPtr& gpsMsg );
   void                            gpsHandler( const sensor_msgs::NavSatFixConstPtr& gpsMsg );
   void                            pointAssociateToMap( PointType const* const pi, PointType* const po );
-  pcl::PointCloud<PointType>::Ptr transformPointCloud( pcl::PointCloud<PointType>::Ptr cloudIn, PointTypePose* transformIn );
+  void                            transformPointCloud( const pcl::PointCloud<PointType>& cloudIn, const Eigen::Affine3f& transform, pcl::PointCloud<PointType>& cloudOut );
   gtsam::Pose3                    pclPointTogtsamPose3( PointTypePose thisPoint );
   gtsam::Pose3                    trans2gtsamPose( float transformIn[] );
   Eigen::Affine3f                 pclPointToAffine3f( PointTypePose thisPoint );
@@ -189,18 +302,31 @@ public:
   void                            visualizeGlobalMapThread();
   void                            publishGlobalMap();
   void                            loopClosureThread();
+  void                            poseGraphThread();
   void                            loopInfoHandler( const std_msgs::Float64MultiArray::ConstPtr& loopMsg );
   void                            performLoopClosure();
   bool                            detectLoopClosureDistance( int* latestID, int* closestID );
   bool                            detectLoopClosureExternal( int* latestID, int* closestID );
   void                            loopFindNearKeyframes( pcl::PointCloud<PointType>::Ptr& nearKeyframes, const int& key, const int& searchNum );
   void                            visualizeLoopClosure();
+  void                            publishKeyPoseSnapshot();
   void                            updateInitialGuess();
   void                            extractForLoopClosure();
   void                            extractNearby();
   void                            extractCloud( pcl::PointCloud<PointType>::Ptr cloudToExtract );
+  KeyFrameCache::ValuePtr         getTransformedKeyFrame( int keyInd );
+  void                            extractLocalMap( pcl::PointCloud<PointType>& cornerOut, pcl::PointCloud<PointType>& surfOut );
   void                            extractCloudForIVox( pcl::PointCloud<PointType>::Ptr cloudToExtract );
+  void                            addKeyFrameToIVox( int keyInd );
+  void                            queueStaleIVoxKeyFrames();
+  void                            reinsertStaleIVoxKeyFrames();
+  void                            updateIVoxWindow();
+  void                            extractCloudForIkdTree( pcl::PointCloud<PointType>::Ptr cloudToExtract );
+  void                            addKeyFrameToIkdTree( int keyInd );
+  void                            updateIkdTreeMapBox();
   void                            candidatePointsForIVox( const PointVector& points );
+  void                            searchNearestIVox( IVoxType& iVoxMap, int label, const pcl::PointCloud<PointType>::Ptr& cloud, int cloudNum,
+                                                     const std::vector<bool>& selectFlag, IVoxBatchQuery& query );
   void                            extractSurroundingKeyFrames();
   void                            downsampleCurrentScan();
   void                            updatePointAssociateToMap();
@@ -209,6 +335,7 @@ public:
   void                            surfOptimization();
   void                            surfOptimizationIVox();
   void                            combineOptimizationCoeffs();
+  bool                            selectObservableFeatures( cv::Mat& matA, cv::Mat& matB );
   bool                            LMOptimization( int iterCount );
   void                            scan2MapOptimization();
   void                            scan2MapOptimizationIVox();
@@ -216,10 +343,12 @@ public:
   bool                            saveFrame();
   void                            addOdomFactor();
   void                            addGPSFactor();
+  void                            updatePoseCovariance();
   void                            addLoopFactor();
   void                            saveKeyFramesAndFactor();
   void                            correctPoses();
-  void                            updatePath( const PointTypePose& pose_in );
+  void                            applyPoseGraphResult();
+  void                            updatePath( const PointTypePose& pose_in, int index = -1 );
   void                            publishOdometry();
   void                            publishFrames();
   void                            publishTransform();
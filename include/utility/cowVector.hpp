@@ -0,0 +1,62 @@
+#pragma once
+
+#include <Eigen/Core>
+#include <memory>
+#include <vector>
+
+/**
+ * Vector stored in fixed size chunks shared between copies, a copy costs one pointer per chunk and a write copies only
+ * the chunk it lands in if another copy still holds it. The owner thread keeps one as the working copy and hands out
+ * copies as immutable snapshots, which are then read without any lock while the owner goes on writing.
+ */
+template <typename T, std::size_t ChunkSize = 256>
+class CowVector
+{
+public:
+  std::size_t size() const { return size_; }
+  bool        empty() const { return size_ == 0; }
+
+  const T& operator[]( std::size_t i ) const { return ( *chunks_[ i / ChunkSize ] )[ i % ChunkSize ]; }
+  const T& back() const { return ( *this )[ size_ - 1 ]; }
+
+  void push_back( const T& value )
+  {
+    if ( size_ % ChunkSize == 0 )
+    {
+      chunks_.push_back( std::make_shared<Chunk>() );
+      chunks_.back()->reserve( ChunkSize );
+    }
+    writable( chunks_.size() - 1 ).push_back( value );
+    size_++;
+  }
+
+  void set( std::size_t i, const T& value ) { writable( i / ChunkSize )[ i % ChunkSize ] = value; }
+
+  template <typename Container>
+  void copyTo( Container& out ) const
+  {
+    out.clear();
+    out.reserve( size_ );
+    for ( const auto& chunk : chunks_ )
+    {
+      out.insert( out.end(), chunk->begin(), chunk->end() );
+    }
+  }
+
+private:
+  using Chunk = std::vector<T, Eigen::aligned_allocator<T>>;
+
+  Chunk& writable( std::size_t c )
+  {
+    // only copies made from this one share its chunks, once they are gone the count can not go up again
+    if ( chunks_[ c ].use_count() > 1 )
+    {
+      chunks_[ c ] = std::make_shared<Chunk>( *chunks_[ c ] );
+      chunks_[ c ]->reserve( ChunkSize );
+    }
+    return *chunks_[ c ];
+  }
+
+  std::vector<std::shared_ptr<Chunk>> chunks_;
+  std::size_t                         size_ = 0;
+};
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+/**
+ * Two copies of a structure, one read by the owner thread (front) and one updated by a background thread (back).
+ * publish() swaps them between two reads, then the updates of the new front are replayed on the new back before
+ * any newer update, so both copies see every update in the same order. The updates must not depend on anything
+ * but the structure and what they captured, they run twice.
+ * Without async there is a single copy and apply() runs the update right away.
+ */
+template <typename T>
+class DoubleBuffer
+{
+public:
+  using Update = std::function<void( T& )>;
+
+  /// make is called once per copy
+  DoubleBuffer( const std::function<std::shared_ptr<T>()>& make, bool async ) : front_( make() )
+  {
+    if ( async )
+    {
+      back_   = make();
+      worker_ = std::thread( &DoubleBuffer::run, this );
+    }
+  }
+
+  ~DoubleBuffer()
+  {
+    if ( worker_.joinable() )
+    {
+      {
+        std::lock_guard<std::mutex> lock( mutex_ );
+        stop_ = true;
+      }
+      cond_.notify_one();
+      worker_.join();
+    }
+  }
+
+  DoubleBuffer( const DoubleBuffer& )            = delete;
+  DoubleBuffer& operator=( const DoubleBuffer& ) = delete;
+
+  /// copy to read, only changes in publish()
+  T& front() { return *front_; }
+
+  void apply( Update update )
+  {
+    if ( !worker_.joinable() )
+    {
+      update( *front_ );
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock( mutex_ );
+      pending_.push_back( std::move( update ) );
+    }
+    cond_.notify_one();
+  }
+
+  /**
+   * make the updates applied to the back copy so far visible, never waits for the worker. If it is in the middle
+   * of an update the swap is left for the next call and the worker holds back until then.
+   * @return whether the copies were swapped
+   */
+  bool publish()
+  {
+    if ( !worker_.joinable() )
+    {
+      return false;
+    }
+    {
+      std::lock_guard<std::mutex> lock( mutex_ );
+      // the replay runs first, so the back copy is ahead of the front one as soon as applied_ is not empty
+      if ( applied_.empty() )
+      {
+        return false;
+      }
+      if ( busy_ )
+      {
+        publishRequested_ = true;
+        return false;
+      }
+      std::swap( front_, back_ );
+      replay_.swap( applied_ );
+      publishRequested_ = false;
+    }
+    cond_.notify_one();
+    return true;
+  }
+
+private:
+  void run()
+  {
+    std::unique_lock<std::mutex> lock( mutex_ );
+    for ( ;; )
+    {
+      cond_.wait( lock, [ this ] { return stop_ || !replay_.empty() || ( !pending_.empty() && !publishRequested_ ); } );
+      if ( stop_ )
+      {
+        return;
+      }
+
+      const bool replay = !replay_.empty();
+      auto&      queue  = replay ? replay_ : pending_;
+      Update     update = std::move( queue.front() );
+      queue.pop_front();
+      busy_ = true;
+
+      lock.unlock();
+      update( *back_ );
+      lock.lock();
+
+      busy_ = false;
+      if ( !replay )
+      {
+        applied_.push_back( std::move( update ) );
+      }
+    }
+  }
+
+  std::shared_ptr<T>      front_;
+  std::shared_ptr<T>      back_;
+  std::deque<Update>      pending_;  // not applied to any copy yet
+  std::deque<Update>      applied_;  // applied to the back copy only
+  std::deque<Update>      replay_;   // applied to the front copy only, replayed on the back one first
+  bool                    busy_             = false;
+  bool                    publishRequested_ = false;
+  bool                    stop_             = false;
+  std::mutex              mutex_;
+  std::condition_variable cond_;
+  std::thread             worker_;
+};
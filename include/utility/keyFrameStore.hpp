@@ -0,0 +1,293 @@
+#pragma once
+
+#include <pcl/point_cloud.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <Eigen/Geometry>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * Feature clouds of the keyframes in their own frame, each point as 16 bit xyz and an 8 bit intensity (8 bytes instead
+ * of the 32 of a pcl point). The steps are per cloud: xyz is off by at most half of the largest coordinate / 32767,
+ * intensity by half of its range / 255. A cloud is appended once and never changes, the points are kept in chunks that
+ * are never modified once full, so clouds can be decoded by other threads while new ones are added.
+ * After spillTo() the oldest full chunks past the memory budget are appended to a file and read back through a memory
+ * map, the os then keeps in ram only the pages read lately.
+ */
+template <typename PointT>
+class KeyFrameStore
+{
+public:
+  explicit KeyFrameStore( std::size_t chunkPoints = 1 << 16 ) : chunkPoints_( chunkPoints ) {}
+
+  ~KeyFrameStore()
+  {
+    if ( fd_ >= 0 )
+    {
+      // the mapped chunks still held by a decode keep the data
+      chunks_.clear();
+      ::close( fd_ );
+    }
+  }
+
+  KeyFrameStore( const KeyFrameStore& )            = delete;
+  KeyFrameStore& operator=( const KeyFrameStore& ) = delete;
+
+  /**
+   * keep at most memoryBytes of points in ram, older chunks go to a new file named pathPrefix and a unique suffix.
+   * The name is removed right away, so other processes spilling to the same directory never see the file and it goes
+   * away with the last descriptor or mapping, even after a crash
+   * @return false if the file can not be created, everything then stays in ram
+   */
+  bool spillTo( const std::string& pathPrefix, std::size_t memoryBytes )
+  {
+    std::string path = pathPrefix + "XXXXXX";
+    int         fd   = ::mkstemp( &path[ 0 ] );
+    if ( fd < 0 )
+    {
+      return false;
+    }
+    ::unlink( path.c_str() );
+    std::lock_guard<std::mutex> lock( mutex_ );
+    fd_          = fd;
+    memoryBytes_ = memoryBytes;
+    return true;
+  }
+
+  /// store a cloud given in the frame of its keyframe, returns its index
+  int add( const pcl::PointCloud<PointT>& cloud )
+  {
+    Cloud entry;
+    entry.size = cloud.size();
+
+    float maxAbs       = 0;
+    float intensityMin = entry.size > 0 ? cloud.points[ 0 ].intensity : 0;
+    float intensityMax = intensityMin;
+    for ( const PointT& point : cloud.points )
+    {
+      maxAbs       = std::max( { maxAbs, std::abs( point.x ), std::abs( point.y ), std::abs( point.z ) } );
+      intensityMin = std::min( intensityMin, point.intensity );
+      intensityMax = std::max( intensityMax, point.intensity );
+    }
+    entry.step          = maxAbs > 0 ? maxAbs / 32767.0f : 1.0f;
+    entry.intensityMin  = intensityMin;
+    entry.intensityStep = intensityMax > intensityMin ? ( intensityMax - intensityMin ) / 255.0f : 1.0f;
+
+    Point* points;
+    int    index;
+    {
+      std::lock_guard<std::mutex> lock( mutex_ );
+      if ( chunks_.empty() || chunks_.back().used + entry.size > chunks_.back().size )
+      {
+        Chunk chunk;
+        chunk.size = std::max( chunkPoints_, entry.size );
+        chunk.data.reset( new Point[ chunk.size ], std::default_delete<Point[]>() );
+        chunks_.push_back( chunk );
+        residentBytes_ += chunk.size * sizeof( Point );
+      }
+      Chunk& chunk = chunks_.back();
+      entry.chunk  = chunks_.size() - 1;
+      entry.offset = chunk.used;
+      points       = chunk.data.get() + chunk.used;
+      chunk.used += entry.size;
+      numPoints_ += entry.size;
+      index = clouds_.size();
+    }
+
+    // only this thread writes, the entry is published once the points are there
+    const float scale          = 1.0f / entry.step;
+    const float intensityScale = 1.0f / entry.intensityStep;
+    for ( std::size_t i = 0; i < entry.size; ++i )
+    {
+      const PointT& point = cloud.points[ i ];
+      points[ i ].x       = quantize( point.x * scale );
+      points[ i ].y       = quantize( point.y * scale );
+      points[ i ].z       = quantize( point.z * scale );
+      points[ i ].i       = (uint8_t)std::min( 255.0f, std::round( ( point.intensity - entry.intensityMin ) * intensityScale ) );
+    }
+    {
+      std::lock_guard<std::mutex> lock( mutex_ );
+      clouds_.push_back( entry );
+    }
+
+    spill();
+    return index;
+  }
+
+  /// append cloud index, moved by transform (its keyframe pose for the map frame), to cloudOut
+  void decode( int index, const Eigen::Affine3f& transform, pcl::PointCloud<PointT>& cloudOut ) const
+  {
+    Cloud                        entry;
+    std::shared_ptr<const Point> data;  // keeps a chunk spilled meanwhile alive
+    {
+      std::lock_guard<std::mutex> lock( mutex_ );
+      entry = clouds_[ index ];
+      data  = chunks_[ entry.chunk ].data;
+    }
+    const Point* points = data.get() + entry.offset;
+
+    const std::size_t offset = cloudOut.size();
+    cloudOut.resize( offset + entry.size );
+
+    // the step is folded into the rotation, a point is then three four lane multiply-adds as for float clouds
+    const Eigen::Matrix4f& trans = transform.matrix();
+    const Eigen::Vector4f  col0  = trans.col( 0 ) * entry.step;
+    const Eigen::Vector4f  col1  = trans.col( 1 ) * entry.step;
+    const Eigen::Vector4f  col2  = trans.col( 2 ) * entry.step;
+    const Eigen::Vector4f  col3  = trans.col( 3 );
+    for ( std::size_t i = 0; i < entry.size; ++i )
+    {
+      const Point& point       = points[ i ];
+      PointT&      pointTo     = cloudOut.points[ offset + i ];
+      pointTo.getVector4fMap() = col0 * (float)point.x + col1 * (float)point.y + col2 * (float)point.z + col3;
+      pointTo.intensity        = entry.intensityMin + point.i * entry.intensityStep;
+    }
+  }
+
+  /// start reading the spilled clouds first to last (clamped) from disk in the background, see madvise
+  void prefetch( int first, int last ) const
+  {
+    std::lock_guard<std::mutex> lock( mutex_ );
+    first = std::max( first, 0 );
+    last  = std::min( last, (int)clouds_.size() - 1 );
+    for ( int i = first; i <= last; ++i )
+    {
+      const Cloud& entry = clouds_[ i ];
+      const Chunk& chunk = chunks_[ entry.chunk ];
+      if ( chunk.spilled && entry.size > 0 )
+      {
+        const uintptr_t begin = (uintptr_t)( chunk.data.get() + entry.offset ) & ~( pageSize() - 1 );
+        const uintptr_t end   = (uintptr_t)( chunk.data.get() + entry.offset + entry.size );
+        ::madvise( (void*)begin, end - begin, MADV_WILLNEED );
+      }
+    }
+  }
+
+  int size() const
+  {
+    std::lock_guard<std::mutex> lock( mutex_ );
+    return clouds_.size();
+  }
+
+  std::size_t numPoints() const
+  {
+    std::lock_guard<std::mutex> lock( mutex_ );
+    return numPoints_;
+  }
+
+  /// memory held by the chunks still in ram and the cloud table
+  std::size_t bytes() const
+  {
+    std::lock_guard<std::mutex> lock( mutex_ );
+    return residentBytes_ + clouds_.capacity() * sizeof( Cloud );
+  }
+
+  /// size of the spill file
+  std::size_t spilledBytes() const
+  {
+    std::lock_guard<std::mutex> lock( mutex_ );
+    return fileBytes_;
+  }
+
+private:
+  struct Point
+  {
+    int16_t x, y, z;
+    uint8_t i;
+  };
+
+  struct Cloud
+  {
+    std::size_t chunk  = 0;
+    std::size_t offset = 0;  // first point in the chunk
+    std::size_t size   = 0;
+    float       step;           // meters per xyz unit
+    float       intensityMin;
+    float       intensityStep;  // intensity per unit
+  };
+
+  struct Chunk
+  {
+    std::shared_ptr<Point> data;
+    std::size_t            size    = 0;  // points
+    std::size_t            used    = 0;  // points used by clouds
+    bool                   spilled = false;
+  };
+
+  static int16_t quantize( float v ) { return (int16_t)std::max( -32767.0f, std::min( 32767.0f, std::round( v ) ) ); }
+
+  static uintptr_t pageSize() { return ::sysconf( _SC_PAGESIZE ); }
+
+  /// move the oldest full chunks in ram to the file until the budget holds, the current chunk always stays
+  void spill()
+  {
+    for ( ;; )
+    {
+      std::shared_ptr<Point> data;
+      std::size_t            bytes;
+      std::size_t            index;
+      off_t                  fileOffset;
+      {
+        std::lock_guard<std::mutex> lock( mutex_ );
+        if ( fd_ < 0 || residentBytes_ <= memoryBytes_ || nextSpill_ + 1 >= chunks_.size() )
+        {
+          return;
+        }
+        index      = nextSpill_;
+        data       = chunks_[ index ].data;
+        bytes      = chunks_[ index ].used * sizeof( Point );
+        fileOffset = fileBytes_;
+      }
+
+      // the chunk is full and never written again, so it is copied out without the lock
+      void* mapped = MAP_FAILED;
+      if ( bytes > 0 && ::pwrite( fd_, data.get(), bytes, fileOffset ) == (ssize_t)bytes )
+      {
+        mapped = ::mmap( nullptr, bytes, PROT_READ, MAP_SHARED, fd_, fileOffset );
+      }
+
+      std::lock_guard<std::mutex> lock( mutex_ );
+      Chunk& chunk = chunks_[ index ];
+      if ( mapped != MAP_FAILED )
+      {
+        chunk.data.reset( (Point*)mapped, [ bytes ]( Point* p ) { ::munmap( p, bytes ); } );
+        chunk.spilled = true;
+        // the next chunk starts on a page for mmap
+        fileBytes_ = ( fileOffset + bytes + pageSize() - 1 ) & ~( pageSize() - 1 );
+      }
+      else if ( bytes > 0 )
+      {
+        // disk full or similar, keep the rest in ram
+        ::close( fd_ );
+        fd_ = -1;
+        return;
+      }
+      else
+      {
+        // nothing to write, the memory goes as it is no longer counted
+        chunk.data.reset();
+      }
+      residentBytes_ -= chunk.size * sizeof( Point );
+      nextSpill_++;
+    }
+  }
+
+  std::vector<Chunk> chunks_;
+  std::vector<Cloud> clouds_;
+  std::size_t        chunkPoints_;         // points of a chunk, larger for a larger cloud
+  std::size_t        numPoints_     = 0;
+  std::size_t        residentBytes_ = 0;   // chunks in ram
+  std::size_t        memoryBytes_   = 0;   // budget of the chunks in ram once spilling
+  std::size_t        fileBytes_     = 0;
+  std::size_t        nextSpill_     = 0;   // oldest chunk still in ram
+  int                fd_            = -1;  // spill file, already unlinked
+  mutable std::mutex mutex_;
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+
+/**
+ * Least recently used cache of immutable values bounded by their size in bytes. get() hands out shared pointers,
+ * so an evicted value stays alive as long as a caller still holds it. Not thread safe.
+ */
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class LruCache
+{
+public:
+  using ValuePtr = std::shared_ptr<const Value>;
+
+  explicit LruCache( std::size_t capacity_bytes ) : capacity_( capacity_bytes ) {}
+
+  /// the value of key, marked as the most recently used, or nullptr
+  ValuePtr get( const Key& key )
+  {
+    auto it = index_.find( key );
+    if ( it == index_.end() )
+    {
+      misses_++;
+      return nullptr;
+    }
+    hits_++;
+    entries_.splice( entries_.begin(), entries_, it->second );
+    return it->second->value;
+  }
+
+  /// insert or replace the value of key, then evict the least recently used values until the budget holds
+  void put( const Key& key, ValuePtr value, std::size_t bytes )
+  {
+    erase( key );
+    entries_.push_front( Entry{ key, std::move( value ), bytes } );
+    index_.emplace( key, entries_.begin() );
+    bytes_ += bytes;
+
+    // the value just inserted is kept even if it is larger than the whole budget
+    while ( bytes_ > capacity_ && entries_.size() > 1 )
+    {
+      evicted_++;
+      erase( entries_.back().key );
+    }
+  }
+
+  void erase( const Key& key )
+  {
+    auto it = index_.find( key );
+    if ( it == index_.end() )
+    {
+      return;
+    }
+    bytes_ -= it->second->bytes;
+    entries_.erase( it->second );
+    index_.erase( it );
+  }
+
+  void clear()
+  {
+    entries_.clear();
+    index_.clear();
+    bytes_ = 0;
+  }
+
+  std::size_t size() const { return entries_.size(); }
+  std::size_t bytes() const { return bytes_; }
+  std::size_t hits() const { return hits_; }
+  std::size_t misses() const { return misses_; }
+  std::size_t evicted() const { return evicted_; }
+
+private:
+  struct Entry
+  {
+    Key         key;
+    ValuePtr    value;
+    std::size_t bytes;
+  };
+
+  std::list<Entry>                                                   entries_;  // most recently used first
+  std::unordered_map<Key, typename std::list<Entry>::iterator, Hash> index_;
+  std::size_t                                                        capacity_;
+  std::size_t                                                        bytes_   = 0;
+  std::size_t                                                        hits_    = 0;
+  std::size_t                                                        misses_  = 0;
+  std::size_t                                                        evicted_ = 0;
+};
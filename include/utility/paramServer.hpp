@@ -30,6 +30,7 @@ public:
   bool  useGpsElevation;
   float gpsCovThreshold;
   float poseCovThreshold;
+  float poseCovarianceInterval;
 
   // Save pcd
   bool        savePCD;
@@ -69,6 +70,7 @@ public:
   int   surfFeatureMinValidNum;
   float edgeDistanceThreshold;
   float surfDistanceThreshold;
+  int   maxResidualNum;
 
   // voxel filter paprams
   float odometrySurfLeafSize;
@@ -87,6 +89,18 @@ public:
   float surroundingkeyframeAddingAngleThreshold;
   float surroundingKeyframeDensity;
   float surroundingKeyframeSearchRadius;
+  float surroundingKeyframeCacheSize;
+  float surroundingKeyframeCacheDistThreshold;
+  float surroundingKeyframeCacheAngleThreshold;
+  float keyPoseCorrectDistThreshold;
+  float keyPoseCorrectAngleThreshold;
+
+  // Keyframe storage
+  float       keyFrameMemoryLimit;
+  std::string keyFrameSpillDirectory;
+
+  // Pose graph
+  bool asyncPoseGraph;
 
   // Loop closure
   bool  loopClosureEnableFlag;
@@ -106,9 +120,26 @@ public:
   float neighborSearchRadius;
   bool  dynamicSearchRadiusFlag;
   bool  useIVox;
+  bool  useIVoxFit;
+  float iVoxFitMinLinearity;
+  float iVoxFitMinPlanarity;
   float iVoxCapacity;
   float iVoxResolution;
   int   iVoxType;
+  float iVoxCorrectDistThreshold;
+  float iVoxCorrectAngleThreshold;
+  int   iVoxCorrectKeyFramesPerScan;
+  float iVoxExtractDistThreshold;
+  int   iVoxWindowType;
+  float iVoxWindowSize;
+  int   iVoxNodeType;
+  int   iVoxMaxPointsPerGrid;
+  int   iVoxReplacePolicy;
+  float iVoxMinPointDistance;
+  bool  iVoxAsyncUpdate;
+  bool  iVoxSharedMap;
+  bool  useIkdTree;
+  float ikdTreeMapSize;
 
   // gravity
   bool  gravityOptimizationFlag;
@@ -133,6 +164,7 @@ public:
     nh.param<bool>( "lio_sam/useGpsElevation", useGpsElevation, false );
     nh.param<float>( "lio_sam/gpsCovThreshold", gpsCovThreshold, 2.0 );
     nh.param<float>( "lio_sam/poseCovThreshold", poseCovThreshold, 25.0 );
+    nh.param<float>( "lio_sam/poseCovarianceInterval", poseCovarianceInterval, 1.0 );
 
     nh.param<bool>( "lio_sam/savePCD", savePCD, false );
     nh.param<std::string>( "lio_sam/savePCDDirectory", savePCDDirectory, "/Downloads/LOAM/" );
@@ -192,6 +224,7 @@ public:
     nh.param<int>( "lio_sam/surfFeatureMinValidNum", surfFeatureMinValidNum, 100 );
     nh.param<float>( "lio_sam/edgeDistanceThreshold", edgeDistanceThreshold, 0.1 );
     nh.param<float>( "lio_sam/surfDistanceThreshold", surfDistanceThreshold, 0.1 );
+    nh.param<int>( "lio_sam/maxResidualNum", maxResidualNum, 0 );
 
     nh.param<float>( "lio_sam/odometrySurfLeafSize", odometrySurfLeafSize, 0.2 );
     nh.param<float>( "lio_sam/mappingCornerLeafSize", mappingCornerLeafSize, 0.2 );
@@ -207,6 +240,16 @@ public:
     nh.param<float>( "lio_sam/surroundingkeyframeAddingAngleThreshold", surroundingkeyframeAddingAngleThreshold, 0.2 );
     nh.param<float>( "lio_sam/surroundingKeyframeDensity", surroundingKeyframeDensity, 1.0 );
     nh.param<float>( "lio_sam/surroundingKeyframeSearchRadius", surroundingKeyframeSearchRadius, 50.0 );
+    nh.param<float>( "lio_sam/surroundingKeyframeCacheSize", surroundingKeyframeCacheSize, 512.0 );
+    nh.param<float>( "lio_sam/surroundingKeyframeCacheDistThreshold", surroundingKeyframeCacheDistThreshold, 0.05 );
+    nh.param<float>( "lio_sam/surroundingKeyframeCacheAngleThreshold", surroundingKeyframeCacheAngleThreshold, 0.005 );
+    nh.param<float>( "lio_sam/keyPoseCorrectDistThreshold", keyPoseCorrectDistThreshold, 0.001 );
+    nh.param<float>( "lio_sam/keyPoseCorrectAngleThreshold", keyPoseCorrectAngleThreshold, 0.0002 );
+
+    nh.param<float>( "lio_sam/keyFrameMemoryLimit", keyFrameMemoryLimit, 0.0 );
+    nh.param<std::string>( "lio_sam/keyFrameSpillDirectory", keyFrameSpillDirectory, "/tmp/" );
+
+    nh.param<bool>( "lio_sam/asyncPoseGraph", asyncPoseGraph, false );
 
     nh.param<bool>( "lio_sam/loopClosureEnableFlag", loopClosureEnableFlag, false );
     nh.param<float>( "lio_sam/loopClosureFrequency", loopClosureFrequency, 1.0 );
@@ -223,9 +266,26 @@ public:
     nh.param<float>( "lio_sam/neighborSearchRadius", neighborSearchRadius, 2.0 );
     nh.param<bool>( "lio_sam/dynamicSearchRadiusFlag", dynamicSearchRadiusFlag, false );
     nh.param<bool>( "lio_sam/useIVox", useIVox, false );
+    nh.param<bool>( "lio_sam/useIVoxFit", useIVoxFit, false );
+    nh.param<float>( "lio_sam/iVoxFitMinLinearity", iVoxFitMinLinearity, 0.67 );
+    nh.param<float>( "lio_sam/iVoxFitMinPlanarity", iVoxFitMinPlanarity, 0.3 );
     nh.param<int>( "lio_sam/iVoxType", iVoxType, 2 );
     nh.param<float>( "lio_sam/iVoxCapacity", iVoxCapacity, 500000 );
     nh.param<float>( "lio_sam/iVoxResolution", iVoxResolution, 0.2 );
+    nh.param<float>( "lio_sam/iVoxCorrectDistThreshold", iVoxCorrectDistThreshold, 0.05 );
+    nh.param<float>( "lio_sam/iVoxCorrectAngleThreshold", iVoxCorrectAngleThreshold, 0.005 );
+    nh.param<int>( "lio_sam/iVoxCorrectKeyFramesPerScan", iVoxCorrectKeyFramesPerScan, 10 );
+    nh.param<float>( "lio_sam/iVoxExtractDistThreshold", iVoxExtractDistThreshold, 5.0 );
+    nh.param<int>( "lio_sam/iVoxWindowType", iVoxWindowType, 0 );
+    nh.param<float>( "lio_sam/iVoxWindowSize", iVoxWindowSize, 100.0 );
+    nh.param<int>( "lio_sam/iVoxNodeType", iVoxNodeType, 0 );
+    nh.param<int>( "lio_sam/iVoxMaxPointsPerGrid", iVoxMaxPointsPerGrid, 0 );
+    nh.param<int>( "lio_sam/iVoxReplacePolicy", iVoxReplacePolicy, 0 );
+    nh.param<float>( "lio_sam/iVoxMinPointDistance", iVoxMinPointDistance, 0.1 );
+    nh.param<bool>( "lio_sam/iVoxAsyncUpdate", iVoxAsyncUpdate, false );
+    nh.param<bool>( "lio_sam/iVoxSharedMap", iVoxSharedMap, false );
+    nh.param<bool>( "lio_sam/useIkdTree", useIkdTree, false );
+    nh.param<float>( "lio_sam/ikdTreeMapSize", ikdTreeMapSize, 200.0 );
 
     nh.param<bool>( "lio_sam/gravityOptimizationFlag", gravityOptimizationFlag, false );
     nh.param<float>( "lio_sam/gravityNoise", gravityNoise, 0.001 );
@@ -11,6 +11,7 @@
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <mutex>
 #include <numeric>
 #include <string>
 
@@ -48,6 +49,7 @@ public:
     auto t2        = std::chrono::high_resolution_clock::now();
     auto time_used = std::chrono::duration_cast<std::chrono::duration<double>>( t2 - t1 ).count() * 1000;
 
+    std::lock_guard<std::mutex> lock( mutex_ );
     if ( records_.find( func_name ) != records_.end() )
     {
       records_[ func_name ].time_usage_in_ms_.emplace_back( time_used );
@@ -63,6 +65,7 @@ public:
   /// print the run time
   static void PrintAll()
   {
+    std::lock_guard<std::mutex> lock( mutex_ );
     std::cout << BOLDGREEN << ">>> ===== Printing run time =====" << std::endl;
     for ( const auto& r : records_ )
     {
@@ -87,6 +90,8 @@ public:
       LOG( INFO ) << "Dump Time Records into file: " << file_name;
     }
 
+    std::lock_guard<std::mutex> lock( mutex_ );
+
     size_t max_length = 0;
     for ( const auto& iter : records_ )
     {
@@ -119,6 +124,7 @@ public:
   /// get the average time usage of a function
   static double GetMeanTime( const std::string& func_name )
   {
+    std::lock_guard<std::mutex> lock( mutex_ );
     if ( records_.find( func_name ) == records_.end() )
     {
       return 0.0;
@@ -130,10 +136,15 @@ public:
   }
 
   /// clean the records
-  static void Clear() { records_.clear(); }
+  static void Clear()
+  {
+    std::lock_guard<std::mutex> lock( mutex_ );
+    records_.clear();
+  }
 
 private:
   static std::map<std::string, TimerRecord> records_;
+  static std::mutex                         mutex_;  // records_, functions may be timed from several threads
 };
 
 }  // namespace faster_lio
@@ -50,10 +50,12 @@
 #include <iostream>
 #include <iterator>
 #include <limits>
+#include <map>
 #include <mutex>
 #include <opencv2/imgproc.hpp>
 #include <pcl/search/impl/search.hpp>
 #include <queue>
+#include <set>
 #include <sstream>
 #include <string>
 #include <thread>
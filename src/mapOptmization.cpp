@@ -43,9 +43,45 @@ MapOptimization::MapOptimization() : firstGps( false )
 
 MapOptimization::~MapOptimization()
 {
+  // the map update worker decodes from the keyframe stores, which are destroyed before it otherwise
+  iVoxBuffer.reset();
+
   std::cout << "MapOptimization destructor called." << std::endl;
   std::cout << BOLDGREEN << "Time Consumed: " << timeAverage.getAverage() << " ms Per Scan." << RESET << std::endl;
   faster_lio::Timer::PrintAll();
+
+  if ( useIVox )
+  {
+    auto printIVoxStats = []( const std::string& name, const IVoxType& iVox ) {
+      const IVoxType::Stats& stats = iVox.GetStats();
+      std::cout << BOLDGREEN << "[ " << name << " ] resident voxels: " << iVox.NumValidGrids() << ", points: " << iVox.NumPoints()
+                << ", window evicted voxels: " << stats.window_evicted_grids_ << ", capacity evicted voxels: " << stats.capacity_evicted_grids_
+                << ", rejected points: " << stats.rejected_points_ << ", replaced points: " << stats.replaced_points_ << RESET << std::endl;
+    };
+    if ( iVoxSharedMap )
+    {
+      printIVoxStats( "iVoxSharedMap", *iVoxCornerMap );
+    }
+    else
+    {
+      printIVoxStats( "iVoxCornerMap", *iVoxCornerMap );
+      printIVoxStats( "iVoxSurfMap", *iVoxSurfMap );
+    }
+  }
+  else if ( useIkdTree )
+  {
+    auto printIkdTreeStats = []( const std::string& name, const IkdTree<PointType>& tree ) {
+      const IkdTree<PointType>::Stats& stats = tree.GetStats();
+      std::cout << BOLDGREEN << "[ " << name << " ] points: " << tree.Size() << ", nodes: " << tree.NumNodes()
+                << ", rebuilds: " << stats.rebuilds_ << ", rebuilt points: " << stats.rebuilt_points_
+                << ", deleted points: " << stats.deleted_points_ << RESET << std::endl;
+    };
+    printIkdTreeStats( "ikdCornerMap", ikdCornerMap );
+    printIkdTreeStats( "ikdSurfMap", ikdSurfMap );
+  }
+  std::cout << BOLDGREEN << "Keyframe clouds: " << cornerCloudKeyFrames.size() << ", points: " << cornerCloudKeyFrames.numPoints() + surfCloudKeyFrames.numPoints()
+            << ", memory: " << ( cornerCloudKeyFrames.bytes() + surfCloudKeyFrames.bytes() ) / 1048576.0 << " MB"
+            << ", on disk: " << ( cornerCloudKeyFrames.spilledBytes() + surfCloudKeyFrames.spilledBytes() ) / 1048576.0 << " MB" << RESET << std::endl;
 }
 
 void MapOptimization::allocateMemory()
@@ -53,8 +89,9 @@ void MapOptimization::allocateMemory()
   ROS_INFO( "Resetting mapLocalization" );
 
   // IVox
-  iVoxOptions.resolution_ = iVoxResolution;
-  iVoxOptions.capacity_   = iVoxCapacity;
+  iVoxOptions.resolution_  = iVoxResolution;
+  iVoxOptions.capacity_    = iVoxCapacity;
+  iVoxOptions.num_threads_ = numberOfCores;
   if ( iVoxType == 0 )
   {
     iVoxOptions.nearby_type_ = IVoxType::NearbyType::CENTER;
@@ -76,17 +113,78 @@ void MapOptimization::allocateMemory()
     ROS_ERROR( "Invalid iVoxType! Check Param Yaml!!!" );
     ros::shutdown();
   }
+  if ( iVoxWindowType == 0 )
+  {
+    iVoxOptions.window_type_ = IVoxType::WindowType::NONE;
+  }
+  else if ( iVoxWindowType == 1 )
+  {
+    iVoxOptions.window_type_ = IVoxType::WindowType::RADIUS;
+  }
+  else if ( iVoxWindowType == 2 )
+  {
+    iVoxOptions.window_type_ = IVoxType::WindowType::BOX;
+  }
+  else
+  {
+    ROS_ERROR( "Invalid iVoxWindowType! Check Param Yaml!!!" );
+    ros::shutdown();
+  }
+  iVoxOptions.window_size_         = iVoxWindowSize;
+  iVoxOptions.window_step_         = iVoxResolution;
+  iVoxOptions.max_points_per_grid_ = std::max( iVoxMaxPointsPerGrid, 0 );
+  iVoxOptions.min_point_distance_  = iVoxMinPointDistance;
+  iVoxOptions.fit_                 = useIVoxFit;  // the voxels only keep moments when they are matched against
+  if ( iVoxReplacePolicy < 0 || iVoxReplacePolicy > 3 )
+  {
+    ROS_ERROR( "Invalid iVoxReplacePolicy! Check Param Yaml!!!" );
+    ros::shutdown();
+  }
+  iVoxOptions.replace_policy_ = static_cast<faster_lio::IVoxReplacePolicy>( iVoxReplacePolicy );
 
-  iVoxCornerMap = std::make_shared<IVoxType>( iVoxOptions );
-  iVoxSurfMap   = std::make_shared<IVoxType>( iVoxOptions );
+  if ( iVoxNodeType < 0 || iVoxNodeType > 2 )
+  {
+    ROS_ERROR( "Invalid iVoxNodeType! Check Param Yaml!!!" );
+    ros::shutdown();
+  }
+  faster_lio::IVoxNodeType iVoxNode = static_cast<faster_lio::IVoxNodeType>( iVoxNodeType );
+
+  // with iVoxSharedMap the features are kept apart by label in the voxels of a single map, the surf points are
+  // found in most voxels and get the inline label 0
+  iVoxCornerLabel = iVoxSharedMap ? 1 : 0;
+  iVoxSurfLabel   = 0;
+
+  // IVoxGridType::LINKED for the original unordered_map + std::list voxel container
+  auto makeIVoxMaps = [ this, iVoxNode ]() {
+    auto maps    = std::make_shared<IVoxMaps>();
+    maps->corner = faster_lio::MakeIVox<3, PointType, faster_lio::IVoxGridType::FLAT>( iVoxNode, iVoxOptions, iVoxSharedMap ? 2 : 1 );
+    maps->surf   = iVoxSharedMap ? maps->corner : faster_lio::MakeIVox<3, PointType, faster_lio::IVoxGridType::FLAT>( iVoxNode, iVoxOptions );
+    return maps;
+  };
+  iVoxBuffer.reset( new DoubleBuffer<IVoxMaps>( makeIVoxMaps, iVoxAsyncUpdate ) );
+  iVoxCornerMap = iVoxBuffer->front().corner;
+  iVoxSurfMap   = iVoxBuffer->front().surf;
+  iVoxWindow    = IVoxType::Window( iVoxOptions );
 
   cloudKeyPoses3D.reset( new pcl::PointCloud<PointType>() );
   cloudKeyPoses6D.reset( new pcl::PointCloud<PointTypePose>() );
-  copy_cloudKeyPoses3D.reset( new pcl::PointCloud<PointType>() );
-  copy_cloudKeyPoses6D.reset( new pcl::PointCloud<PointTypePose>() );
+  keyPosesSnapshot = std::make_shared<const KeyPoses>();
 
-  kdtreeSurroundingKeyPoses.reset( new pcl::KdTreeFLANN<PointType>() );
-  kdtreeHistoryKeyPoses.reset( new pcl::KdTreeFLANN<PointType>() );
+  laserCloudMapContainer.reset( new KeyFrameCache( (std::size_t)( surroundingKeyframeCacheSize * 1024 * 1024 ) ) );
+
+  if ( keyFrameMemoryLimit > 0 )
+  {
+    // the budget is shared by the corner and surf clouds
+    std::size_t memoryBytes = (std::size_t)( keyFrameMemoryLimit * 1024 * 1024 / 2 );
+    if ( !cornerCloudKeyFrames.spillTo( keyFrameSpillDirectory + "corner_keyframes_", memoryBytes ) )
+    {
+      ROS_WARN( "Can not create a keyframe spill file in %s, the corner clouds stay in memory.", keyFrameSpillDirectory.c_str() );
+    }
+    if ( !surfCloudKeyFrames.spillTo( keyFrameSpillDirectory + "surf_keyframes_", memoryBytes ) )
+    {
+      ROS_WARN( "Can not create a keyframe spill file in %s, the surf clouds stay in memory.", keyFrameSpillDirectory.c_str() );
+    }
+  }
 
   laserCloudCornerLast.reset( new pcl::PointCloud<PointType>() );    // corner feature set from odoOptimization
   laserCloudSurfLast.reset( new pcl::PointCloud<PointType>() );      // surf feature set from odoOptimization
@@ -102,9 +200,13 @@ void MapOptimization::allocateMemory()
   laserCloudOriSurfVec.resize( N_SCAN * Horizon_SCAN );
   coeffSelSurfVec.resize( N_SCAN * Horizon_SCAN );
   laserCloudOriSurfFlag.resize( N_SCAN * Horizon_SCAN );
+  laserCloudCornerSelectFlag.resize( N_SCAN * Horizon_SCAN );
+  laserCloudSurfSelectFlag.resize( N_SCAN * Horizon_SCAN );
 
   std::fill( laserCloudOriCornerFlag.begin(), laserCloudOriCornerFlag.end(), false );
   std::fill( laserCloudOriSurfFlag.begin(), laserCloudOriSurfFlag.end(), false );
+  std::fill( laserCloudCornerSelectFlag.begin(), laserCloudCornerSelectFlag.end(), true );
+  std::fill( laserCloudSurfSelectFlag.begin(), laserCloudSurfSelectFlag.end(), true );
 
   laserCloudCornerFromMap.reset( new pcl::PointCloud<PointType>() );
   laserCloudSurfFromMap.reset( new pcl::PointCloud<PointType>() );
@@ -150,18 +252,33 @@ void MapOptimization::laserCloudInfoHandler( const lio_sam::cloud_infoConstPtr &
       faster_lio::Timer::Evaluate( [ &, this ]() { extractSurroundingKeyFrames(); }, "extractSurroundingKeyFramesIVox" );
       faster_lio::Timer::Evaluate( [ &, this ]() { downsampleCurrentScan(); }, "downsampleCurrentScanIVox" );
       faster_lio::Timer::Evaluate( [ &, this ]() { scan2MapOptimizationIVox(); }, "scan2MapOptimizationIVox" );
+      if ( asyncPoseGraph )
+      {
+        // the pose graph is solved in the background, the scan-to-map pose goes out right away
+        faster_lio::Timer::Evaluate( [ &, this ]() { publishOdometry(); }, "publishOdometryIVox" );
+      }
       faster_lio::Timer::Evaluate( [ &, this ]() { saveKeyFramesAndFactor(); }, "saveKeyFramesAndFactorIVox" );
       faster_lio::Timer::Evaluate( [ &, this ]() { correctPoses(); }, "correctPosesIVox" );
-      faster_lio::Timer::Evaluate( [ &, this ]() { publishOdometry(); }, "publishOdometryIVox" );
+      if ( !asyncPoseGraph )
+      {
+        faster_lio::Timer::Evaluate( [ &, this ]() { publishOdometry(); }, "publishOdometryIVox" );
+      }
       faster_lio::Timer::Evaluate( [ &, this ]() { publishFrames(); }, "publishFramesIVox" );
 #else
       updateInitialGuess();
       extractSurroundingKeyFrames();
       downsampleCurrentScan();
       scan2MapOptimizationIVox();
+      if ( asyncPoseGraph )
+      {
+        publishOdometry();
+      }
       saveKeyFramesAndFactor();
       correctPoses();
-      publishOdometry();
+      if ( !asyncPoseGraph )
+      {
+        publishOdometry();
+      }
       publishFrames();
 #endif
     }
@@ -172,18 +289,32 @@ void MapOptimization::laserCloudInfoHandler( const lio_sam::cloud_infoConstPtr &
       faster_lio::Timer::Evaluate( [ &, this ]() { extractSurroundingKeyFrames(); }, "extractSurroundingKeyFrames" );
       faster_lio::Timer::Evaluate( [ &, this ]() { downsampleCurrentScan(); }, "downsampleCurrentScan" );
       faster_lio::Timer::Evaluate( [ &, this ]() { scan2MapOptimization(); }, "scan2MapOptimization" );
+      if ( asyncPoseGraph )
+      {
+        faster_lio::Timer::Evaluate( [ &, this ]() { publishOdometry(); }, "publishOdometry" );
+      }
       faster_lio::Timer::Evaluate( [ &, this ]() { saveKeyFramesAndFactor(); }, "saveKeyFramesAndFactor" );
       faster_lio::Timer::Evaluate( [ &, this ]() { correctPoses(); }, "correctPoses" );
-      faster_lio::Timer::Evaluate( [ &, this ]() { publishOdometry(); }, "publishOdometry" );
+      if ( !asyncPoseGraph )
+      {
+        faster_lio::Timer::Evaluate( [ &, this ]() { publishOdometry(); }, "publishOdometry" );
+      }
       faster_lio::Timer::Evaluate( [ &, this ]() { publishFrames(); }, "publishFrames" );
 #else
       updateInitialGuess();
       extractSurroundingKeyFrames();
       downsampleCurrentScan();
       scan2MapOptimization();
+      if ( asyncPoseGraph )
+      {
+        publishOdometry();
+      }
       saveKeyFramesAndFactor();
       correctPoses();
-      publishOdometry();
+      if ( !asyncPoseGraph )
+      {
+        publishOdometry();
+      }
       publishFrames();
 #endif
     }
@@ -237,25 +368,28 @@ void MapOptimization::pointAssociateToMap( PointType const *const pi, PointType
   po->intensity = pi->intensity;
 }
 
-pcl::PointCloud<PointType>::Ptr MapOptimization::transformPointCloud( pcl::PointCloud<PointType>::Ptr cloudIn, PointTypePose *transformIn )
+void MapOptimization::transformPointCloud( const pcl::PointCloud<PointType> &cloudIn, const Eigen::Affine3f &transform, pcl::PointCloud<PointType> &cloudOut )
 {
-  pcl::PointCloud<PointType>::Ptr cloudOut( new pcl::PointCloud<PointType>() );
-
-  int cloudSize = cloudIn->size();
-  cloudOut->resize( cloudSize );
-
-  Eigen::Affine3f transCur = pcl::getTransformation( transformIn->x, transformIn->y, transformIn->z, transformIn->roll, transformIn->pitch, transformIn->yaw );
-
-#pragma omp parallel for num_threads( numberOfCores )
+  // appended to cloudOut, so fusing keyframes needs no temporary cloud
+  const int offset    = cloudOut.size();
+  const int cloudSize = cloudIn.size();
+  cloudOut.resize( offset + cloudSize );
+
+  // the aligned x y z w of a point times the columns of the matrix, four lanes per multiply-add
+  const Eigen::Matrix4f &transCur = transform.matrix();
+  const Eigen::Vector4f  col0     = transCur.col( 0 );
+  const Eigen::Vector4f  col1     = transCur.col( 1 );
+  const Eigen::Vector4f  col2     = transCur.col( 2 );
+  const Eigen::Vector4f  col3     = transCur.col( 3 );
+
+#pragma omp parallel for num_threads( numberOfCores ) if ( cloudSize > 20000 )
   for ( int i = 0; i < cloudSize; ++i )
   {
-    const auto &pointFrom           = cloudIn->points[ i ];
-    cloudOut->points[ i ].x         = transCur( 0, 0 ) * pointFrom.x + transCur( 0, 1 ) * pointFrom.y + transCur( 0, 2 ) * pointFrom.z + transCur( 0, 3 );
-    cloudOut->points[ i ].y         = transCur( 1, 0 ) * pointFrom.x + transCur( 1, 1 ) * pointFrom.y + transCur( 1, 2 ) * pointFrom.z + transCur( 1, 3 );
-    cloudOut->points[ i ].z         = transCur( 2, 0 ) * pointFrom.x + transCur( 2, 1 ) * pointFrom.y + transCur( 2, 2 ) * pointFrom.z + transCur( 2, 3 );
-    cloudOut->points[ i ].intensity = pointFrom.intensity;
+    const PointType &pointFrom = cloudIn.points[ i ];
+    PointType       &pointTo   = cloudOut.points[ offset + i ];
+    pointTo.getVector4fMap()   = col0 * pointFrom.x + col1 * pointFrom.y + col2 * pointFrom.z + col3;
+    pointTo.intensity          = pointFrom.intensity;
   }
-  return cloudOut;
 }
 
 gtsam::Pose3 MapOptimization::pclPointTogtsamPose3( PointTypePose thisPoint )
@@ -322,8 +456,17 @@ bool MapOptimization::saveMapService( lio_sam::save_mapRequest &req, lio_sam::sa
   unused = system( ( std::string( "mkdir -p " ) + saveMapDirectory ).c_str() );
   std::cout << "Create directory: " << unused << std::endl;
   // save key frame transformations
-  pcl::io::savePCDFileBinary( saveMapDirectory + "/trajectory.pcd", *cloudKeyPoses3D );
-  pcl::io::savePCDFileBinary( saveMapDirectory + "/transformations.pcd", *cloudKeyPoses6D );
+  std::shared_ptr<const KeyPoses> keyPoses = std::atomic_load( &keyPosesSnapshot );
+  pcl::PointCloud<PointType>      keyPoses3D;
+  pcl::PointCloud<PointTypePose>  keyPoses6D;
+  keyPoses->poses3D.copyTo( keyPoses3D.points );
+  keyPoses->poses6D.copyTo( keyPoses6D.points );
+  keyPoses3D.width  = keyPoses3D.points.size();
+  keyPoses3D.height = 1;
+  keyPoses6D.width  = keyPoses6D.points.size();
+  keyPoses6D.height = 1;
+  pcl::io::savePCDFileBinary( saveMapDirectory + "/trajectory.pcd", keyPoses3D );
+  pcl::io::savePCDFileBinary( saveMapDirectory + "/transformations.pcd", keyPoses6D );
 
   // extract global point cloud map
   pcl::PointCloud<PointType>::Ptr globalCornerCloud( new pcl::PointCloud<PointType>() );
@@ -332,11 +475,11 @@ bool MapOptimization::saveMapService( lio_sam::save_mapRequest &req, lio_sam::sa
   pcl::PointCloud<PointType>::Ptr globalSurfCloudDS( new pcl::PointCloud<PointType>() );
   pcl::PointCloud<PointType>::Ptr globalMapCloud( new pcl::PointCloud<PointType>() );
 
-  for ( int i = 0; i < (int)cloudKeyPoses3D->size(); i++ )
+  for ( int i = 0; i < (int)keyPoses->transforms.size(); i++ )
   {
-    *globalCornerCloud += *transformPointCloud( cornerCloudKeyFrames[ i ], &cloudKeyPoses6D->points[ i ] );
-    *globalSurfCloud += *transformPointCloud( surfCloudKeyFrames[ i ], &cloudKeyPoses6D->points[ i ] );
-    std::cout << "\r" << std::flush << "Processing feature cloud " << i << " of " << cloudKeyPoses6D->size() << " ...";
+    cornerCloudKeyFrames.decode( i, keyPoses->transforms[ i ], *globalCornerCloud );
+    surfCloudKeyFrames.decode( i, keyPoses->transforms[ i ], *globalSurfCloud );
+    std::cout << "\r" << std::flush << "Processing feature cloud " << i << " of " << keyPoses->transforms.size() << " ...";
   }
   std::cout << std::endl;
 
@@ -418,49 +561,51 @@ void MapOptimization::publishGlobalMap()
     return;
   }
 
-  if ( cloudKeyPoses3D->points.empty() == true )
+  std::shared_ptr<const KeyPoses> keyPoses = std::atomic_load( &keyPosesSnapshot );
+  if ( keyPoses->poses3D.empty() == true )
   {
     return;
   }
+  const int numKeyPoses = keyPoses->poses3D.size();
 
-  pcl::KdTreeFLANN<PointType>::Ptr kdtreeGlobalMap( new pcl::KdTreeFLANN<PointType>() );
-  pcl::PointCloud<PointType>::Ptr  globalMapKeyPoses( new pcl::PointCloud<PointType>() );
-  pcl::PointCloud<PointType>::Ptr  globalMapKeyPosesDS( new pcl::PointCloud<PointType>() );
-  pcl::PointCloud<PointType>::Ptr  globalMapKeyFrames( new pcl::PointCloud<PointType>() );
-  pcl::PointCloud<PointType>::Ptr  globalMapKeyFramesDS( new pcl::PointCloud<PointType>() );
+  pcl::PointCloud<PointType>::Ptr globalMapKeyPoses( new pcl::PointCloud<PointType>() );
+  pcl::PointCloud<PointType>::Ptr globalMapKeyPosesDS( new pcl::PointCloud<PointType>() );
+  pcl::PointCloud<PointType>::Ptr globalMapKeyFrames( new pcl::PointCloud<PointType>() );
+  pcl::PointCloud<PointType>::Ptr globalMapKeyFramesDS( new pcl::PointCloud<PointType>() );
 
-  // kd-tree to find near key frames to visualize
-  std::vector<int>   pointSearchIndGlobalMap;
-  std::vector<float> pointSearchSqDisGlobalMap;
   // search near key frames to visualize
-  mtx.lock();
-  kdtreeGlobalMap->setInputCloud( cloudKeyPoses3D );
-  kdtreeGlobalMap->radiusSearch( cloudKeyPoses3D->back(), globalMapVisualizationSearchRadius, pointSearchIndGlobalMap, pointSearchSqDisGlobalMap, 0 );
-  mtx.unlock();
+  PointVector        pointSearchGlobalMap;
+  std::vector<float> pointSearchSqDisGlobalMap;
+  mtxKeyPoseIndex.lock();
+  keyPoseIndex.RadiusSearch( keyPoses->poses3D.back(), globalMapVisualizationSearchRadius, pointSearchGlobalMap, pointSearchSqDisGlobalMap );
+  mtxKeyPoseIndex.unlock();
 
-  for ( int i = 0; i < (int)pointSearchIndGlobalMap.size(); ++i )
-    globalMapKeyPoses->push_back( cloudKeyPoses3D->points[ pointSearchIndGlobalMap[ i ] ] );
+  globalMapKeyPoses->points.assign( pointSearchGlobalMap.begin(), pointSearchGlobalMap.end() );
+  globalMapKeyPoses->width  = globalMapKeyPoses->points.size();
+  globalMapKeyPoses->height = 1;
   // downsample near selected key frames
   pcl::VoxelGrid<PointType> downSizeFilterGlobalMapKeyPoses;                                                                                               // for global map visualization
   downSizeFilterGlobalMapKeyPoses.setLeafSize( globalMapVisualizationPoseDensity, globalMapVisualizationPoseDensity, globalMapVisualizationPoseDensity );  // for global map visualization
   downSizeFilterGlobalMapKeyPoses.setInputCloud( globalMapKeyPoses );
   downSizeFilterGlobalMapKeyPoses.filter( *globalMapKeyPosesDS );
+  mtxKeyPoseIndex.lock();
   for ( auto &pt : globalMapKeyPosesDS->points )
   {
-    kdtreeGlobalMap->nearestKSearch( pt, 1, pointSearchIndGlobalMap, pointSearchSqDisGlobalMap );
-    pt.intensity = cloudKeyPoses3D->points[ pointSearchIndGlobalMap[ 0 ] ].intensity;
+    keyPoseIndex.NearestSearch( pt, 1, pointSearchGlobalMap, pointSearchSqDisGlobalMap );
+    pt.intensity = pointSearchGlobalMap[ 0 ].intensity;
   }
+  mtxKeyPoseIndex.unlock();
 
-  // extract visualized and downsampled key frames
+  // extract visualized and downsampled key frames, the index may already hold key frames newer than the snapshot
   for ( int i = 0; i < (int)globalMapKeyPosesDS->size(); ++i )
   {
-    if ( pointDistance( globalMapKeyPosesDS->points[ i ], cloudKeyPoses3D->back() ) > globalMapVisualizationSearchRadius )
+    int thisKeyInd = (int)globalMapKeyPosesDS->points[ i ].intensity;
+    if ( thisKeyInd >= numKeyPoses || pointDistance( globalMapKeyPosesDS->points[ i ], keyPoses->poses3D.back() ) > globalMapVisualizationSearchRadius )
     {
       continue;
     }
-    int thisKeyInd = (int)globalMapKeyPosesDS->points[ i ].intensity;
-    *globalMapKeyFrames += *transformPointCloud( cornerCloudKeyFrames[ thisKeyInd ], &cloudKeyPoses6D->points[ thisKeyInd ] );
-    *globalMapKeyFrames += *transformPointCloud( surfCloudKeyFrames[ thisKeyInd ], &cloudKeyPoses6D->points[ thisKeyInd ] );
+    cornerCloudKeyFrames.decode( thisKeyInd, keyPoses->transforms[ thisKeyInd ], *globalMapKeyFrames );
+    surfCloudKeyFrames.decode( thisKeyInd, keyPoses->transforms[ thisKeyInd ], *globalMapKeyFrames );
   }
   // downsample visualized points
   pcl::VoxelGrid<PointType> downSizeFilterGlobalMapKeyFrames;                                                                                      // for global map visualization
@@ -487,6 +632,75 @@ void MapOptimization::loopClosureThread()
   }
 }
 
+void MapOptimization::poseGraphThread()
+{
+  if ( asyncPoseGraph == false )
+  {
+    return;
+  }
+
+  while ( ros::ok() )
+  {
+    // everything queued since the last solve goes into a single update
+    PoseGraphUpdate update;
+    {
+      std::unique_lock<std::mutex> lock( mtxPoseGraph );
+      if ( !poseGraphCondition.wait_for( lock, std::chrono::milliseconds( 100 ), [ this ]() { return !poseGraphQueue.empty(); } ) )
+      {
+        continue;
+      }
+      while ( !poseGraphQueue.empty() )
+      {
+        update.graph.push_back( poseGraphQueue.front().graph );
+        update.estimate.insert( poseGraphQueue.front().estimate );
+        update.correction = update.correction || poseGraphQueue.front().correction;
+        update.covariance = update.covariance || poseGraphQueue.front().covariance;
+        update.firstKey   = std::min( update.firstKey, poseGraphQueue.front().firstKey );
+        poseGraphQueue.pop_front();
+      }
+    }
+
+    isam->update( update.graph, update.estimate );
+    isam->update();
+
+    if ( update.correction == true )
+    {
+      isam->update();
+      isam->update();
+      isam->update();
+      isam->update();
+      isam->update();
+    }
+
+    // a result not taken yet by the mapping thread is replaced by this one, which then has to carry its correction and covariance
+    PoseGraphResult result;
+    bool            covariance;
+    {
+      std::lock_guard<std::mutex> lock( mtxPoseGraph );
+      result.correction = update.correction || ( poseGraphResultReady && poseGraphResult.correction );
+      result.firstKey   = poseGraphResultReady ? std::min( update.firstKey, poseGraphResult.firstKey ) : update.firstKey;
+      covariance        = update.covariance || ( poseGraphResultReady && poseGraphResult.covariance.size() != 0 );
+    }
+    if ( result.correction == true )
+    {
+      result.estimate = isam->calculateEstimate();
+    }
+    if ( covariance == true )
+    {
+#if DEBUG
+      faster_lio::Timer::Evaluate( [ &, this ]() { result.covariance = isam->marginalCovariance( update.estimate.keys().back() ); }, "marginalCovariance" );
+#else
+      result.covariance = isam->marginalCovariance( update.estimate.keys().back() );
+#endif
+      result.covarianceKey = (int)update.estimate.keys().back();
+    }
+
+    std::lock_guard<std::mutex> lock( mtxPoseGraph );
+    poseGraphResult      = std::move( result );
+    poseGraphResultReady = true;
+  }
+}
+
 void MapOptimization::loopInfoHandler( const std_msgs::Float64MultiArray::ConstPtr &loopMsg )
 {
   std::lock_guard<std::mutex> lock( mtxLoopInfo );
@@ -505,16 +719,13 @@ void MapOptimization::loopInfoHandler( const std_msgs::Float64MultiArray::ConstP
 
 void MapOptimization::performLoopClosure()
 {
-  if ( cloudKeyPoses3D->points.empty() == true )
+  // the latest published version, the mapping thread is not waited for
+  loopKeyPoses = std::atomic_load( &keyPosesSnapshot );
+  if ( loopKeyPoses->poses3D.empty() == true )
   {
     return;
   }
 
-  mtx.lock();
-  *copy_cloudKeyPoses3D = *cloudKeyPoses3D;
-  *copy_cloudKeyPoses6D = *cloudKeyPoses6D;
-  mtx.unlock();
-
   // find keys
   int loopKeyCur;
   int loopKeyPre;
@@ -526,6 +737,10 @@ void MapOptimization::performLoopClosure()
     }
   }
 
+  // the history keyframes may be on disk, their pages are read in while the current one is decoded
+  cornerCloudKeyFrames.prefetch( loopKeyPre - historyKeyframeSearchNum, loopKeyPre + historyKeyframeSearchNum );
+  surfCloudKeyFrames.prefetch( loopKeyPre - historyKeyframeSearchNum, loopKeyPre + historyKeyframeSearchNum );
+
   // extract cloud
   pcl::PointCloud<PointType>::Ptr cureKeyframeCloud( new pcl::PointCloud<PointType>() );
   pcl::PointCloud<PointType>::Ptr prevKeyframeCloud( new pcl::PointCloud<PointType>() );
@@ -575,13 +790,13 @@ void MapOptimization::performLoopClosure()
   correctionLidarFrame = icp.getFinalTransformation();
 
   // transform from world origin to wrong pose
-  Eigen::Affine3f tWrong = pclPointToAffine3f( copy_cloudKeyPoses6D->points[ loopKeyCur ] );
+  Eigen::Affine3f tWrong = loopKeyPoses->transforms[ loopKeyCur ];
 
   // transform from world origin to corrected pose
   Eigen::Affine3f tCorrect = correctionLidarFrame * tWrong;  // pre-multiplying -> successive rotation about a fixed frame
   pcl::getTranslationAndEulerAngles( tCorrect, x, y, z, roll, pitch, yaw );
   gtsam::Pose3  poseFrom = gtsam::Pose3( gtsam::Rot3::RzRyRx( roll, pitch, yaw ), gtsam::Point3( x, y, z ) );
-  gtsam::Pose3  poseTo   = pclPointTogtsamPose3( copy_cloudKeyPoses6D->points[ loopKeyPre ] );
+  gtsam::Pose3  poseTo   = pclPointTogtsamPose3( loopKeyPoses->poses6D[ loopKeyPre ] );
   gtsam::Vector Vector6( 6 );
   float         noiseScore = icp.getFitnessScore();
   Vector6 << noiseScore, noiseScore, noiseScore, noiseScore, noiseScore, noiseScore;
@@ -600,7 +815,7 @@ void MapOptimization::performLoopClosure()
 
 bool MapOptimization::detectLoopClosureDistance( int *latestID, int *closestID )
 {
-  int loopKeyCur = copy_cloudKeyPoses3D->size() - 1;
+  int loopKeyCur = loopKeyPoses->poses3D.size() - 1;
   int loopKeyPre = -1;
 
   // check loop constraint added before
@@ -610,16 +825,21 @@ bool MapOptimization::detectLoopClosureDistance( int *latestID, int *closestID )
     return false;
   }
 
-  // find the closest history key frame
-  std::vector<int>   pointSearchIndLoop;
+  // find the closest history key frame, the index may already hold key frames newer than the snapshot
+  PointVector        pointSearchLoop;
   std::vector<float> pointSearchSqDisLoop;
-  kdtreeHistoryKeyPoses->setInputCloud( copy_cloudKeyPoses3D );
-  kdtreeHistoryKeyPoses->radiusSearch( copy_cloudKeyPoses3D->back(), historyKeyframeSearchRadius, pointSearchIndLoop, pointSearchSqDisLoop, 0 );
+  mtxKeyPoseIndex.lock();
+  keyPoseIndex.RadiusSearch( loopKeyPoses->poses3D.back(), historyKeyframeSearchRadius, pointSearchLoop, pointSearchSqDisLoop );
+  mtxKeyPoseIndex.unlock();
 
-  for ( int i = 0; i < (int)pointSearchIndLoop.size(); ++i )
+  for ( int i = 0; i < (int)pointSearchLoop.size(); ++i )
   {
-    int id = pointSearchIndLoop[ i ];
-    if ( abs( copy_cloudKeyPoses6D->points[ id ].time - timeLaserInfoCur ) > historyKeyframeSearchTimeDiff )
+    int id = (int)pointSearchLoop[ i ].intensity;
+    if ( id > loopKeyCur )
+    {
+      continue;
+    }
+    if ( abs( loopKeyPoses->poses6D[ id ].time - timeLaserInfoCur ) > historyKeyframeSearchTimeDiff )
     {
       loopKeyPre = id;
       break;
@@ -658,7 +878,7 @@ bool MapOptimization::detectLoopClosureExternal( int *latestID, int *closestID )
     return false;
   }
 
-  int cloudSize = copy_cloudKeyPoses6D->size();
+  int cloudSize = loopKeyPoses->poses6D.size();
   if ( cloudSize < 2 )
   {
     return false;
@@ -668,9 +888,9 @@ bool MapOptimization::detectLoopClosureExternal( int *latestID, int *closestID )
   loopKeyCur = cloudSize - 1;
   for ( int i = cloudSize - 1; i >= 0; --i )
   {
-    if ( copy_cloudKeyPoses6D->points[ i ].time >= loopTimeCur )
+    if ( loopKeyPoses->poses6D[ i ].time >= loopTimeCur )
     {
-      loopKeyCur = round( copy_cloudKeyPoses6D->points[ i ].intensity );
+      loopKeyCur = round( loopKeyPoses->poses6D[ i ].intensity );
     }
     else
     {
@@ -682,9 +902,9 @@ bool MapOptimization::detectLoopClosureExternal( int *latestID, int *closestID )
   loopKeyPre = 0;
   for ( int i = 0; i < cloudSize; ++i )
   {
-    if ( copy_cloudKeyPoses6D->points[ i ].time <= loopTimePre )
+    if ( loopKeyPoses->poses6D[ i ].time <= loopTimePre )
     {
-      loopKeyPre = round( copy_cloudKeyPoses6D->points[ i ].intensity );
+      loopKeyPre = round( loopKeyPoses->poses6D[ i ].intensity );
     }
     else
     {
@@ -713,7 +933,7 @@ void MapOptimization::loopFindNearKeyframes( pcl::PointCloud<PointType>::Ptr &ne
 {
   // extract near keyframes
   nearKeyframes->clear();
-  int cloudSize = copy_cloudKeyPoses6D->size();
+  int cloudSize = loopKeyPoses->poses6D.size();
   for ( int i = -searchNum; i <= searchNum; ++i )
   {
     int keyNear = key + i;
@@ -721,8 +941,8 @@ void MapOptimization::loopFindNearKeyframes( pcl::PointCloud<PointType>::Ptr &ne
     {
       continue;
     }
-    *nearKeyframes += *transformPointCloud( cornerCloudKeyFrames[ keyNear ], &copy_cloudKeyPoses6D->points[ keyNear ] );
-    *nearKeyframes += *transformPointCloud( surfCloudKeyFrames[ keyNear ], &copy_cloudKeyPoses6D->points[ keyNear ] );
+    cornerCloudKeyFrames.decode( keyNear, loopKeyPoses->transforms[ keyNear ], *nearKeyframes );
+    surfCloudKeyFrames.decode( keyNear, loopKeyPoses->transforms[ keyNear ], *nearKeyframes );
   }
 
   if ( nearKeyframes->empty() )
@@ -781,14 +1001,14 @@ void MapOptimization::visualizeLoopClosure()
     int                  key_cur = it->first;
     int                  key_pre = it->second;
     geometry_msgs::Point p;
-    p.x = copy_cloudKeyPoses6D->points[ key_cur ].x;
-    p.y = copy_cloudKeyPoses6D->points[ key_cur ].y;
-    p.z = copy_cloudKeyPoses6D->points[ key_cur ].z;
+    p.x = loopKeyPoses->poses6D[ key_cur ].x;
+    p.y = loopKeyPoses->poses6D[ key_cur ].y;
+    p.z = loopKeyPoses->poses6D[ key_cur ].z;
     markerNode.points.push_back( p );
     markerEdge.points.push_back( p );
-    p.x = copy_cloudKeyPoses6D->points[ key_pre ].x;
-    p.y = copy_cloudKeyPoses6D->points[ key_pre ].y;
-    p.z = copy_cloudKeyPoses6D->points[ key_pre ].z;
+    p.x = loopKeyPoses->poses6D[ key_pre ].x;
+    p.y = loopKeyPoses->poses6D[ key_pre ].y;
+    p.z = loopKeyPoses->poses6D[ key_pre ].z;
     markerNode.points.push_back( p );
     markerEdge.points.push_back( p );
   }
@@ -884,6 +1104,10 @@ void MapOptimization::extractForLoopClosure()
   {
     extractCloudForIVox( cloudToExtract );
   }
+  else if ( useIkdTree )
+  {
+    extractCloudForIkdTree( cloudToExtract );
+  }
   else
   {
     extractCloud( cloudToExtract );
@@ -896,24 +1120,21 @@ void MapOptimization::extractNearby()
 {
   pcl::PointCloud<PointType>::Ptr surroundingKeyPoses( new pcl::PointCloud<PointType>() );
   pcl::PointCloud<PointType>::Ptr surroundingKeyPosesDS( new pcl::PointCloud<PointType>() );
-  std::vector<int>                pointSearchInd;
+  PointVector                     pointSearch;
   std::vector<float>              pointSearchSqDis;
 
   // extract all the nearby key poses and downsample them
-  kdtreeSurroundingKeyPoses->setInputCloud( cloudKeyPoses3D );  // create kd-tree
-  kdtreeSurroundingKeyPoses->radiusSearch( cloudKeyPoses3D->back(), (double)surroundingKeyframeSearchRadius, pointSearchInd, pointSearchSqDis );
-  for ( int i = 0; i < (int)pointSearchInd.size(); ++i )
-  {
-    int id = pointSearchInd[ i ];
-    surroundingKeyPoses->push_back( cloudKeyPoses3D->points[ id ] );
-  }
+  keyPoseIndex.RadiusSearch( cloudKeyPoses3D->back(), surroundingKeyframeSearchRadius, pointSearch, pointSearchSqDis );
+  surroundingKeyPoses->points.assign( pointSearch.begin(), pointSearch.end() );
+  surroundingKeyPoses->width  = surroundingKeyPoses->points.size();
+  surroundingKeyPoses->height = 1;
 
   downSizeFilterSurroundingKeyPoses.setInputCloud( surroundingKeyPoses );
   downSizeFilterSurroundingKeyPoses.filter( *surroundingKeyPosesDS );
   for ( auto &pt : surroundingKeyPosesDS->points )
   {
-    kdtreeSurroundingKeyPoses->nearestKSearch( pt, 1, pointSearchInd, pointSearchSqDis );
-    pt.intensity = cloudKeyPoses3D->points[ pointSearchInd[ 0 ] ].intensity;
+    keyPoseIndex.NearestSearch( pt, 1, pointSearch, pointSearchSqDis );
+    pt.intensity = pointSearch[ 0 ].intensity;
   }
 
   // also extract some latest key frames in case the robot rotates in one position
@@ -934,6 +1155,10 @@ void MapOptimization::extractNearby()
   {
     extractCloudForIVox( surroundingKeyPosesDS );
   }
+  else if ( useIkdTree )
+  {
+    extractCloudForIkdTree( surroundingKeyPosesDS );
+  }
   else
   {
     extractCloud( surroundingKeyPosesDS );
@@ -953,23 +1178,10 @@ void MapOptimization::extractCloud( pcl::PointCloud<PointType>::Ptr cloudToExtra
       continue;
     }
 
-    int thisKeyInd = (int)cloudToExtract->points[ i ].intensity;
-
-    if ( laserCloudMapContainer.find( thisKeyInd ) != laserCloudMapContainer.end() )
-    {
-      // transformed cloud available
-      *laserCloudCornerFromMap += laserCloudMapContainer[ thisKeyInd ].first;
-      *laserCloudSurfFromMap += laserCloudMapContainer[ thisKeyInd ].second;
-    }
-    else
-    {
-      // transformed cloud not available
-      pcl::PointCloud<PointType> laserCloudCornerTemp = *transformPointCloud( cornerCloudKeyFrames[ thisKeyInd ], &cloudKeyPoses6D->points[ thisKeyInd ] );
-      pcl::PointCloud<PointType> laserCloudSurfTemp   = *transformPointCloud( surfCloudKeyFrames[ thisKeyInd ], &cloudKeyPoses6D->points[ thisKeyInd ] );
-      *laserCloudCornerFromMap += laserCloudCornerTemp;
-      *laserCloudSurfFromMap += laserCloudSurfTemp;
-      laserCloudMapContainer[ thisKeyInd ] = std::make_pair( laserCloudCornerTemp, laserCloudSurfTemp );
-    }
+    int                     thisKeyInd = (int)cloudToExtract->points[ i ].intensity;
+    KeyFrameCache::ValuePtr clouds     = getTransformedKeyFrame( thisKeyInd );
+    *laserCloudCornerFromMap += clouds->first;
+    *laserCloudSurfFromMap += clouds->second;
   }
 
   // Downsample the surrounding corner key frames (or map)
@@ -982,26 +1194,67 @@ void MapOptimization::extractCloud( pcl::PointCloud<PointType>::Ptr cloudToExtra
   downSizeFilterSurf.filter( *laserCloudSurfFromMapDS );
   laserCloudSurfFromMapDSNum = laserCloudSurfFromMapDS->size();
 
-  // clear map cache if too large
-  if ( laserCloudMapContainer.size() > 1000 )
-  {
-    laserCloudMapContainer.clear();
-  }
+  ROS_DEBUG( "keyframe cache: %zu clouds, %.1f MB, hits %zu, misses %zu, evicted %zu", laserCloudMapContainer->size(),
+             laserCloudMapContainer->bytes() / 1048576.0, laserCloudMapContainer->hits(), laserCloudMapContainer->misses(),
+             laserCloudMapContainer->evicted() );
 }
 
-void MapOptimization::extractCloudForIVox( pcl::PointCloud<PointType>::Ptr cloudToExtract )
+MapOptimization::KeyFrameCache::ValuePtr MapOptimization::getTransformedKeyFrame( int keyInd )
 {
-  // if there is a loop correct, the iVox map should be cleared
-  if ( needCorrectFlag )
-  {
-    iVoxCornerMap   = std::make_shared<IVoxType>( iVoxOptions );
-    iVoxSurfMap     = std::make_shared<IVoxType>( iVoxOptions );
-    needCorrectFlag = false;
+  KeyFrameCacheKey        key( keyInd, keyPoseVersions[ keyInd ] );
+  KeyFrameCache::ValuePtr clouds = laserCloudMapContainer->get( key );
+  if ( !clouds )
+  {
+    // transformed cloud not available
+    auto transformed = std::make_shared<KeyFrameClouds>();
+    cornerCloudKeyFrames.decode( keyInd, keyPoseTransforms[ keyInd ], transformed->first );
+    surfCloudKeyFrames.decode( keyInd, keyPoseTransforms[ keyInd ], transformed->second );
+    std::size_t bytes = sizeof( KeyFrameClouds ) + ( transformed->first.size() + transformed->second.size() ) * sizeof( PointType );
+    laserCloudMapContainer->put( key, transformed, bytes );
+    clouds = transformed;
+  }
+  return clouds;
+}
+
+void MapOptimization::extractLocalMap( pcl::PointCloud<PointType>& cornerOut, pcl::PointCloud<PointType>& surfOut )
+{
+  if ( useIkdTree && !useIVox )
+  {
+    // the trees already keep the density of the voxel filters, the cube around the latest keyframe is read out
+    const Eigen::Vector3f center   = cloudKeyPoses3D->back().getVector3fMap();
+    const Eigen::Vector3f halfSize = Eigen::Vector3f::Constant( surroundingKeyframeSearchRadius );
+    ikdCornerMap.BoxSearch( center - halfSize, center + halfSize, cornerOut.points );
+    ikdSurfMap.BoxSearch( center - halfSize, center + halfSize, surfOut.points );
+    cornerOut.width  = cornerOut.points.size();
+    cornerOut.height = 1;
+    surfOut.width    = surfOut.points.size();
+    surfOut.height   = 1;
+    return;
   }
 
-  // fuse the map
-  laserCloudCornerFromMap->clear();
-  laserCloudSurfFromMap->clear();
+  // the iVox maps can not be listed (and are owned by the update thread with iVoxAsyncUpdate), so the local map is
+  // fused from the surrounding keyframes they hold, as extractCloud does
+  pcl::PointCloud<PointType>::Ptr corner( new pcl::PointCloud<PointType>() );
+  pcl::PointCloud<PointType>::Ptr surf( new pcl::PointCloud<PointType>() );
+  for ( const auto& it : iVoxKeyFramePoses )
+  {
+    if ( pointDistance( cloudKeyPoses3D->points[ it.first ], cloudKeyPoses3D->back() ) > surroundingKeyframeSearchRadius )
+    {
+      continue;
+    }
+    KeyFrameCache::ValuePtr clouds = getTransformedKeyFrame( it.first );
+    *corner += clouds->first;
+    *surf += clouds->second;
+  }
+  downSizeFilterCorner.setInputCloud( corner );
+  downSizeFilterCorner.filter( cornerOut );
+  downSizeFilterSurf.setInputCloud( surf );
+  downSizeFilterSurf.filter( surfOut );
+}
+
+void MapOptimization::extractCloudForIVox( pcl::PointCloud<PointType>::Ptr cloudToExtract )
+{
+  std::set<int> surroundingKeyFrames;
   for ( int i = 0; i < (int)cloudToExtract->size(); ++i )
   {
     if ( pointDistance( cloudToExtract->points[ i ], cloudKeyPoses3D->back() ) > surroundingKeyframeSearchRadius )
@@ -1009,182 +1262,537 @@ void MapOptimization::extractCloudForIVox( pcl::PointCloud<PointType>::Ptr cloud
       continue;
     }
 
-    int thisKeyInd = (int)cloudToExtract->points[ i ].intensity;
-
-    if ( laserCloudMapContainer.find( thisKeyInd ) == laserCloudMapContainer.end() )
+    // keyframes out of the sliding window would be evicted right away
+    const PointType& keyPose = cloudToExtract->points[ i ];
+    if ( !iVoxWindow.Contains( IVoxType::PtType( keyPose.x, keyPose.y, keyPose.z ) ) )
     {
-      // add ivox
-      pcl::PointCloud<PointType> laserCloudCornerTemp = *transformPointCloud( cornerCloudKeyFrames[ thisKeyInd ], &cloudKeyPoses6D->points[ thisKeyInd ] );
-      pcl::PointCloud<PointType> laserCloudSurfTemp   = *transformPointCloud( surfCloudKeyFrames[ thisKeyInd ], &cloudKeyPoses6D->points[ thisKeyInd ] );
-      *laserCloudCornerFromMap += laserCloudCornerTemp;
-      *laserCloudSurfFromMap += laserCloudSurfTemp;
-      laserCloudMapContainer[ thisKeyInd ] = std::make_pair( laserCloudCornerTemp, laserCloudSurfTemp );
+      continue;
     }
-  }
-
-  // Downsample the surrounding corner key frames (or map)
-  downSizeFilterCorner.setInputCloud( laserCloudCornerFromMap );
-  downSizeFilterCorner.filter( *laserCloudCornerFromMapDS );
-  // laserCloudCornerFromMapDSNum = laserCloudCornerFromMapDS->size();
-
-  // Downsample the surrounding surf key frames (or map)
-  downSizeFilterSurf.setInputCloud( laserCloudSurfFromMap );
-  downSizeFilterSurf.filter( *laserCloudSurfFromMapDS );
-  // laserCloudSurfFromMapDSNum = laserCloudSurfFromMapDS->size();
 
-  // add ivox
-  iVoxCornerMap->AddPoints( laserCloudCornerFromMapDS->points );
-  iVoxSurfMap->AddPoints( laserCloudSurfFromMapDS->points );
+    int thisKeyInd = (int)cloudToExtract->points[ i ].intensity;
+    surroundingKeyFrames.insert( thisKeyInd );
 
-  // clear map cache if too large
-  if ( laserCloudMapContainer.size() > 1000 )
-  {
-    laserCloudMapContainer.clear();
+    if ( iVoxKeyFramePoses.find( thisKeyInd ) == iVoxKeyFramePoses.end() )
+    {
+      addKeyFrameToIVox( thisKeyInd );
+    }
   }
-}
 
-void MapOptimization::extractSurroundingKeyFrames()
-{
-  if ( cloudKeyPoses3D->points.empty() )
+  // forget the keyframes out of the surrounding area if too many, their points are removed so they can be added again
+  if ( iVoxKeyFramePoses.size() > 1000 )
   {
-    return;
+    std::set<uint32_t> farKeyFrames;
+    for ( auto it = iVoxKeyFramePoses.begin(); it != iVoxKeyFramePoses.end(); )
+    {
+      if ( surroundingKeyFrames.count( it->first ) == 0 )
+      {
+        farKeyFrames.insert( it->first );
+        it = iVoxKeyFramePoses.erase( it );
+      }
+      else
+      {
+        ++it;
+      }
+    }
+    iVoxBuffer->apply( [ farKeyFrames = std::move( farKeyFrames ) ]( IVoxMaps& maps ) {
+      auto isFar = [ &farKeyFrames ]( const uint32_t tag ) { return farKeyFrames.count( tag ) > 0; };
+      maps.forEach( [ &isFar ]( IVoxType& map ) { map.RemovePoints( isFar ); } );
+    } );
   }
-  // if ( loopClosureEnableFlag == true )
-  // {
-  //   extractForLoopClosure();
-  // }
-  // else
-  // {
-  //   extractNearby();
-  // }
-
-  extractNearby();
 }
 
-void MapOptimization::downsampleCurrentScan()
+void MapOptimization::addKeyFrameToIVox( int keyInd )
 {
-  // Downsample cloud from current scan
-  laserCloudCornerLastDS->clear();
-  downSizeFilterCorner.setInputCloud( laserCloudCornerLast );
-  downSizeFilterCorner.filter( *laserCloudCornerLastDS );
-  laserCloudCornerLastDSNum = laserCloudCornerLastDS->size();
+  // transformed and downsampled by the first map copy the update runs on (in the background with iVoxAsyncUpdate),
+  // the second one reuses the result
+  struct KeyFrameClouds
+  {
+    pcl::PointCloud<PointType>::Ptr corner;
+    pcl::PointCloud<PointType>::Ptr surf;
+  };
+  auto            clouds = std::make_shared<KeyFrameClouds>();
+  PointTypePose   pose   = cloudKeyPoses6D->points[ keyInd ];
+  Eigen::Affine3f trans  = keyPoseTransforms[ keyInd ];
+  iVoxBuffer->apply( [ this, clouds, trans, keyInd ]( IVoxMaps& maps ) mutable {
+    if ( !clouds->corner )
+    {
+      pcl::VoxelGrid<PointType>       downSizeFilter;
+      pcl::PointCloud<PointType>::Ptr transformed( new pcl::PointCloud<PointType>() );
+      clouds->corner.reset( new pcl::PointCloud<PointType>() );
+      cornerCloudKeyFrames.decode( keyInd, trans, *transformed );
+      downSizeFilter.setLeafSize( mappingCornerLeafSize, mappingCornerLeafSize, mappingCornerLeafSize );
+      downSizeFilter.setInputCloud( transformed );
+      downSizeFilter.filter( *clouds->corner );
+
+      transformed.reset( new pcl::PointCloud<PointType>() );
+      clouds->surf.reset( new pcl::PointCloud<PointType>() );
+      surfCloudKeyFrames.decode( keyInd, trans, *transformed );
+      downSizeFilter.setLeafSize( mappingSurfLeafSize, mappingSurfLeafSize, mappingSurfLeafSize );
+      downSizeFilter.setInputCloud( transformed );
+      downSizeFilter.filter( *clouds->surf );
+    }
 
-  laserCloudSurfLastDS->clear();
-  downSizeFilterSurf.setInputCloud( laserCloudSurfLast );
-  downSizeFilterSurf.filter( *laserCloudSurfLastDS );
-  laserCloudSurfLastDSNum = laserCloudSurfLastDS->size();
+    // the points are tagged with the keyframe so they can be replaced after a pose correction
+    maps.corner->AddPoints( clouds->corner->points, keyInd, iVoxCornerLabel );
+    maps.surf->AddPoints( clouds->surf->points, keyInd, iVoxSurfLabel );
+  } );
+  iVoxKeyFramePoses[ keyInd ] = pose;
 }
 
-void MapOptimization::scan2MapOptimization()
+void MapOptimization::updateIVoxWindow()
 {
-  if ( cloudKeyPoses3D->points.empty() )
+  // the maps get the same centers as iVoxWindow, so they sweep exactly when it moves
+  IVoxType::PtType center( transformTobeMapped[ 3 ], transformTobeMapped[ 4 ], transformTobeMapped[ 5 ] );
+  if ( !iVoxWindow.Update( center ) )
   {
     return;
   }
 
-  firstScanFlag = false;
-
-  if ( laserCloudCornerLastDSNum > edgeFeatureMinValidNum && laserCloudSurfLastDSNum > surfFeatureMinValidNum )
+  // keyframes that left the window are forgotten with their remaining points, a revisit adds them again
+  std::set<uint32_t> outKeyFrames;
+  for ( auto it = iVoxKeyFramePoses.begin(); it != iVoxKeyFramePoses.end(); )
   {
-    kdtreeCornerFromMap->setInputCloud( laserCloudCornerFromMapDS );
-    kdtreeSurfFromMap->setInputCloud( laserCloudSurfFromMapDS );
-
-    for ( int iterCount = 0; iterCount < 30; iterCount++ )
+    const PointType& keyPose = cloudKeyPoses3D->points[ it->first ];
+    if ( !iVoxWindow.Contains( IVoxType::PtType( keyPose.x, keyPose.y, keyPose.z ) ) )
     {
-      laserCloudOri->clear();
-      coeffSel->clear();
-
-      // faster_lio::Timer::Evaluate( [ &, this ]() { cornerOptimization(); }, "cornerOptimization" );
-      // faster_lio::Timer::Evaluate( [ &, this ]() { surfOptimization(); }, "surfOptimization" );
-      // faster_lio::Timer::Evaluate( [ &, this ]() { combineOptimizationCoeffs(); }, "combineOptimizationCoeffs" );
-
-      cornerOptimization();
-      surfOptimization();
-      combineOptimizationCoeffs();
-
-      if ( LMOptimization( iterCount ) == true )
+      outKeyFrames.insert( it->first );
+      it = iVoxKeyFramePoses.erase( it );
+    }
+    else
+    {
+      ++it;
+    }
+  }
+  iVoxBuffer->apply( [ center, outKeyFrames ]( IVoxMaps& maps ) {
+    auto isOut = [ &outKeyFrames ]( const uint32_t tag ) { return outKeyFrames.count( tag ) > 0; };
+    maps.forEach( [ & ]( IVoxType& map ) {
+      map.UpdateWindow( center );
+      if ( !outKeyFrames.empty() )
       {
-        break;
+        map.RemovePoints( isOut );
       }
-    }
+    } );
+  } );
+
+  // counts of the published maps, behind by the pending updates with iVoxAsyncUpdate
+  ROS_DEBUG( "iVox window: corner voxels %zu, surf voxels %zu, window evicted voxels %zu, forgotten keyframes %zu",
+             iVoxCornerMap->NumValidGrids(), iVoxSurfMap->NumValidGrids(),
+             iVoxCornerMap->GetStats().window_evicted_grids_ + ( iVoxSharedMap ? 0 : iVoxSurfMap->GetStats().window_evicted_grids_ ),
+             outKeyFrames.size() );
+}
 
-    transformUpdate();
+void MapOptimization::queueStaleIVoxKeyFrames()
+{
+  std::vector<std::pair<float, int>> stale;  // distance to the latest keyframe, keyframe
+  for ( const auto& it : iVoxKeyFramePoses )
+  {
+    const PointTypePose& inserted = it.second;
+
+    Eigen::Affine3f delta = pclPointToAffine3f( inserted ).inverse() * keyPoseTransforms[ it.first ];
+    float           angle = Eigen::AngleAxisf( delta.rotation() ).angle();
+    if ( delta.translation().norm() > iVoxCorrectDistThreshold || std::abs( angle ) > iVoxCorrectAngleThreshold )
+    {
+      stale.emplace_back( pointDistance( cloudKeyPoses3D->points[ it.first ], cloudKeyPoses3D->back() ), it.first );
+    }
   }
-  else
+
+  // the keyframes close to the robot matter most for the next scans
+  std::sort( stale.begin(), stale.end() );
+  iVoxStaleKeyFrames.clear();
+  for ( const auto& it : stale )
   {
-    ROS_WARN( "Not enough features! Only %d edge and %d planar features available.", laserCloudCornerLastDSNum, laserCloudSurfLastDSNum );
+    iVoxStaleKeyFrames.push_back( it.second );
   }
 }
 
-
-void MapOptimization::scan2MapOptimizationIVox()
+void MapOptimization::reinsertStaleIVoxKeyFrames()
 {
-  if ( cloudKeyPoses3D->points.empty() )
+  if ( iVoxStaleKeyFrames.empty() )
   {
     return;
   }
 
-  if ( laserCloudCornerLastDSNum > edgeFeatureMinValidNum && laserCloudSurfLastDSNum > surfFeatureMinValidNum )
+  std::set<uint32_t> batch;
+  while ( !iVoxStaleKeyFrames.empty() && (int)batch.size() < iVoxCorrectKeyFramesPerScan )
   {
-    for ( int iterCount = 0; iterCount < 30; iterCount++ )
+    if ( iVoxKeyFramePoses.count( iVoxStaleKeyFrames.front() ) > 0 )
     {
-      laserCloudOri->clear();
-      coeffSel->clear();
-
-      // faster_lio::Timer::Evaluate( [ &, this ]() { cornerOptimizationIVox(); }, "cornerOptimizationIVox" );
-      // faster_lio::Timer::Evaluate( [ &, this ]() { surfOptimizationIVox(); }, "surfOptimizationIVox" );
-      // faster_lio::Timer::Evaluate( [ &, this ]() { combineOptimizationCoeffs(); }, "combineOptimizationCoeffs" );
-      cornerOptimizationIVox();
-      surfOptimizationIVox();
-      combineOptimizationCoeffs();
-
-      if ( LMOptimization( iterCount ) == true )
-      {
-        break;
-      }
+      batch.insert( iVoxStaleKeyFrames.front() );
     }
-
-    transformUpdate();
+    iVoxStaleKeyFrames.pop_front();
   }
-  else
+
+  iVoxBuffer->apply( [ batch ]( IVoxMaps& maps ) {
+    auto inBatch = [ &batch ]( const uint32_t tag ) { return batch.count( tag ) > 0; };
+    maps.forEach( [ &inBatch ]( IVoxType& map ) { map.RemovePoints( inBatch ); } );
+  } );
+  for ( const uint32_t keyInd : batch )
   {
-    ROS_WARN( "Not enough features! Only %d edge and %d planar features available.", laserCloudCornerLastDSNum, laserCloudSurfLastDSNum );
+    addKeyFrameToIVox( keyInd );
   }
 }
 
-void MapOptimization::updatePointAssociateToMap()
-{
-  transPointAssociateToMap = trans2Affine3f( transformTobeMapped );
-}
-
-void MapOptimization::cornerOptimization()
+void MapOptimization::extractCloudForIkdTree( pcl::PointCloud<PointType>::Ptr cloudToExtract )
 {
-  updatePointAssociateToMap();
+  const Eigen::Vector3f halfSize = Eigen::Vector3f::Constant( ikdTreeMapSize / 2 );
 
-#pragma omp parallel for num_threads( numberOfCores )
-  for ( int i = 0; i < laserCloudCornerLastDSNum; i++ )
+  std::vector<int> newKeyFrames;
+  for ( int i = 0; i < (int)cloudToExtract->size(); ++i )
   {
-    PointType          pointOri, pointSel, coeff;
-    std::vector<int>   pointSearchInd;
-    std::vector<float> pointSearchSqDis;
+    if ( pointDistance( cloudToExtract->points[ i ], cloudKeyPoses3D->back() ) > surroundingKeyframeSearchRadius )
+    {
+      continue;
+    }
+
+    // keyframes out of the map cube would be deleted when it moves
+    Eigen::Vector3f keyPose = cloudToExtract->points[ i ].getVector3fMap();
+    if ( ( ( keyPose - ikdMapCenter ).cwiseAbs().array() > halfSize.array() ).any() )
+    {
+      continue;
+    }
+
+    int thisKeyInd = (int)cloudToExtract->points[ i ].intensity;
+    if ( ikdKeyFrames.count( thisKeyInd ) == 0 )
+    {
+      newKeyFrames.push_back( thisKeyInd );
+    }
+  }
+  if ( newKeyFrames.empty() )
+  {
+    return;
+  }
+
+  if ( ikdSurfMap.Size() > 0 )
+  {
+    for ( const int keyInd : newKeyFrames )
+    {
+      addKeyFrameToIkdTree( keyInd );
+    }
+    return;
+  }
+
+  // an empty map (after a correction) is built at once from the fused keyframes, as extractCloud does
+  laserCloudCornerFromMap->clear();
+  laserCloudSurfFromMap->clear();
+  for ( const int keyInd : newKeyFrames )
+  {
+    cornerCloudKeyFrames.decode( keyInd, keyPoseTransforms[ keyInd ], *laserCloudCornerFromMap );
+    surfCloudKeyFrames.decode( keyInd, keyPoseTransforms[ keyInd ], *laserCloudSurfFromMap );
+    ikdKeyFrames.insert( keyInd );
+  }
+  pcl::PointCloud<PointType> cloudDS;
+  downSizeFilterCorner.setInputCloud( laserCloudCornerFromMap );
+  downSizeFilterCorner.filter( cloudDS );
+  ikdCornerMap.Build( cloudDS.points );
+  downSizeFilterSurf.setInputCloud( laserCloudSurfFromMap );
+  downSizeFilterSurf.filter( cloudDS );
+  ikdSurfMap.Build( cloudDS.points );
+  laserCloudCornerFromMap->clear();
+  laserCloudSurfFromMap->clear();
+}
+
+void MapOptimization::addKeyFrameToIkdTree( int keyInd )
+{
+  // a point is dropped if the map already has one in its leaf cube, which keeps the density of the voxel filter
+  pcl::PointCloud<PointType> cloud;
+  cornerCloudKeyFrames.decode( keyInd, keyPoseTransforms[ keyInd ], cloud );
+  ikdCornerMap.AddPoints( cloud.points, mappingCornerLeafSize );
+  cloud.clear();
+  surfCloudKeyFrames.decode( keyInd, keyPoseTransforms[ keyInd ], cloud );
+  ikdSurfMap.AddPoints( cloud.points, mappingSurfLeafSize );
+  ikdKeyFrames.insert( keyInd );
+}
+
+void MapOptimization::updateIkdTreeMapBox()
+{
+  // the maps keep a cube of side ikdTreeMapSize around the robot. It is moved onto the robot once the robot strayed a
+  // quarter side from its center, everything out of the new cube is box-deleted
+  Eigen::Vector3f position( transformTobeMapped[ 3 ], transformTobeMapped[ 4 ], transformTobeMapped[ 5 ] );
+  Eigen::Vector3f halfSize = Eigen::Vector3f::Constant( ikdTreeMapSize / 2 );
+  if ( ikdMapInit && ( ( position - ikdMapCenter ).cwiseAbs().array() < halfSize.array() / 2 ).all() )
+  {
+    return;
+  }
+  ikdMapCenter = position;
+  if ( !ikdMapInit )
+  {
+    ikdMapInit = true;
+    return;
+  }
+
+  // the outside of the cube as 6 half spaces
+  const Eigen::Vector3f lowest  = Eigen::Vector3f::Constant( std::numeric_limits<float>::lowest() );
+  const Eigen::Vector3f highest = Eigen::Vector3f::Constant( std::numeric_limits<float>::max() );
+  std::size_t           deleted = 0;
+  for ( int axis = 0; axis < 3; ++axis )
+  {
+    Eigen::Vector3f belowMax = highest;
+    Eigen::Vector3f aboveMin = lowest;
+    belowMax[ axis ]         = ikdMapCenter[ axis ] - halfSize[ axis ];
+    aboveMin[ axis ]         = ikdMapCenter[ axis ] + halfSize[ axis ];
+    deleted += ikdCornerMap.DeleteBox( lowest, belowMax ) + ikdSurfMap.DeleteBox( lowest, belowMax );
+    deleted += ikdCornerMap.DeleteBox( aboveMin, highest ) + ikdSurfMap.DeleteBox( aboveMin, highest );
+  }
+
+  // the delete left the points of the keyframes posed outside the cube that still fall inside it. Such a keyframe leaves
+  // ikdKeyFrames, so extractCloudForIkdTree inserts it again once the cube covers its pose, and the leaf size check of
+  // AddPoints skips the points still there. After a correction the trees are cleared instead and rebuilt at once
+  for ( auto it = ikdKeyFrames.begin(); it != ikdKeyFrames.end(); )
+  {
+    Eigen::Vector3f keyPose = cloudKeyPoses3D->points[ *it ].getVector3fMap();
+    if ( ( ( keyPose - ikdMapCenter ).cwiseAbs().array() > halfSize.array() ).any() )
+    {
+      it = ikdKeyFrames.erase( it );
+    }
+    else
+    {
+      ++it;
+    }
+  }
+
+  ROS_DEBUG( "ikd-tree map moved: corner points %zu, surf points %zu, deleted points %zu, keyframes %zu",
+             ikdCornerMap.Size(), ikdSurfMap.Size(), deleted, ikdKeyFrames.size() );
+}
+
+void MapOptimization::extractSurroundingKeyFrames()
+{
+  if ( cloudKeyPoses3D->points.empty() )
+  {
+    return;
+  }
+  // if ( loopClosureEnableFlag == true )
+  // {
+  //   extractForLoopClosure();
+  // }
+  // else
+  // {
+  //   extractNearby();
+  // }
+
+  if ( useIVox )
+  {
+    // the updates of the previous scans become visible to scan-to-map, see iVoxAsyncUpdate
+    if ( iVoxBuffer->publish() )
+    {
+      iVoxCornerMap = iVoxBuffer->front().corner;
+      iVoxSurfMap   = iVoxBuffer->front().surf;
+    }
+
+    // a loop/gps correction moved the keyframes, only the ones moved noticeably are re-inserted, a few per scan
+    if ( needCorrectFlag )
+    {
+      queueStaleIVoxKeyFrames();
+      needCorrectFlag = false;
+      iVoxExtractFlag = true;
+    }
+    reinsertStaleIVoxKeyFrames();
+    updateIVoxWindow();
+
+    // new keyframes are pushed into ivox by saveKeyFramesAndFactor, the surrounding keyframes only need to be
+    // searched again once the robot moved far enough for old keyframes to come into range
+    if ( !iVoxExtractFlag && pointDistance( cloudKeyPoses3D->back(), lastIVoxExtractPose ) < iVoxExtractDistThreshold )
+    {
+      return;
+    }
+    lastIVoxExtractPose = cloudKeyPoses3D->back();
+    iVoxExtractFlag     = false;
+  }
+  else if ( useIkdTree )
+  {
+    // a loop/gps correction moved the keyframes, the maps are built again from the corrected poses
+    if ( needCorrectFlag )
+    {
+      ikdCornerMap.Clear();
+      ikdSurfMap.Clear();
+      ikdKeyFrames.clear();
+      needCorrectFlag = false;
+    }
+    updateIkdTreeMapBox();
+  }
+
+  extractNearby();
+}
+
+void MapOptimization::downsampleCurrentScan()
+{
+  // Downsample cloud from current scan
+  laserCloudCornerLastDS->clear();
+  downSizeFilterCorner.setInputCloud( laserCloudCornerLast );
+  downSizeFilterCorner.filter( *laserCloudCornerLastDS );
+  laserCloudCornerLastDSNum = laserCloudCornerLastDS->size();
+
+  laserCloudSurfLastDS->clear();
+  downSizeFilterSurf.setInputCloud( laserCloudSurfLast );
+  downSizeFilterSurf.filter( *laserCloudSurfLastDS );
+  laserCloudSurfLastDSNum = laserCloudSurfLastDS->size();
+}
+
+void MapOptimization::scan2MapOptimization()
+{
+  if ( cloudKeyPoses3D->points.empty() )
+  {
+    return;
+  }
+
+  firstScanFlag = false;
+
+  if ( laserCloudCornerLastDSNum > edgeFeatureMinValidNum && laserCloudSurfLastDSNum > surfFeatureMinValidNum )
+  {
+    // the ikd-trees are updated in place by extractSurroundingKeyFrames
+    if ( !useIkdTree )
+    {
+      kdtreeCornerFromMap->setInputCloud( laserCloudCornerFromMapDS );
+      kdtreeSurfFromMap->setInputCloud( laserCloudSurfFromMapDS );
+    }
+
+    // every feature takes part until the first iteration selects a budgeted subset
+    std::fill( laserCloudCornerSelectFlag.begin(), laserCloudCornerSelectFlag.end(), true );
+    std::fill( laserCloudSurfSelectFlag.begin(), laserCloudSurfSelectFlag.end(), true );
+
+    for ( int iterCount = 0; iterCount < 30; iterCount++ )
+    {
+      laserCloudOri->clear();
+      coeffSel->clear();
+
+      // faster_lio::Timer::Evaluate( [ &, this ]() { cornerOptimization(); }, "cornerOptimization" );
+      // faster_lio::Timer::Evaluate( [ &, this ]() { surfOptimization(); }, "surfOptimization" );
+      // faster_lio::Timer::Evaluate( [ &, this ]() { combineOptimizationCoeffs(); }, "combineOptimizationCoeffs" );
+
+      cornerOptimization();
+      surfOptimization();
+      combineOptimizationCoeffs();
+
+      if ( LMOptimization( iterCount ) == true )
+      {
+        break;
+      }
+    }
+
+    transformUpdate();
+  }
+  else
+  {
+    ROS_WARN( "Not enough features! Only %d edge and %d planar features available.", laserCloudCornerLastDSNum, laserCloudSurfLastDSNum );
+  }
+}
+
+
+void MapOptimization::scan2MapOptimizationIVox()
+{
+  if ( cloudKeyPoses3D->points.empty() )
+  {
+    return;
+  }
+
+  if ( laserCloudCornerLastDSNum > edgeFeatureMinValidNum && laserCloudSurfLastDSNum > surfFeatureMinValidNum )
+  {
+    // every feature takes part until the first iteration selects a budgeted subset
+    std::fill( laserCloudCornerSelectFlag.begin(), laserCloudCornerSelectFlag.end(), true );
+    std::fill( laserCloudSurfSelectFlag.begin(), laserCloudSurfSelectFlag.end(), true );
+
+    // the features move little between the iterations, their knn search order is kept until the next scan
+    iVoxCornerQuery.order.clear();
+    iVoxSurfQuery.order.clear();
+
+    for ( int iterCount = 0; iterCount < 30; iterCount++ )
+    {
+      laserCloudOri->clear();
+      coeffSel->clear();
+
+      // faster_lio::Timer::Evaluate( [ &, this ]() { cornerOptimizationIVox(); }, "cornerOptimizationIVox" );
+      // faster_lio::Timer::Evaluate( [ &, this ]() { surfOptimizationIVox(); }, "surfOptimizationIVox" );
+      // faster_lio::Timer::Evaluate( [ &, this ]() { combineOptimizationCoeffs(); }, "combineOptimizationCoeffs" );
+      cornerOptimizationIVox();
+      surfOptimizationIVox();
+      combineOptimizationCoeffs();
+
+      if ( LMOptimization( iterCount ) == true )
+      {
+        break;
+      }
+    }
+
+    transformUpdate();
+  }
+  else
+  {
+    ROS_WARN( "Not enough features! Only %d edge and %d planar features available.", laserCloudCornerLastDSNum, laserCloudSurfLastDSNum );
+  }
+}
+
+void MapOptimization::searchNearestIVox( IVoxType& iVoxMap, int label, const pcl::PointCloud<PointType>::Ptr& cloud, int cloudNum,
+                                         const std::vector<bool>& selectFlag, IVoxBatchQuery& query )
+{
+  query.points.clear();
+  query.index.clear();
+  for ( int i = 0; i < cloudNum; i++ )
+  {
+    if ( selectFlag[ i ] )
+    {
+      PointType pointSel;
+      pointAssociateToMap( &cloud->points[ i ], &pointSel );
+      query.points.push_back( pointSel );
+      query.index.push_back( i );
+    }
+  }
+
+  if ( !useIVoxFit )
+  {
+    // the closest 5 map points of every feature, visited in voxel order
+    iVoxMap.GetClosestPoints( query.points, query.nearest, query.numFound, query.order, 5, (double)neighborSearchRadius, label );
+  }
+}
+
+void MapOptimization::updatePointAssociateToMap()
+{
+  transPointAssociateToMap = trans2Affine3f( transformTobeMapped );
+}
+
+void MapOptimization::cornerOptimization()
+{
+  updatePointAssociateToMap();
+
+#pragma omp parallel for num_threads( numberOfCores )
+  for ( int i = 0; i < laserCloudCornerLastDSNum; i++ )
+  {
+    if ( laserCloudCornerSelectFlag[ i ] == false )
+    {
+      continue;
+    }
+
+    PointType          pointOri, pointSel, coeff;
+    std::vector<int>   pointSearchInd;
+    std::vector<float> pointSearchSqDis;
+    PointVector        pointSearch;  // the closest map points
 
     pointOri = laserCloudCornerLastDS->points[ i ];
     pointAssociateToMap( &pointOri, &pointSel );
 
-    kdtreeCornerFromMap->nearestKSearch( pointSel, 5, pointSearchInd, pointSearchSqDis );
+    if ( useIkdTree )
+    {
+      ikdCornerMap.NearestSearch( pointSel, 5, pointSearch, pointSearchSqDis );
+    }
+    else
+    {
+      kdtreeCornerFromMap->nearestKSearch( pointSel, 5, pointSearchInd, pointSearchSqDis );
+      for ( const int ind : pointSearchInd )
+      {
+        pointSearch.push_back( laserCloudCornerFromMapDS->points[ ind ] );
+      }
+    }
 
     cv::Mat matA1( 3, 3, CV_32F, cv::Scalar::all( 0 ) );
     cv::Mat matD1( 1, 3, CV_32F, cv::Scalar::all( 0 ) );
     cv::Mat matV1( 3, 3, CV_32F, cv::Scalar::all( 0 ) );
 
-    if ( pointSearchSqDis[ 4 ] < 1.0 )
+    if ( pointSearchSqDis.size() == 5 && pointSearchSqDis[ 4 ] < 1.0 )
     {
       float cx = 0, cy = 0, cz = 0;
       for ( int j = 0; j < 5; j++ )
       {
-        cx += laserCloudCornerFromMapDS->points[ pointSearchInd[ j ] ].x;
-        cy += laserCloudCornerFromMapDS->points[ pointSearchInd[ j ] ].y;
-        cz += laserCloudCornerFromMapDS->points[ pointSearchInd[ j ] ].z;
+        cx += pointSearch[ j ].x;
+        cy += pointSearch[ j ].y;
+        cz += pointSearch[ j ].z;
       }
       cx /= 5;
       cy /= 5;
@@ -1193,9 +1801,9 @@ void MapOptimization::cornerOptimization()
       float a11 = 0, a12 = 0, a13 = 0, a22 = 0, a23 = 0, a33 = 0;
       for ( int j = 0; j < 5; j++ )
       {
-        float ax = laserCloudCornerFromMapDS->points[ pointSearchInd[ j ] ].x - cx;
-        float ay = laserCloudCornerFromMapDS->points[ pointSearchInd[ j ] ].y - cy;
-        float az = laserCloudCornerFromMapDS->points[ pointSearchInd[ j ] ].z - cz;
+        float ax = pointSearch[ j ].x - cx;
+        float ay = pointSearch[ j ].y - cy;
+        float az = pointSearch[ j ].z - cz;
 
         a11 += ax * ax;
         a12 += ax * ay;
@@ -1269,145 +1877,173 @@ void MapOptimization::cornerOptimization()
  * @brief MapOptimization::surfOptimization
  * @details 优化surf点，并计算每个点的最近邻点。但是有个问题，在这里计算最近邻点的话，
  * updatePointAssociateToMap()计算的位姿并不是当前帧最终的位姿
-*/
-void MapOptimization::cornerOptimizationIVox()
-{
-  updatePointAssociateToMap();
-
-#pragma omp parallel for num_threads( numberOfCores )
-  for ( int i = 0; i < laserCloudCornerLastDSNum; i++ )
-  {
-    PointType pointOri, pointSel, coeff;
-
-    // 更新当前帧的每一个点的最近邻点
-    // auto& pointSearchIndiVox = nearestCornerPoints[ i ];
-    PointVector pointSearchIndiVox;
-
-    pointOri = laserCloudCornerLastDS->points[ i ];
-    pointAssociateToMap( &pointOri, &pointSel );
-
-    // find the closest 5 points to form a plane
-    iVoxCornerMap->GetClosestPoint( pointSel, pointSearchIndiVox, 5, (double)neighborSearchRadius );
-
-    // if the the most far point's distance is less than 1.0m, then all points is less than 1.0m
-    if ( pointSearchIndiVox.size() == 5 )
-    {
-      // calculate the covariance matrix of these 5 closest points
-      cv::Mat matA1( 3, 3, CV_32F, cv::Scalar::all( 0 ) );
-      cv::Mat matD1( 1, 3, CV_32F, cv::Scalar::all( 0 ) );
-      cv::Mat matV1( 3, 3, CV_32F, cv::Scalar::all( 0 ) );
-
-      float cx = 0, cy = 0, cz = 0;
-
-      // calculate the center point of these 5 closest points
-      for ( int j = 0; j < 5; j++ )
-      {
-        cx += pointSearchIndiVox[ j ].x;
-        cy += pointSearchIndiVox[ j ].y;
-        cz += pointSearchIndiVox[ j ].z;
-      }
-      cx /= 5;
-      cy /= 5;
-      cz /= 5;
-
-      // calculate the covariance matrix
-      float a11 = 0, a12 = 0, a13 = 0, a22 = 0, a23 = 0, a33 = 0;
-      for ( int j = 0; j < 5; j++ )
-      {
-        float ax = pointSearchIndiVox[ j ].x - cx;
-        float ay = pointSearchIndiVox[ j ].y - cy;
-        float az = pointSearchIndiVox[ j ].z - cz;
-
-        a11 += ax * ax;
-        a12 += ax * ay;
-        a13 += ax * az;
-
-        a22 += ay * ay;
-        a23 += ay * az;
-
-        a33 += az * az;
-      }
-      a11 /= 5;
-      a12 /= 5;
-      a13 /= 5;
-
-      a22 /= 5;
-      a23 /= 5;
-
-      a33 /= 5;
-
-      matA1.at<float>( 0, 0 ) = a11;
-      matA1.at<float>( 0, 1 ) = a12;
-      matA1.at<float>( 0, 2 ) = a13;
-      matA1.at<float>( 1, 0 ) = a12;
-      matA1.at<float>( 1, 1 ) = a22;
-      matA1.at<float>( 1, 2 ) = a23;
-      matA1.at<float>( 2, 0 ) = a13;
-      matA1.at<float>( 2, 1 ) = a23;
-      matA1.at<float>( 2, 2 ) = a33;
-
-      // calculate the eigenvalue and eigenvector
-      cv::eigen( matA1, matD1, matV1 );
-
-      // if the bigest eigenvalue is more than 3 times of the second bigest eigenvalue
-      // then the line, which is consist of the 5 closest points, is stable
-      if ( matD1.at<float>( 0, 0 ) > 3 * matD1.at<float>( 0, 1 ) )
-      {
-        // origin point
-        float x0 = pointSel.x;
-        float y0 = pointSel.y;
-        float z0 = pointSel.z;
-
-        // the direction of the line
-        float x1 = cx + 0.1 * matV1.at<float>( 0, 0 );
-        float y1 = cy + 0.1 * matV1.at<float>( 0, 1 );
-        float z1 = cz + 0.1 * matV1.at<float>( 0, 2 );
+*/
+void MapOptimization::cornerOptimizationIVox()
+{
+  updatePointAssociateToMap();
+  searchNearestIVox( *iVoxCornerMap, iVoxCornerLabel, laserCloudCornerLastDS, laserCloudCornerLastDSNum, laserCloudCornerSelectFlag, iVoxCornerQuery );
 
-        // the other direction of the line
-        float x2 = cx - 0.1 * matV1.at<float>( 0, 0 );
-        float y2 = cy - 0.1 * matV1.at<float>( 0, 1 );
-        float z2 = cz - 0.1 * matV1.at<float>( 0, 2 );
+#pragma omp parallel for num_threads( numberOfCores )
+  for ( int k = 0; k < (int)iVoxCornerQuery.points.size(); k++ )
+  {
+    int       i = iVoxCornerQuery.index[ k ];
+    PointType pointOri, pointSel, coeff;
 
-        // a012 means area_0_1_2, which is the area of the triangle consist of the origin point and the line
-        // but here it is double of the triangle area
-        float a012 = sqrt( ( ( x0 - x1 ) * ( y0 - y2 ) - ( x0 - x2 ) * ( y0 - y1 ) ) * ( ( x0 - x1 ) * ( y0 - y2 ) - ( x0 - x2 ) * ( y0 - y1 ) ) +
-                           ( ( x0 - x1 ) * ( z0 - z2 ) - ( x0 - x2 ) * ( z0 - z1 ) ) * ( ( x0 - x1 ) * ( z0 - z2 ) - ( x0 - x2 ) * ( z0 - z1 ) ) +
-                           ( ( y0 - y1 ) * ( z0 - z2 ) - ( y0 - y2 ) * ( z0 - z1 ) ) * ( ( y0 - y1 ) * ( z0 - z2 ) - ( y0 - y2 ) * ( z0 - z1 ) ) );
+    pointOri = laserCloudCornerLastDS->points[ i ];
+    pointSel = iVoxCornerQuery.points[ k ];
 
-        // l12 means the distance between the two points 1 and 2
-        float l12 = sqrt( ( x1 - x2 ) * ( x1 - x2 ) + ( y1 - y2 ) * ( y1 - y2 ) + ( z1 - z2 ) * ( z1 - z2 ) );
+    // center and direction of the line
+    float cx = 0, cy = 0, cz = 0;
+    float lx = 0, ly = 0, lz = 0;
+    bool  lineValid = false;
 
-        // calculate the direction of the point 0 to l12(line_1_2)
-        float la = ( ( y1 - y2 ) * ( ( x0 - x1 ) * ( y0 - y2 ) - ( x0 - x2 ) * ( y0 - y1 ) ) +
-                     ( z1 - z2 ) * ( ( x0 - x1 ) * ( z0 - z2 ) - ( x0 - x2 ) * ( z0 - z1 ) ) ) /
-                   a012 / l12;
+    if ( useIVoxFit )
+    {
+      // look up the line cached in the voxel instead of fitting the 5 closest points
+      IVoxType::FitType fit;
+      if ( iVoxCornerMap->GetClosestFit( pointSel, fit, 5, neighborSearchRadius, iVoxCornerLabel ) && fit.linearity > iVoxFitMinLinearity )
+      {
+        cx        = fit.centroid.x();
+        cy        = fit.centroid.y();
+        cz        = fit.centroid.z();
+        lx        = fit.direction.x();
+        ly        = fit.direction.y();
+        lz        = fit.direction.z();
+        lineValid = true;
+      }
+    }
+    else
+    {
+      // 更新当前帧的每一个点的最近邻点, searched for the whole scan by searchNearestIVox
+      const PointType* pointSearchIndiVox = &iVoxCornerQuery.nearest[ k * 5 ];
+      int              pointSearchNum     = iVoxCornerQuery.numFound[ k ];
 
-        float lb = -( ( x1 - x2 ) * ( ( x0 - x1 ) * ( y0 - y2 ) - ( x0 - x2 ) * ( y0 - y1 ) ) -
-                      ( z1 - z2 ) * ( ( y0 - y1 ) * ( z0 - z2 ) - ( y0 - y2 ) * ( z0 - z1 ) ) ) /
-                   a012 / l12;
+      // if the the most far point's distance is less than 1.0m, then all points is less than 1.0m
+      if ( pointSearchNum == 5 )
+      {
+        // calculate the covariance matrix of these 5 closest points
+        cv::Mat matA1( 3, 3, CV_32F, cv::Scalar::all( 0 ) );
+        cv::Mat matD1( 1, 3, CV_32F, cv::Scalar::all( 0 ) );
+        cv::Mat matV1( 3, 3, CV_32F, cv::Scalar::all( 0 ) );
 
-        float lc = -( ( x1 - x2 ) * ( ( x0 - x1 ) * ( z0 - z2 ) - ( x0 - x2 ) * ( z0 - z1 ) ) +
-                      ( y1 - y2 ) * ( ( y0 - y1 ) * ( z0 - z2 ) - ( y0 - y2 ) * ( z0 - z1 ) ) ) /
-                   a012 / l12;
+        // calculate the center point of these 5 closest points
+        for ( int j = 0; j < 5; j++ )
+        {
+          cx += pointSearchIndiVox[ j ].x;
+          cy += pointSearchIndiVox[ j ].y;
+          cz += pointSearchIndiVox[ j ].z;
+        }
+        cx /= 5;
+        cy /= 5;
+        cz /= 5;
 
-        float ld2 = a012 / l12;  // the height of the triangle (point 0 to line_1_2)
+        // calculate the covariance matrix
+        float a11 = 0, a12 = 0, a13 = 0, a22 = 0, a23 = 0, a33 = 0;
+        for ( int j = 0; j < 5; j++ )
+        {
+          float ax = pointSearchIndiVox[ j ].x - cx;
+          float ay = pointSearchIndiVox[ j ].y - cy;
+          float az = pointSearchIndiVox[ j ].z - cz;
 
-        // the bigger distance(ld2) is, the smaller the coeff is
-        float s = 1 - 0.9 * fabs( ld2 );
+          a11 += ax * ax;
+          a12 += ax * ay;
+          a13 += ax * az;
 
-        coeff.x         = s * la;
-        coeff.y         = s * lb;
-        coeff.z         = s * lc;
-        coeff.intensity = s * ld2;
+          a22 += ay * ay;
+          a23 += ay * az;
 
-        if ( s > 0.1 )
+          a33 += az * az;
+        }
+        a11 /= 5;
+        a12 /= 5;
+        a13 /= 5;
+
+        a22 /= 5;
+        a23 /= 5;
+
+        a33 /= 5;
+
+        matA1.at<float>( 0, 0 ) = a11;
+        matA1.at<float>( 0, 1 ) = a12;
+        matA1.at<float>( 0, 2 ) = a13;
+        matA1.at<float>( 1, 0 ) = a12;
+        matA1.at<float>( 1, 1 ) = a22;
+        matA1.at<float>( 1, 2 ) = a23;
+        matA1.at<float>( 2, 0 ) = a13;
+        matA1.at<float>( 2, 1 ) = a23;
+        matA1.at<float>( 2, 2 ) = a33;
+
+        // calculate the eigenvalue and eigenvector
+        cv::eigen( matA1, matD1, matV1 );
+
+        // if the bigest eigenvalue is more than 3 times of the second bigest eigenvalue
+        // then the line, which is consist of the 5 closest points, is stable
+        if ( matD1.at<float>( 0, 0 ) > 3 * matD1.at<float>( 0, 1 ) )
         {
-          laserCloudOriCornerVec[ i ]  = pointOri;
-          coeffSelCornerVec[ i ]       = coeff;
-          laserCloudOriCornerFlag[ i ] = true;
+          lx        = matV1.at<float>( 0, 0 );
+          ly        = matV1.at<float>( 0, 1 );
+          lz        = matV1.at<float>( 0, 2 );
+          lineValid = true;
         }
       }
     }
+
+    if ( lineValid )
+    {
+      // origin point
+      float x0 = pointSel.x;
+      float y0 = pointSel.y;
+      float z0 = pointSel.z;
+
+      // the direction of the line
+      float x1 = cx + 0.1 * lx;
+      float y1 = cy + 0.1 * ly;
+      float z1 = cz + 0.1 * lz;
+
+      // the other direction of the line
+      float x2 = cx - 0.1 * lx;
+      float y2 = cy - 0.1 * ly;
+      float z2 = cz - 0.1 * lz;
+
+      // a012 means area_0_1_2, which is the area of the triangle consist of the origin point and the line
+      // but here it is double of the triangle area
+      float a012 = sqrt( ( ( x0 - x1 ) * ( y0 - y2 ) - ( x0 - x2 ) * ( y0 - y1 ) ) * ( ( x0 - x1 ) * ( y0 - y2 ) - ( x0 - x2 ) * ( y0 - y1 ) ) +
+                         ( ( x0 - x1 ) * ( z0 - z2 ) - ( x0 - x2 ) * ( z0 - z1 ) ) * ( ( x0 - x1 ) * ( z0 - z2 ) - ( x0 - x2 ) * ( z0 - z1 ) ) +
+                         ( ( y0 - y1 ) * ( z0 - z2 ) - ( y0 - y2 ) * ( z0 - z1 ) ) * ( ( y0 - y1 ) * ( z0 - z2 ) - ( y0 - y2 ) * ( z0 - z1 ) ) );
+
+      // l12 means the distance between the two points 1 and 2
+      float l12 = sqrt( ( x1 - x2 ) * ( x1 - x2 ) + ( y1 - y2 ) * ( y1 - y2 ) + ( z1 - z2 ) * ( z1 - z2 ) );
+
+      // calculate the direction of the point 0 to l12(line_1_2)
+      float la = ( ( y1 - y2 ) * ( ( x0 - x1 ) * ( y0 - y2 ) - ( x0 - x2 ) * ( y0 - y1 ) ) +
+                   ( z1 - z2 ) * ( ( x0 - x1 ) * ( z0 - z2 ) - ( x0 - x2 ) * ( z0 - z1 ) ) ) /
+                 a012 / l12;
+
+      float lb = -( ( x1 - x2 ) * ( ( x0 - x1 ) * ( y0 - y2 ) - ( x0 - x2 ) * ( y0 - y1 ) ) -
+                    ( z1 - z2 ) * ( ( y0 - y1 ) * ( z0 - z2 ) - ( y0 - y2 ) * ( z0 - z1 ) ) ) /
+                 a012 / l12;
+
+      float lc = -( ( x1 - x2 ) * ( ( x0 - x1 ) * ( z0 - z2 ) - ( x0 - x2 ) * ( z0 - z1 ) ) +
+                    ( y1 - y2 ) * ( ( y0 - y1 ) * ( z0 - z2 ) - ( y0 - y2 ) * ( z0 - z1 ) ) ) /
+                 a012 / l12;
+
+      float ld2 = a012 / l12;  // the height of the triangle (point 0 to line_1_2)
+
+      // the bigger distance(ld2) is, the smaller the coeff is
+      float s = 1 - 0.9 * fabs( ld2 );
+
+      coeff.x         = s * la;
+      coeff.y         = s * lb;
+      coeff.z         = s * lc;
+      coeff.intensity = s * ld2;
+
+      if ( s > 0.1 )
+      {
+        laserCloudOriCornerVec[ i ]  = pointOri;
+        coeffSelCornerVec[ i ]       = coeff;
+        laserCloudOriCornerFlag[ i ] = true;
+      }
+    }
   }
 }
 
@@ -1418,13 +2054,30 @@ void MapOptimization::surfOptimization()
 #pragma omp parallel for num_threads( numberOfCores )
   for ( int i = 0; i < laserCloudSurfLastDSNum; i++ )
   {
+    if ( laserCloudSurfSelectFlag[ i ] == false )
+    {
+      continue;
+    }
+
     PointType          pointOri, pointSel, coeff;
     std::vector<int>   pointSearchInd;
     std::vector<float> pointSearchSqDis;
+    PointVector        pointSearch;  // the closest map points
 
     pointOri = laserCloudSurfLastDS->points[ i ];
     pointAssociateToMap( &pointOri, &pointSel );
-    kdtreeSurfFromMap->nearestKSearch( pointSel, 5, pointSearchInd, pointSearchSqDis );
+    if ( useIkdTree )
+    {
+      ikdSurfMap.NearestSearch( pointSel, 5, pointSearch, pointSearchSqDis );
+    }
+    else
+    {
+      kdtreeSurfFromMap->nearestKSearch( pointSel, 5, pointSearchInd, pointSearchSqDis );
+      for ( const int ind : pointSearchInd )
+      {
+        pointSearch.push_back( laserCloudSurfFromMapDS->points[ ind ] );
+      }
+    }
 
     Eigen::Matrix<float, 5, 3> matA0;
     Eigen::Matrix<float, 5, 1> matB0;
@@ -1434,13 +2087,13 @@ void MapOptimization::surfOptimization()
     matB0.fill( -1 );
     matX0.setZero();
 
-    if ( pointSearchSqDis[ 4 ] < 1.0 )
+    if ( pointSearchSqDis.size() == 5 && pointSearchSqDis[ 4 ] < 1.0 )
     {
       for ( int j = 0; j < 5; j++ )
       {
-        matA0( j, 0 ) = laserCloudSurfFromMapDS->points[ pointSearchInd[ j ] ].x;
-        matA0( j, 1 ) = laserCloudSurfFromMapDS->points[ pointSearchInd[ j ] ].y;
-        matA0( j, 2 ) = laserCloudSurfFromMapDS->points[ pointSearchInd[ j ] ].z;
+        matA0( j, 0 ) = pointSearch[ j ].x;
+        matA0( j, 1 ) = pointSearch[ j ].y;
+        matA0( j, 2 ) = pointSearch[ j ].z;
       }
 
       matX0 = matA0.colPivHouseholderQr().solve( matB0 );
@@ -1459,9 +2112,7 @@ void MapOptimization::surfOptimization()
       bool planeValid = true;
       for ( int j = 0; j < 5; j++ )
       {
-        if ( fabs( pa * laserCloudSurfFromMapDS->points[ pointSearchInd[ j ] ].x +
-                   pb * laserCloudSurfFromMapDS->points[ pointSearchInd[ j ] ].y +
-                   pc * laserCloudSurfFromMapDS->points[ pointSearchInd[ j ] ].z + pd ) > 0.2 )
+        if ( fabs( pa * pointSearch[ j ].x + pb * pointSearch[ j ].y + pc * pointSearch[ j ].z + pd ) > 0.2 )
         {
           planeValid = false;
           break;
@@ -1493,81 +2144,104 @@ void MapOptimization::surfOptimization()
 void MapOptimization::surfOptimizationIVox()
 {
   updatePointAssociateToMap();
+  searchNearestIVox( *iVoxSurfMap, iVoxSurfLabel, laserCloudSurfLastDS, laserCloudSurfLastDSNum, laserCloudSurfSelectFlag, iVoxSurfQuery );
 
 #pragma omp parallel for num_threads( numberOfCores )
-  for ( int i = 0; i < laserCloudSurfLastDSNum; i++ )
+  for ( int k = 0; k < (int)iVoxSurfQuery.points.size(); k++ )
   {
+    int       i = iVoxSurfQuery.index[ k ];
     PointType pointOri, pointSel, coeff;
 
-    // 更新当前帧的每一个点的最近邻点
-    PointVector pointSearchIndiVox;
-
     pointOri = laserCloudSurfLastDS->points[ i ];
-    pointAssociateToMap( &pointOri, &pointSel );
+    pointSel = iVoxSurfQuery.points[ k ];
 
-    iVoxSurfMap->GetClosestPoint( pointSel, pointSearchIndiVox, 5, (double)neighborSearchRadius );
+    // plane: pa * x + pb * y + pc * z + pd = 0
+    float pa = 0, pb = 0, pc = 0, pd = 0;
+    bool  planeValid = false;
 
-    if ( pointSearchIndiVox.size() == 5 )
+    if ( useIVoxFit )
     {
-      Eigen::Matrix<float, 5, 3> matA0;
-      Eigen::Matrix<float, 5, 1> matB0;
-      Eigen::Vector3f            matX0;
-
-      matA0.setZero();
-      matB0.fill( -1 );
-      matX0.setZero();
-
-      for ( int j = 0; j < 5; j++ )
+      // look up the plane cached in the voxel instead of fitting the 5 closest points. The points can not all be checked
+      // against surfDistanceThreshold as there, so twice their standard deviation from the plane has to be within it
+      IVoxType::FitType fit;
+      if ( iVoxSurfMap->GetClosestFit( pointSel, fit, 5, neighborSearchRadius, iVoxSurfLabel ) && fit.planarity > iVoxFitMinPlanarity &&
+           4 * fit.eigen_values( 0 ) < surfDistanceThreshold * surfDistanceThreshold )
       {
-        matA0( j, 0 ) = pointSearchIndiVox[ j ].x;
-        matA0( j, 1 ) = pointSearchIndiVox[ j ].y;
-        matA0( j, 2 ) = pointSearchIndiVox[ j ].z;
+        pa         = fit.normal.x();
+        pb         = fit.normal.y();
+        pc         = fit.normal.z();
+        pd         = -fit.normal.dot( fit.centroid );
+        planeValid = true;
       }
-      matX0 = matA0.colPivHouseholderQr().solve( matB0 );
+    }
+    else
+    {
+      // 更新当前帧的每一个点的最近邻点, searched for the whole scan by searchNearestIVox
+      const PointType* pointSearchIndiVox = &iVoxSurfQuery.nearest[ k * 5 ];
+      int              pointSearchNum     = iVoxSurfQuery.numFound[ k ];
 
-      float pa = matX0( 0, 0 );
-      float pb = matX0( 1, 0 );
-      float pc = matX0( 2, 0 );
-      float pd = 1;
+      if ( pointSearchNum == 5 )
+      {
+        Eigen::Matrix<float, 5, 3> matA0;
+        Eigen::Matrix<float, 5, 1> matB0;
+        Eigen::Vector3f            matX0;
 
-      float ps = sqrt( pa * pa + pb * pb + pc * pc );
-      pa /= ps;
-      pb /= ps;
-      pc /= ps;
-      pd /= ps;
+        matA0.setZero();
+        matB0.fill( -1 );
+        matX0.setZero();
 
-      bool planeValid = true;
-      for ( int j = 0; j < 5; j++ )
-      {
-        // if one point's distance to the plane is bigger than 0.2, then the plane is not good
-        if ( fabs( pa * pointSearchIndiVox[ j ].x + pb * pointSearchIndiVox[ j ].y + pc * pointSearchIndiVox[ j ].z + pd ) > surfDistanceThreshold )
+        for ( int j = 0; j < 5; j++ )
         {
-          planeValid = false;
-          break;
+          matA0( j, 0 ) = pointSearchIndiVox[ j ].x;
+          matA0( j, 1 ) = pointSearchIndiVox[ j ].y;
+          matA0( j, 2 ) = pointSearchIndiVox[ j ].z;
         }
-      }
-
-      if ( planeValid )
-      {
-        // this point's distance to the plane
-        float pd2 = pa * pointSel.x + pb * pointSel.y + pc * pointSel.z + pd;
+        matX0 = matA0.colPivHouseholderQr().solve( matB0 );
 
-        float s = 1 - 0.9 * fabs( pd2 ) / sqrt( sqrt( pointOri.x * pointOri.x + pointOri.y * pointOri.y + pointOri.z * pointOri.z ) );
-        // float s = 1 - 0.9 * fabs( pd2 ) / magicSqrt( magicSqrt( pointOri.x * pointOri.x + pointOri.y * pointOri.y + pointOri.z * pointOri.z ) );
+        pa = matX0( 0, 0 );
+        pb = matX0( 1, 0 );
+        pc = matX0( 2, 0 );
+        pd = 1;
 
-        coeff.x         = s * pa;
-        coeff.y         = s * pb;
-        coeff.z         = s * pc;
-        coeff.intensity = s * pd2;
+        float ps = sqrt( pa * pa + pb * pb + pc * pc );
+        pa /= ps;
+        pb /= ps;
+        pc /= ps;
+        pd /= ps;
 
-        if ( s > 0.1 )
+        planeValid = true;
+        for ( int j = 0; j < 5; j++ )
         {
-          laserCloudOriSurfVec[ i ]  = pointOri;
-          coeffSelSurfVec[ i ]       = coeff;
-          laserCloudOriSurfFlag[ i ] = true;
+          // if one point's distance to the plane is bigger than 0.2, then the plane is not good
+          if ( fabs( pa * pointSearchIndiVox[ j ].x + pb * pointSearchIndiVox[ j ].y + pc * pointSearchIndiVox[ j ].z + pd ) > surfDistanceThreshold )
+          {
+            planeValid = false;
+            break;
+          }
         }
       }
     }
+
+    if ( planeValid )
+    {
+      // this point's distance to the plane
+      float pd2 = pa * pointSel.x + pb * pointSel.y + pc * pointSel.z + pd;
+
+      float s = 1 - 0.9 * fabs( pd2 ) / sqrt( sqrt( pointOri.x * pointOri.x + pointOri.y * pointOri.y + pointOri.z * pointOri.z ) );
+      // float s = 1 - 0.9 * fabs( pd2 ) / magicSqrt( magicSqrt( pointOri.x * pointOri.x + pointOri.y * pointOri.y + pointOri.z * pointOri.z ) );
+
+      coeff.x         = s * pa;
+      coeff.y         = s * pb;
+      coeff.z         = s * pc;
+      coeff.intensity = s * pd2;
+
+      if ( s > 0.1 )
+      {
+        laserCloudOriSurfVec[ i ]  = pointOri;
+        coeffSelSurfVec[ i ]       = coeff;
+        laserCloudOriSurfFlag[ i ] = true;
+      }
+    }
   }
 }
 
@@ -1616,6 +2290,8 @@ void MapOptimization::combineOptimizationCoeffs()
   // }
   // // > [ combineOptimizationCoeffs ] average time usage: 0.0843421 ms , called times: 5322
 
+  laserCloudOriSourceInd.clear();
+
   // combine corner coeffs
   for ( int i = 0; i < laserCloudCornerLastDSNum; ++i )
   {
@@ -1623,6 +2299,7 @@ void MapOptimization::combineOptimizationCoeffs()
     {
       laserCloudOri->emplace_back( laserCloudOriCornerVec[ i ] );
       coeffSel->emplace_back( coeffSelCornerVec[ i ] );
+      laserCloudOriSourceInd.emplace_back( i );
     }
   }
 
@@ -1633,6 +2310,7 @@ void MapOptimization::combineOptimizationCoeffs()
     {
       laserCloudOri->emplace_back( laserCloudOriSurfVec[ i ] );
       coeffSel->emplace_back( coeffSelSurfVec[ i ] );
+      laserCloudOriSourceInd.emplace_back( laserCloudCornerLastDSNum + i );
     }
   }
   // > [ combineOptimizationCoeffs ] average time usage: 0.0960778 ms , called times: 12864
@@ -1642,6 +2320,78 @@ void MapOptimization::combineOptimizationCoeffs()
   std::fill( laserCloudOriSurfFlag.begin(), laserCloudOriSurfFlag.end(), false );
 }
 
+/**
+ * @brief keep at most maxResidualNum residuals which preserve the 6x6 information matrix
+ * @details the rows of matA are the per-residual jacobians of the first iteration. The budget is shared by the
+ * eigen directions of A^T * A, weakest direction first, and each direction greedily takes the residuals that
+ * contribute most along it. Only the selected features are matched in the following iterations.
+ * @return whether residuals were dropped
+ */
+bool MapOptimization::selectObservableFeatures( cv::Mat &matA, cv::Mat &matB )
+{
+  const int rowNum = matA.rows;
+  const int budget = std::max( maxResidualNum, minResidualNum );
+  if ( rowNum <= budget )
+  {
+    return false;
+  }
+
+  Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, 6, Eigen::RowMajor>> jacobians( matA.ptr<float>(), rowNum, 6 );
+  Eigen::SelfAdjointEigenSolver<Eigen::Matrix<float, 6, 6>>                 solver( jacobians.transpose() * jacobians );
+  // information of every residual along every eigen direction, eigen values are in increasing order
+  Eigen::Matrix<float, Eigen::Dynamic, 6> information = ( jacobians * solver.eigenvectors() ).cwiseAbs2();
+
+  std::vector<bool> selected( rowNum, false );
+  std::vector<int>  order( rowNum );
+  int               selectedNum = 0;
+  for ( int k = 0; k < 6; ++k )
+  {
+    int quota = ( budget - selectedNum ) / ( 6 - k );
+    // at most selectedNum of the best residuals are already taken by weaker directions
+    int sortNum = std::min( rowNum, quota + selectedNum );
+    std::iota( order.begin(), order.end(), 0 );
+    std::partial_sort( order.begin(), order.begin() + sortNum, order.end(),
+                       [ &information, k ]( int a, int b ) { return information( a, k ) > information( b, k ); } );
+    for ( int j = 0; j < sortNum && quota > 0; ++j )
+    {
+      if ( selected[ order[ j ] ] == false )
+      {
+        selected[ order[ j ] ] = true;
+        selectedNum++;
+        quota--;
+      }
+    }
+  }
+
+  cv::Mat matASel( selectedNum, 6, CV_32F, cv::Scalar::all( 0 ) );
+  cv::Mat matBSel( selectedNum, 1, CV_32F, cv::Scalar::all( 0 ) );
+  std::fill( laserCloudCornerSelectFlag.begin(), laserCloudCornerSelectFlag.end(), false );
+  std::fill( laserCloudSurfSelectFlag.begin(), laserCloudSurfSelectFlag.end(), false );
+  for ( int i = 0, row = 0; i < rowNum; ++i )
+  {
+    if ( selected[ i ] == false )
+    {
+      continue;
+    }
+    matA.row( i ).copyTo( matASel.row( row ) );
+    matB.row( i ).copyTo( matBSel.row( row ) );
+    row++;
+
+    int sourceInd = laserCloudOriSourceInd[ i ];
+    if ( sourceInd < laserCloudCornerLastDSNum )
+    {
+      laserCloudCornerSelectFlag[ sourceInd ] = true;
+    }
+    else
+    {
+      laserCloudSurfSelectFlag[ sourceInd - laserCloudCornerLastDSNum ] = true;
+    }
+  }
+  matA = matASel;
+  matB = matBSel;
+  return true;
+}
+
 bool MapOptimization::LMOptimization( int iterCount )
 {
   // This optimization is from the original loam_velodyne by Ji Zhang, need to cope with coordinate transformation
@@ -1662,7 +2412,7 @@ bool MapOptimization::LMOptimization( int iterCount )
   float crz = cos( transformTobeMapped[ 0 ] );
 
   int laserCloudSelNum = laserCloudOri->size();
-  if ( laserCloudSelNum < 50 )
+  if ( laserCloudSelNum < minResidualNum )
   {
     return false;
   }
@@ -1705,8 +2455,6 @@ bool MapOptimization::LMOptimization( int iterCount )
 
   cv::transpose( matA, matAt );
   matAtA = matAt * matA;
-  matAtB = matAt * matB;
-  cv::solve( matAtA, matAtB, matX, cv::DECOMP_QR );
 
   if ( iterCount == 0 )
   {
@@ -1735,8 +2483,19 @@ bool MapOptimization::LMOptimization( int iterCount )
       }
     }
     matP = matV.inv() * matV2;
+
+    // observability-driven feature subsampling, the selected features are reused by the following iterations.
+    // It runs after the degeneracy check, which needs the information of all the features for its fixed thresholds
+    if ( maxResidualNum > 0 && selectObservableFeatures( matA, matB ) )
+    {
+      cv::transpose( matA, matAt );
+      matAtA = matAt * matA;
+    }
   }
 
+  matAtB = matAt * matB;
+  cv::solve( matAtA, matAtB, matX, cv::DECOMP_QR );
+
   if ( isDegenerate )
   {
     cv::Mat matX2( 6, 1, CV_32F, cv::Scalar::all( 0 ) );
@@ -1821,7 +2580,7 @@ bool MapOptimization::saveFrame()
     }
   }
 
-  Eigen::Affine3f transStart   = pclPointToAffine3f( cloudKeyPoses6D->back() );
+  Eigen::Affine3f transStart   = keyPoseTransforms.back();
   Eigen::Affine3f transFinal   = pcl::getTransformation( transformTobeMapped[ 3 ], transformTobeMapped[ 4 ], transformTobeMapped[ 5 ],
                                                        transformTobeMapped[ 0 ], transformTobeMapped[ 1 ], transformTobeMapped[ 2 ] );
   Eigen::Affine3f transBetween = transStart.inverse() * transFinal;
@@ -1877,6 +2636,13 @@ void MapOptimization::addGPSFactor()
     }
   }
 
+  // computed only here, with gps data waiting, and not yet there with asyncPoseGraph
+  updatePoseCovariance();
+  if ( poseCovariance.size() == 0 )
+  {
+    return;
+  }
+
   // pose covariance small, no need to correct
   if ( poseCovariance( 3, 3 ) < poseCovThreshold && poseCovariance( 4, 4 ) < poseCovThreshold )
   {
@@ -1946,12 +2712,36 @@ void MapOptimization::addGPSFactor()
       gtsam::GPSFactor                        gps_factor( cloudKeyPoses3D->size(), gtsam::Point3( gps_x, gps_y, gps_z ), gps_noise );
       gtSAMgraph.add( gps_factor );
 
-      aLoopIsClosed = true;
+      aLoopIsClosed  = true;
+      gpsFactorAdded = true;
       break;
     }
   }
 }
 
+void MapOptimization::updatePoseCovariance()
+{
+  // the last keyframe moves little from one keyframe to the next, so does the covariance
+  if ( poseCovarianceTime >= 0 && timeLaserInfoCur - poseCovarianceTime < poseCovarianceInterval )
+  {
+    return;
+  }
+  poseCovarianceTime = timeLaserInfoCur;
+
+  if ( asyncPoseGraph == true )
+  {
+    poseCovarianceWanted = true;
+    return;
+  }
+
+  // the last keyframe is in the root clique of the bayes tree, its marginal needs no elimination of the rest
+#if DEBUG
+  faster_lio::Timer::Evaluate( [ &, this ]() { poseCovariance = isam->marginalCovariance( cloudKeyPoses3D->size() - 1 ); }, "marginalCovariance" );
+#else
+  poseCovariance = isam->marginalCovariance( cloudKeyPoses3D->size() - 1 );
+#endif
+}
+
 void MapOptimization::addLoopFactor()
 {
   if ( loopIndexQueue.empty() )
@@ -1966,6 +2756,8 @@ void MapOptimization::addLoopFactor()
     gtsam::Pose3                            poseBetween  = loopPoseQueue[ i ];
     gtsam::noiseModel::Diagonal::shared_ptr noiseBetween = loopNoiseQueue[ i ];
     gtSAMgraph.add( gtsam::BetweenFactor<gtsam::Pose3>( indexFrom, indexTo, poseBetween, noiseBetween ) );
+    loopFactorSpans.emplace_back( std::min( indexFrom, indexTo ), std::max( indexFrom, indexTo ) );
+    loopFactorFirstKey = std::min( loopFactorFirstKey, loopFactorSpans.back().first );
   }
 
   loopIndexQueue.clear();
@@ -1990,40 +2782,77 @@ void MapOptimization::saveKeyFramesAndFactor()
   // loop factor
   addLoopFactor();
 
-  // std::cout << "****************************************************" << std::endl;
-  // gtSAMgraph.print("GTSAM Graph:\n");
-
-  // update iSAM
-  isam->update( gtSAMgraph, initialEstimate );
-  isam->update();
-
+  // a gps or loop factor shrinks the covariance, the one computed before is of no use
   if ( aLoopIsClosed == true )
   {
-    isam->update();
-    isam->update();
-    isam->update();
-    isam->update();
-    isam->update();
+    poseCovariance.resize( 0, 0 );
+    poseCovarianceTime   = -1;
+    poseCovarianceMinKey = cloudKeyPoses3D->size();
   }
 
-  gtSAMgraph.resize( 0 );
-  initialEstimate.clear();
+  // std::cout << "****************************************************" << std::endl;
+  // gtSAMgraph.print("GTSAM Graph:\n");
 
   //save key poses
   PointType     thisPose3D;
   PointTypePose thisPose6D;
   gtsam::Pose3  latestEstimate;
 
-  isamCurrentEstimate = isam->calculateEstimate();
-  latestEstimate      = isamCurrentEstimate.at<gtsam::Pose3>( isamCurrentEstimate.size() - 1 );
-  // std::cout << "****************************************************" << std::endl;
-  // isamCurrentEstimate.print("Current estimate: ");
+  if ( asyncPoseGraph == true )
+  {
+    // solved in poseGraphThread, the keyframe takes the scan-to-map pose, corrections are applied by correctPoses
+    {
+      std::lock_guard<std::mutex> lock( mtxPoseGraph );
+      poseGraphQueue.push_back( PoseGraphUpdate{ gtSAMgraph, initialEstimate, aLoopIsClosed, poseCovarianceWanted, loopFactorFirstKey } );
+    }
+    poseGraphCondition.notify_one();
+    aLoopIsClosed        = false;
+    poseCovarianceWanted = false;
+    loopFactorFirstKey   = std::numeric_limits<int>::max();
+    latestEstimate       = trans2gtsamPose( transformTobeMapped );
+  }
+  else
+  {
+    // update iSAM
+    isam->update( gtSAMgraph, initialEstimate );
+    isam->update();
+
+    if ( aLoopIsClosed == true )
+    {
+      isam->update();
+      isam->update();
+      isam->update();
+      isam->update();
+      isam->update();
+    }
+
+    isamCurrentEstimate = isam->calculateEstimate();
+    latestEstimate      = isamCurrentEstimate.at<gtsam::Pose3>( isamCurrentEstimate.size() - 1 );
+    correctionFirstKey  = std::min( correctionFirstKey, loopFactorFirstKey );
+    loopFactorFirstKey  = std::numeric_limits<int>::max();
+    // std::cout << "****************************************************" << std::endl;
+    // isamCurrentEstimate.print("Current estimate: ");
+
+    // save updated transform
+    transformTobeMapped[ 0 ] = latestEstimate.rotation().roll();
+    transformTobeMapped[ 1 ] = latestEstimate.rotation().pitch();
+    transformTobeMapped[ 2 ] = latestEstimate.rotation().yaw();
+    transformTobeMapped[ 3 ] = latestEstimate.translation().x();
+    transformTobeMapped[ 4 ] = latestEstimate.translation().y();
+    transformTobeMapped[ 5 ] = latestEstimate.translation().z();
+  }
+
+  gtSAMgraph.resize( 0 );
+  initialEstimate.clear();
 
   thisPose3D.x         = latestEstimate.translation().x();
   thisPose3D.y         = latestEstimate.translation().y();
   thisPose3D.z         = latestEstimate.translation().z();
   thisPose3D.intensity = cloudKeyPoses3D->size();  // this can be used as index
   cloudKeyPoses3D->push_back( thisPose3D );
+  mtxKeyPoseIndex.lock();
+  keyPoseIndex.AddPoints( PointVector{ thisPose3D } );
+  mtxKeyPoseIndex.unlock();
 
   thisPose6D.x         = thisPose3D.x;
   thisPose6D.y         = thisPose3D.y;
@@ -2034,29 +2863,30 @@ void MapOptimization::saveKeyFramesAndFactor()
   thisPose6D.yaw       = latestEstimate.rotation().yaw();
   thisPose6D.time      = timeLaserInfoCur;
   cloudKeyPoses6D->push_back( thisPose6D );
+  keyPoseTransforms.push_back( Eigen::Affine3f( latestEstimate.matrix().cast<float>() ) );
+  keyPoseVersions.push_back( 0 );
+  keyPoseVersionTransforms.push_back( keyPoseTransforms.back() );
 
-  // std::cout << "****************************************************" << std::endl;
-  // std::cout << "Pose covariance:" << std::endl;
-  // std::cout << isam->marginalCovariance(isamCurrentEstimate.size()-1) << std::endl << std::endl;
-  poseCovariance = isam->marginalCovariance( isamCurrentEstimate.size() - 1 );
-
-  // save updated transform
-  transformTobeMapped[ 0 ] = latestEstimate.rotation().roll();
-  transformTobeMapped[ 1 ] = latestEstimate.rotation().pitch();
-  transformTobeMapped[ 2 ] = latestEstimate.rotation().yaw();
-  transformTobeMapped[ 3 ] = latestEstimate.translation().x();
-  transformTobeMapped[ 4 ] = latestEstimate.translation().y();
-  transformTobeMapped[ 5 ] = latestEstimate.translation().z();
+  keyPosesWorking.poses3D.push_back( thisPose3D );
+  keyPosesWorking.poses6D.push_back( thisPose6D );
+  keyPosesWorking.transforms.push_back( keyPoseTransforms.back() );
 
   // save all the received edge and surf points
-  pcl::PointCloud<PointType>::Ptr thisCornerKeyFrame( new pcl::PointCloud<PointType>() );
-  pcl::PointCloud<PointType>::Ptr thisSurfKeyFrame( new pcl::PointCloud<PointType>() );
-  pcl::copyPointCloud( *laserCloudCornerLastDS, *thisCornerKeyFrame );
-  pcl::copyPointCloud( *laserCloudSurfLastDS, *thisSurfKeyFrame );
+  cornerCloudKeyFrames.add( *laserCloudCornerLastDS );
+  surfCloudKeyFrames.add( *laserCloudSurfLastDS );
+
+  // the other threads see the new key frame once its clouds are stored
+  publishKeyPoseSnapshot();
 
-  // save key frame cloud
-  cornerCloudKeyFrames.push_back( thisCornerKeyFrame );
-  surfCloudKeyFrames.push_back( thisSurfKeyFrame );
+  // the new keyframe goes straight into the ivox map instead of waiting for the next surrounding search
+  if ( useIVox )
+  {
+    addKeyFrameToIVox( cloudKeyPoses3D->size() - 1 );
+  }
+  else if ( useIkdTree )
+  {
+    addKeyFrameToIkdTree( cloudKeyPoses3D->size() - 1 );
+  }
 
   // save path for visualization
   updatePath( thisPose6D );
@@ -2069,35 +2899,166 @@ void MapOptimization::correctPoses()
     return;
   }
 
+  if ( asyncPoseGraph == true )
+  {
+    applyPoseGraphResult();
+  }
+
   if ( aLoopIsClosed == true )
   {
-    // clear map cache
-    laserCloudMapContainer.clear();
-    // clear path
-    keyFramePath.poses.clear();
-    // update key poses
+    // Key poses older than the oldest one a loop factor reaches keep their estimate: the newer part of the graph hangs
+    // on them by a single odometry factor and holds only relative factors, which a rigid move of that part satisfies.
+    // An older loop factor across that key pose moves the bound back to its own oldest key pose, and a gps factor
+    // (absolute) anywhere means the whole trajectory is scanned. Each scanned key pose still costs an inverse and an
+    // angle, only the ones the solve really moved are written
     int numPoses = isamCurrentEstimate.size();
-    for ( int i = 0; i < numPoses; ++i )
+    int firstKey = gpsFactorAdded ? 0 : std::min( correctionFirstKey, numPoses );
+    for ( bool extended = true; extended; )
+    {
+      extended = false;
+      for ( const auto& span : loopFactorSpans )
+      {
+        if ( span.first < firstKey && span.second >= firstKey )
+        {
+          firstKey = span.first;
+          extended = true;
+        }
+      }
+    }
+    correctionFirstKey = std::numeric_limits<int>::max();
+
+    PointVector movedFrom;
+    PointVector movedTo;
+    for ( int i = firstKey; i < numPoses; ++i )
     {
-      cloudKeyPoses3D->points[ i ].x = isamCurrentEstimate.at<gtsam::Pose3>( i ).translation().x();
-      cloudKeyPoses3D->points[ i ].y = isamCurrentEstimate.at<gtsam::Pose3>( i ).translation().y();
-      cloudKeyPoses3D->points[ i ].z = isamCurrentEstimate.at<gtsam::Pose3>( i ).translation().z();
+      const gtsam::Pose3&   pose      = isamCurrentEstimate.at<gtsam::Pose3>( i );
+      const Eigen::Affine3f transform = Eigen::Affine3f( pose.matrix().cast<float>() );
+
+      Eigen::Affine3f delta = keyPoseTransforms[ i ].inverse() * transform;
+      float           angle = Eigen::AngleAxisf( delta.linear() ).angle();
+      if ( delta.translation().norm() <= keyPoseCorrectDistThreshold && std::abs( angle ) <= keyPoseCorrectAngleThreshold )
+      {
+        continue;
+      }
+      movedFrom.push_back( cloudKeyPoses3D->points[ i ] );
+
+      const gtsam::Vector3 rpy = pose.rotation().rpy();
+
+      cloudKeyPoses3D->points[ i ].x = transform.translation().x();
+      cloudKeyPoses3D->points[ i ].y = transform.translation().y();
+      cloudKeyPoses3D->points[ i ].z = transform.translation().z();
 
       cloudKeyPoses6D->points[ i ].x     = cloudKeyPoses3D->points[ i ].x;
       cloudKeyPoses6D->points[ i ].y     = cloudKeyPoses3D->points[ i ].y;
       cloudKeyPoses6D->points[ i ].z     = cloudKeyPoses3D->points[ i ].z;
-      cloudKeyPoses6D->points[ i ].roll  = isamCurrentEstimate.at<gtsam::Pose3>( i ).rotation().roll();
-      cloudKeyPoses6D->points[ i ].pitch = isamCurrentEstimate.at<gtsam::Pose3>( i ).rotation().pitch();
-      cloudKeyPoses6D->points[ i ].yaw   = isamCurrentEstimate.at<gtsam::Pose3>( i ).rotation().yaw();
+      cloudKeyPoses6D->points[ i ].roll  = rpy( 0 );
+      cloudKeyPoses6D->points[ i ].pitch = rpy( 1 );
+      cloudKeyPoses6D->points[ i ].yaw   = rpy( 2 );
+      keyPoseTransforms[ i ]             = transform;
+
+      // only the keyframes that really moved are transformed again, the others keep their cached clouds
+      delta = keyPoseVersionTransforms[ i ].inverse() * keyPoseTransforms[ i ];
+      angle = Eigen::AngleAxisf( delta.linear() ).angle();
+      if ( delta.translation().norm() > surroundingKeyframeCacheDistThreshold || std::abs( angle ) > surroundingKeyframeCacheAngleThreshold )
+      {
+        laserCloudMapContainer->erase( KeyFrameCacheKey( i, keyPoseVersions[ i ] ) );
+        keyPoseVersions[ i ]++;
+        keyPoseVersionTransforms[ i ] = keyPoseTransforms[ i ];
+      }
+
+      keyPosesWorking.poses3D.set( i, cloudKeyPoses3D->points[ i ] );
+      keyPosesWorking.poses6D.set( i, cloudKeyPoses6D->points[ i ] );
+      keyPosesWorking.transforms.set( i, keyPoseTransforms[ i ] );
+
+      updatePath( cloudKeyPoses6D->points[ i ], i );
+      movedTo.push_back( cloudKeyPoses3D->points[ i ] );
+    }
+    aLoopIsClosed = false;
 
-      updatePath( cloudKeyPoses6D->points[ i ] );
+    if ( movedTo.empty() )
+    {
+      return;
+    }
+    publishKeyPoseSnapshot();
+
+    mtxKeyPoseIndex.lock();
+    if ( movedTo.size() * 4 > cloudKeyPoses3D->size() )
+    {
+      // one rebuild is cheaper than deleting and re-adding most of the key poses one by one
+      keyPoseIndex.Build( cloudKeyPoses3D->points );
+    }
+    else
+    {
+      const Eigen::Vector3f margin  = Eigen::Vector3f::Constant( 1e-4 );
+      std::size_t           deleted = 0;
+      for ( const PointType& pose : movedFrom )
+      {
+        deleted += keyPoseIndex.DeleteBox( pose.getVector3fMap() - margin, pose.getVector3fMap() + margin );
+      }
+      if ( deleted == movedFrom.size() )
+      {
+        keyPoseIndex.AddPoints( movedTo );
+      }
+      else
+      {
+        // a key pose that stays was within the margin of a moved one
+        keyPoseIndex.Build( cloudKeyPoses3D->points );
+      }
     }
+    mtxKeyPoseIndex.unlock();
     needCorrectFlag = true;
-    aLoopIsClosed   = false;
   }
 }
 
-void MapOptimization::updatePath( const PointTypePose &pose_in )
+void MapOptimization::applyPoseGraphResult()
+{
+  PoseGraphResult result;
+  {
+    std::lock_guard<std::mutex> lock( mtxPoseGraph );
+    if ( poseGraphResultReady == false )
+    {
+      return;
+    }
+    result               = std::move( poseGraphResult );
+    poseGraphResult      = PoseGraphResult();
+    poseGraphResultReady = false;
+  }
+
+  // a covariance solved without the last loop or gps factor may still be on its way, it would undo the reset
+  if ( result.covariance.size() != 0 && result.covarianceKey >= poseCovarianceMinKey )
+  {
+    poseCovariance = result.covariance;
+  }
+  if ( result.correction == false )
+  {
+    // only odometry factors, the solve agrees with the scan-to-map poses the keyframes already have
+    return;
+  }
+
+  // the keyframes added while the graph was solved and the current scan keep their pose relative to the last solved keyframe
+  int             numSolved  = result.estimate.size();
+  Eigen::Affine3f correction = Eigen::Affine3f( result.estimate.at<gtsam::Pose3>( numSolved - 1 ).matrix().cast<float>() ) * keyPoseTransforms[ numSolved - 1 ].inverse();
+
+  isamCurrentEstimate = std::move( result.estimate );
+  for ( int i = numSolved; i < (int)cloudKeyPoses3D->size(); ++i )
+  {
+    isamCurrentEstimate.insert( i, gtsam::Pose3( ( correction * keyPoseTransforms[ i ] ).matrix().cast<double>() ) );
+  }
+
+  Eigen::Affine3f transFinal = correction * trans2Affine3f( transformTobeMapped );
+  pcl::getTranslationAndEulerAngles( transFinal, transformTobeMapped[ 3 ], transformTobeMapped[ 4 ], transformTobeMapped[ 5 ],
+                                     transformTobeMapped[ 0 ], transformTobeMapped[ 1 ], transformTobeMapped[ 2 ] );
+  correctionFirstKey = std::min( correctionFirstKey, result.firstKey );
+  aLoopIsClosed      = true;
+}
+
+void MapOptimization::publishKeyPoseSnapshot()
+{
+  // the copy shares every chunk with the working version, the next write to a chunk copies it
+  std::atomic_store( &keyPosesSnapshot, std::shared_ptr<const KeyPoses>( std::make_shared<KeyPoses>( keyPosesWorking ) ) );
+}
+
+void MapOptimization::updatePath( const PointTypePose &pose_in, int index )
 {
   geometry_msgs::PoseStamped pose_stamped;
   pose_stamped.header.stamp    = ros::Time().fromSec( pose_in.time );
@@ -2114,7 +3075,14 @@ void MapOptimization::updatePath( const PointTypePose &pose_in )
   pose_stamped.pose.orientation.z = q.z();
   pose_stamped.pose.orientation.w = q.w();
 
-  keyFramePath.poses.push_back( pose_stamped );
+  if ( index < 0 )
+  {
+    keyFramePath.poses.push_back( pose_stamped );
+  }
+  else
+  {
+    keyFramePath.poses[ index ] = pose_stamped;
+  }
 }
 
 void MapOptimization::publishOdometry()
@@ -2239,25 +3207,38 @@ void MapOptimization::publishFrames()
   // publish key poses
   publishCloud( pubKeyPoses, cloudKeyPoses3D, timeLaserInfoStamp, odometryFrame );
 
+  // the local map is only kept as a cloud by the kd-tree path, the others build it when somebody listens
+  static int lastSLAMInfoPubSize = -1;
+  bool newSLAMInfo = pubSLAMInfo.getNumSubscribers() != 0 && lastSLAMInfoPubSize != static_cast<int>( cloudKeyPoses3D->size() );
+
+  pcl::PointCloud<PointType>::Ptr localCornerMap = laserCloudCornerFromMapDS;
+  pcl::PointCloud<PointType>::Ptr localSurfMap   = laserCloudSurfFromMapDS;
+  if ( ( useIVox || useIkdTree ) && ( pubRecentKeyFrames.getNumSubscribers() != 0 || newSLAMInfo ) )
+  {
+    localCornerMap.reset( new pcl::PointCloud<PointType>() );
+    localSurfMap.reset( new pcl::PointCloud<PointType>() );
+    extractLocalMap( *localCornerMap, *localSurfMap );
+  }
+
   // Publish surrounding key frames
-  publishCloud( pubRecentKeyFrames, laserCloudSurfFromMapDS, timeLaserInfoStamp, odometryFrame );
+  publishCloud( pubRecentKeyFrames, localSurfMap, timeLaserInfoStamp, odometryFrame );
 
   // publish registered key frame
   if ( pubRecentKeyFrame.getNumSubscribers() != 0 )
   {
     pcl::PointCloud<PointType>::Ptr cloudOut( new pcl::PointCloud<PointType>() );
-    PointTypePose                   thisPose6D = trans2PointTypePose( transformTobeMapped );
-    *cloudOut += *transformPointCloud( laserCloudCornerLastDS, &thisPose6D );
-    *cloudOut += *transformPointCloud( laserCloudSurfLastDS, &thisPose6D );
+    Eigen::Affine3f                 transCur = trans2Affine3f( transformTobeMapped );
+    transformPointCloud( *laserCloudCornerLastDS, transCur, *cloudOut );
+    transformPointCloud( *laserCloudSurfLastDS, transCur, *cloudOut );
     publishCloud( pubRecentKeyFrame, cloudOut, timeLaserInfoStamp, odometryFrame );
   }
   // publish registered high-res raw cloud
   if ( pubCloudRegisteredRaw.getNumSubscribers() != 0 )
   {
+    pcl::PointCloud<PointType>      cloudRaw;
     pcl::PointCloud<PointType>::Ptr cloudOut( new pcl::PointCloud<PointType>() );
-    pcl::fromROSMsg( cloudInfo.cloud_deskewed, *cloudOut );
-    PointTypePose thisPose6D = trans2PointTypePose( transformTobeMapped );
-    *cloudOut                = *transformPointCloud( cloudOut, &thisPose6D );
+    pcl::fromROSMsg( cloudInfo.cloud_deskewed, cloudRaw );
+    transformPointCloud( cloudRaw, trans2Affine3f( transformTobeMapped ), *cloudOut );
     publishCloud( pubCloudRegisteredRaw, cloudOut, timeLaserInfoStamp, odometryFrame );
   }
 
@@ -2271,10 +3252,9 @@ void MapOptimization::publishFrames()
   }
 
   // publish SLAM infomation for 3rd-party usage
-  static int lastSLAMInfoPubSize = -1;
   if ( pubSLAMInfo.getNumSubscribers() != 0 )
   {
-    if ( lastSLAMInfoPubSize != static_cast<int>( cloudKeyPoses3D->size() ) )
+    if ( newSLAMInfo )
     {
       lio_sam::cloud_info slamInfo;
       slamInfo.header.stamp = timeLaserInfoStamp;
@@ -2284,8 +3264,8 @@ void MapOptimization::publishFrames()
       slamInfo.key_frame_cloud = publishCloud( ros::Publisher(), cloudOut, timeLaserInfoStamp, lidarFrame );
       slamInfo.key_frame_poses = publishCloud( ros::Publisher(), cloudKeyPoses6D, timeLaserInfoStamp, odometryFrame );
       pcl::PointCloud<PointType>::Ptr localMapOut( new pcl::PointCloud<PointType>() );
-      *localMapOut += *laserCloudCornerFromMapDS;
-      *localMapOut += *laserCloudSurfFromMapDS;
+      *localMapOut += *localCornerMap;
+      *localMapOut += *localSurfMap;
       slamInfo.key_frame_map = publishCloud( ros::Publisher(), localMapOut, timeLaserInfoStamp, odometryFrame );
       pubSLAMInfo.publish( slamInfo );
       lastSLAMInfoPubSize = cloudKeyPoses6D->size();
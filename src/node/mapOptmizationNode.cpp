@@ -10,11 +10,13 @@ int main( int argc, char** argv )
 
   std::thread loopthread( &lio_sam::MapOptimization::loopClosureThread, &MO );
   std::thread visualizeMapThread( &lio_sam::MapOptimization::visualizeGlobalMapThread, &MO );
+  std::thread poseGraphThread( &lio_sam::MapOptimization::poseGraphThread, &MO );
 
   ros::spin();
 
   loopthread.join();
   visualizeMapThread.join();
+  poseGraphThread.join();
 
   return 0;
 }
@@ -3,5 +3,6 @@
 namespace faster_lio
 {
 std::map<std::string, Timer::TimerRecord> Timer::records_;
+std::mutex                                Timer::mutex_;
 
 }
\ No newline at end of file